@@ -1,4 +1,12 @@
 #include "src/actions.hpp"
+#include "src/async.hpp"
+#include "src/cache.hpp"
+#include "src/compaction.hpp"
+#include "src/epoch.hpp"
+#include "src/hot.hpp"
+#include "src/parallel.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
@@ -8,9 +16,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 #define OP_COUNT 1000000
 #define SIZE 1000
@@ -67,20 +78,349 @@ int main() {
   std::cout << "bench took " << bench_duration << "ns ("
             << bench_duration / OP_COUNT << "ns/op)" << std::endl;
 
+  auto lookup_all = [&](const char* label) {
+    const auto start_lookup = std::chrono::steady_clock::now();
+    start = addr;
+    value = 0;
+    while ((end = strchrnul(start, '\n')) < addr + sb.st_size) {
+      const Nodes::Value* v =
+          Actions::search(root, (uint8_t*)start, end - start);
+      assert(v != nullptr);
+      assert(*v == value);
+      (void)v;
+      value++;
+
+      if (*end == '\n') {
+        start = end + 1;
+      } else {
+        break;
+      }
+    }
+    const auto lookup_duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_lookup)
+            .count();
+    std::cout << label << " lookups took " << lookup_duration << "ns ("
+              << lookup_duration / std::max(value, 1L) << "ns/op)"
+              << std::endl;
+  };
+
+  lookup_all("scattered");
+  Nodes::freeRecursive(Compaction::compactAndSwap(&root));
+  lookup_all("compacted");
+
+  // Sorted keys, inserted one by one then in batches
+  std::vector<std::pair<std::string, Nodes::Value>> sorted;
   start = addr;
   value = 0;
   while ((end = strchrnul(start, '\n')) < addr + sb.st_size) {
-    const Nodes::Value* v = Actions::search(root, (uint8_t*)start, end - start);
-    assert(v != nullptr);
-    assert(*v == value);
-    value++;
-
+    sorted.emplace_back(std::string(start, end - start), value++);
     if (*end == '\n') {
       start = end + 1;
     } else {
       break;
     }
   }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const std::pair<std::string, Nodes::Value>& a,
+                      const std::pair<std::string, Nodes::Value>& b) {
+                     return a.first < b.first;
+                   });
+  std::vector<const uint8_t*> keys;
+  std::vector<size_t> key_lens;
+  std::vector<Nodes::Value> values;
+  for (const auto& entry : sorted) {
+    keys.push_back((const uint8_t*)entry.first.data());
+    key_lens.push_back(entry.first.size());
+    values.push_back(entry.second);
+  }
+
+  auto time_inserts = [&](const char* label, size_t batch_size) {
+    Nodes::Header* tree = Nodes::makeNewRoot();
+    const auto start_insert = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keys.size(); i += batch_size) {
+      size_t n = std::min(batch_size, keys.size() - i);
+      if (batch_size == 1) {
+        Actions::insert(tree, keys[i], key_lens[i], values[i]);
+      } else {
+        Actions::insertBatch(tree, &keys[i], &key_lens[i], &values[i], n);
+      }
+    }
+    const auto insert_duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_insert)
+            .count();
+    std::cout << label << " inserts took " << insert_duration << "ns ("
+              << insert_duration / std::max(keys.size(), (size_t)1)
+              << "ns/op)" << std::endl;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      assert(Actions::search(tree, keys[i], key_lens[i]) != nullptr);
+    }
+    Nodes::freeRecursive(tree);
+  };
+
+  time_inserts("sorted", 1);
+  time_inserts("batched", 4096);
+
+  // Keys sharing a prefix longer than the one stored in a node header
+  {
+    std::vector<std::string> long_keys;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      long_keys.push_back("https://example.com/api/v1/objects/by-name/" +
+                          sorted[(i * 7919) % sorted.size()].first);
+    }
+    Nodes::Header* tree = Nodes::makeNewRoot();
+    auto time_ops = [&](const char* label, bool insert) {
+      const auto start_ops = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < long_keys.size(); ++i) {
+        const uint8_t* key = (const uint8_t*)long_keys[i].data();
+        if (insert) {
+          Actions::insert(tree, key, long_keys[i].size(), i);
+        } else {
+          const Nodes::Value* v =
+              Actions::search(tree, key, long_keys[i].size());
+          assert(v != nullptr);
+          (void)v;
+        }
+      }
+      const auto ops_duration =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_ops)
+              .count();
+      std::cout << label << " took " << ops_duration << "ns ("
+                << ops_duration / std::max(long_keys.size(), (size_t)1)
+                << "ns/op)" << std::endl;
+    };
+    time_ops("long prefix inserts", true);
+    time_ops("long prefix lookups", false);
+    Nodes::freeRecursive(tree);
+  }
+
+  // Memory and lookup time per set of node types, for the words and for keys
+  // made of base 30 digits, so that most nodes have 30 children
+  {
+    std::vector<std::string> fat_keys;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      std::string key;
+      for (size_t digits = i, j = 0; j < 4; ++j, digits /= 30) {
+        key.insert(key.begin(), (char)(1 + digits % 30 * 8));
+      }
+      fat_keys.push_back(key);
+    }
+    std::mt19937 gen(42);
+    std::shuffle(fat_keys.begin(), fat_keys.end(), gen);
+
+    struct Configuration {
+      const char* name;
+      Nodes::TypeSet types;
+    };
+    const Configuration configurations[] = {
+        {"classic", Nodes::CLASSIC_TYPES},
+        {"default", Nodes::DEFAULT_TYPES},
+        {"all", (1u << Nodes::TYPE_COUNT) - 1},
+    };
+    for (const Configuration& configuration : configurations) {
+      Nodes::setNodeTypes(configuration.types);
+      auto time_lookups = [&](const char* label,
+                              const std::vector<std::string>& workload) {
+        Nodes::Header* tree = Nodes::makeNewRoot();
+        for (size_t i = 0; i < workload.size(); ++i) {
+          Actions::insert(tree, (const uint8_t*)workload[i].data(),
+                          workload[i].size(), i);
+        }
+        const auto start_lookup = std::chrono::steady_clock::now();
+        for (const std::string& key : workload) {
+          const Nodes::Value* v =
+              Actions::search(tree, (const uint8_t*)key.data(), key.size());
+          assert(v != nullptr);
+          (void)v;
+        }
+        const auto lookup_duration =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_lookup)
+                .count();
+        Parallel::Stats stats = Parallel::collectStats(tree, 1);
+        std::cout << configuration.name << " " << label << ": "
+                  << stats.memory_bytes << " bytes, lookups took "
+                  << lookup_duration / std::max(workload.size(), (size_t)1)
+                  << "ns/op, nodes";
+        for (size_t i = 0; i < Nodes::TYPE_COUNT; ++i) {
+          if (stats.node_count[i] != 0) {
+            std::cout << " " << Nodes::capacity((Nodes::Type)i) << ":"
+                      << stats.node_count[i];
+          }
+        }
+        std::cout << std::endl;
+        Nodes::freeRecursive(tree);
+      };
+      std::vector<std::string> words;
+      for (const auto& entry : sorted) {
+        words.push_back(entry.first);
+      }
+      std::shuffle(words.begin(), words.end(), gen);
+      time_lookups("words", words);
+      time_lookups("fat nodes", fat_keys);
+    }
+    Nodes::setNodeTypes(Nodes::DEFAULT_TYPES);
+  }
+
+  // Zipfian lookups, on the tree then through a hot key cache
+  {
+    std::mt19937 gen(13);
+    std::vector<double> cdf;
+    double sum = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      sum += 1.0 / (i + 1);
+      cdf.push_back(sum);
+    }
+    // the popular keys are spread over the key space
+    std::vector<size_t> ranks(sorted.size());
+    for (size_t i = 0; i < ranks.size(); ++i) {
+      ranks[i] = i;
+    }
+    std::shuffle(ranks.begin(), ranks.end(), gen);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<const std::string*> queries;
+    for (size_t i = 0; i < OP_COUNT; ++i) {
+      size_t rank =
+          std::lower_bound(cdf.begin(), cdf.end(), uniform(gen)) - cdf.begin();
+      queries.push_back(&sorted[ranks[std::min(rank, ranks.size() - 1)]].first);
+    }
+
+    auto time_zipf = [&](const char* label, Hot::Cache* cache) {
+      size_t found = 0;
+      const auto start_zipf = std::chrono::steady_clock::now();
+      for (const std::string* key : queries) {
+        Nodes::Value v;
+        if (cache != nullptr) {
+          found += cache->search((const uint8_t*)key->data(), key->size(), v);
+        } else {
+          found += Actions::search(root, (const uint8_t*)key->data(),
+                                   key->size()) != nullptr;
+        }
+      }
+      const auto zipf_duration =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_zipf)
+              .count();
+      assert(found == queries.size());
+      (void)found;
+      std::cout << label << " zipfian lookups took "
+                << zipf_duration / OP_COUNT << "ns/op" << std::endl;
+    };
+    time_zipf("tree", nullptr);
+    Hot::Cache cache(root);
+    time_zipf("hot cache", &cache);
+
+    // Writes elsewhere in the tree advance the epoch, which the entries are
+    // only trusted for
+    auto hit_rate = [&](const char* label, bool writing) {
+      std::atomic<bool> reading(true);
+      std::thread writer([&]() {
+        for (long i = 0; writing && reading.load(); ++i) {
+          std::string key = "~written/" + std::to_string(i % 4096);
+          if (i % 8192 < 4096) {
+            Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+          } else {
+            Actions::remove(root, (const uint8_t*)key.data(), key.size());
+          }
+        }
+      });
+      Hot::Cache cache(root);
+      size_t hits = 0;
+      for (const std::string* key : queries) {
+        Nodes::Value v;
+        if (cache.find((const uint8_t*)key->data(), key->size(), v)) {
+          ++hits;
+        } else {
+          cache.search((const uint8_t*)key->data(), key->size(), v);
+        }
+      }
+      reading = false;
+      writer.join();
+      std::cout << "hot cache hit rate " << label << " "
+                << 100 * hits / OP_COUNT << "%" << std::endl;
+    };
+    hit_rate("alone", false);
+    hit_rate("with a writer", true);
+  }
+
+#ifdef CACHE_MODE
+  // Reads of a cache holding about half of the words, while writes evict
+  {
+    Cache::Tree cache(8 << 20);
+    std::mt19937 gen(7);
+    size_t hits = 0;
+    const auto start_cache = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < OP_COUNT; ++i) {
+      // a skewed choice of keys, so that some are hot
+      size_t k = std::min(gen() % sorted.size(), gen() % sorted.size());
+      const std::string& key = sorted[k].first;
+      Nodes::Value v;
+      if (cache.get((const uint8_t*)key.data(), key.size(), v)) {
+        ++hits;
+      } else {
+        cache.put((const uint8_t*)key.data(), key.size(), sorted[k].second);
+      }
+    }
+    const auto cache_duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_cache)
+            .count();
+    std::cout << "cache took " << cache_duration / OP_COUNT << "ns/op, "
+              << hits * 100 / OP_COUNT << "% hits, " << cache.evictions()
+              << " evictions" << std::endl;
+  }
+#endif
+
+#if __cplusplus >= 202002L
+  // The same random lookups one after the other, then interleaved
+  {
+    std::vector<std::string> words;
+    for (const auto& entry : sorted) {
+      words.push_back(entry.first);
+    }
+    std::shuffle(words.begin(), words.end(), std::mt19937(11));
+    auto report = [&](const char* label,
+                      std::chrono::steady_clock::time_point since) {
+      const auto duration =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - since)
+              .count();
+      std::cout << label << " lookups took " << duration / words.size()
+                << "ns/op" << std::endl;
+    };
+
+    auto start_lookups = std::chrono::steady_clock::now();
+    for (const std::string& word : words) {
+      const Nodes::Value* v =
+          Actions::search(root, (const uint8_t*)word.data(), word.size());
+      assert(v != nullptr);
+      (void)v;
+    }
+    report("sequential", start_lookups);
+
+    for (size_t width : {4, 16, 32}) {
+      size_t found = 0;
+      auto count = [](const Async::Result& result, void* arg) {
+        *(size_t*)arg += result.found;
+      };
+      Async::Scheduler scheduler(width);
+      start_lookups = std::chrono::steady_clock::now();
+      for (const std::string& word : words) {
+        Async::Lookup lookup =
+            Async::search(root, (const uint8_t*)word.data(), word.size());
+        while (!scheduler.submit(std::move(lookup), count, &found)) {
+          scheduler.step();
+        }
+      }
+      scheduler.drain();
+      assert(found == words.size());
+      std::string label = "interleaved x" + std::to_string(width);
+      report(label.c_str(), start_lookups);
+    }
+  }
+#endif
 
   munmap(addr, sb.st_size);
 
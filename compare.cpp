@@ -0,0 +1,478 @@
+#include "src/actions.hpp"
+#include "src/epoch.hpp"
+#include "src/tree.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <malloc.h>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Runs the same workloads on the tree, std::map, std::unordered_map and a
+// minimal B+-tree. Built with optimized flags by `make compare`, which runs
+// it from the current directory, where words.txt is expected.
+
+#define SCAN_COUNT 10000
+// Keys visited by each scan
+#define SCAN_LENGTH 100
+
+// Sorted keys in nodes of up to FANOUT entries, leaves linked for scans
+template <typename Key, size_t FANOUT = 32> class BPlusTree {
+public:
+  BPlusTree() : root_(new Leaf()) {}
+  ~BPlusTree() { freeRecursive(root_); }
+
+  BPlusTree(const BPlusTree&) = delete;
+  BPlusTree& operator=(const BPlusTree&) = delete;
+
+  void insert(const Key& key, Nodes::Value value) {
+    Key separator;
+    Node* right = insertInto(root_, key, value, separator);
+    if (right != nullptr) {
+      auto root = new Inner();
+      root->count = 1;
+      root->keys[0] = separator;
+      root->children[0] = root_;
+      root->children[1] = right;
+      root_ = root;
+    }
+  }
+
+  bool find(const Key& key, Nodes::Value& out) const {
+    const Leaf* leaf = findLeaf(key);
+    size_t i = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) -
+               leaf->keys;
+    if (i == leaf->count || leaf->keys[i] != key) {
+      return false;
+    }
+    out = leaf->values[i];
+    return true;
+  }
+
+  // Calls fn(key, value) on up to n keys, from the first one >= key
+  template <typename F> void scan(const Key& key, size_t n, F fn) const {
+    const Leaf* leaf = findLeaf(key);
+    size_t i = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) -
+               leaf->keys;
+    while (leaf != nullptr && n > 0) {
+      for (; i < leaf->count && n > 0; ++i, --n) {
+        fn(leaf->keys[i], leaf->values[i]);
+      }
+      leaf = leaf->next;
+      i = 0;
+    }
+  }
+
+private:
+  // Nodes take one entry more than FANOUT before they are split
+  struct Node {
+    bool is_leaf;
+    size_t count;
+    Key keys[FANOUT + 1];
+  };
+
+  struct Leaf : Node {
+    Leaf() : next(nullptr) {
+      this->is_leaf = true;
+      this->count = 0;
+    }
+    Nodes::Value values[FANOUT + 1];
+    Leaf* next;
+  };
+
+  // children[i] holds the keys below keys[i], the keys equal to a separator
+  // are on its right
+  struct Inner : Node {
+    Inner() {
+      this->is_leaf = false;
+      this->count = 0;
+    }
+    Node* children[FANOUT + 2];
+  };
+
+  const Leaf* findLeaf(const Key& key) const {
+    const Node* node = root_;
+    while (!node->is_leaf) {
+      auto inner = (const Inner*)node;
+      size_t i = std::upper_bound(inner->keys, inner->keys + inner->count,
+                                  key) -
+                 inner->keys;
+      node = inner->children[i];
+    }
+    return (const Leaf*)node;
+  }
+
+  // Returns the new right sibling of node if it was split, separator being
+  // the smallest key below it
+  Node* insertInto(Node* node, const Key& key, Nodes::Value value,
+                   Key& separator) {
+    if (node->is_leaf) {
+      auto leaf = (Leaf*)node;
+      size_t i = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) -
+                 leaf->keys;
+      if (i < leaf->count && leaf->keys[i] == key) {
+        leaf->values[i] = value;
+        return nullptr;
+      }
+      std::move_backward(leaf->keys + i, leaf->keys + leaf->count,
+                         leaf->keys + leaf->count + 1);
+      std::move_backward(leaf->values + i, leaf->values + leaf->count,
+                         leaf->values + leaf->count + 1);
+      leaf->keys[i] = key;
+      leaf->values[i] = value;
+      if (++leaf->count <= FANOUT) {
+        return nullptr;
+      }
+
+      auto right = new Leaf();
+      size_t half = leaf->count / 2;
+      right->count = leaf->count - half;
+      std::move(leaf->keys + half, leaf->keys + leaf->count, right->keys);
+      std::move(leaf->values + half, leaf->values + leaf->count,
+                right->values);
+      leaf->count = half;
+      right->next = leaf->next;
+      leaf->next = right;
+      separator = right->keys[0];
+      return right;
+    }
+
+    auto inner = (Inner*)node;
+    size_t i =
+        std::upper_bound(inner->keys, inner->keys + inner->count, key) -
+        inner->keys;
+    Key child_separator;
+    Node* child =
+        insertInto(inner->children[i], key, value, child_separator);
+    if (child == nullptr) {
+      return nullptr;
+    }
+    std::move_backward(inner->keys + i, inner->keys + inner->count,
+                       inner->keys + inner->count + 1);
+    std::move_backward(inner->children + i + 1,
+                       inner->children + inner->count + 1,
+                       inner->children + inner->count + 2);
+    inner->keys[i] = child_separator;
+    inner->children[i + 1] = child;
+    if (++inner->count <= FANOUT) {
+      return nullptr;
+    }
+
+    // the middle key moves up
+    auto right = new Inner();
+    size_t middle = inner->count / 2;
+    right->count = inner->count - middle - 1;
+    std::move(inner->keys + middle + 1, inner->keys + inner->count,
+              right->keys);
+    std::copy(inner->children + middle + 1,
+              inner->children + inner->count + 1, right->children);
+    separator = inner->keys[middle];
+    inner->count = middle;
+    return right;
+  }
+
+  void freeRecursive(Node* node) {
+    if (node->is_leaf) {
+      delete (Leaf*)node;
+      return;
+    }
+    auto inner = (Inner*)node;
+    for (size_t i = 0; i <= inner->count; ++i) {
+      freeRecursive(inner->children[i]);
+    }
+    delete inner;
+  }
+
+  Node* root_;
+};
+
+// Adapters giving the containers the same interface
+
+template <typename Key> class ArtAdapter {
+public:
+  typedef Typed::KeyCodec<Key> Encoded;
+
+  ArtAdapter() : root_(Nodes::makeNewRoot()) {}
+  ~ArtAdapter() {
+    Epoch::collect();
+    Nodes::freeRecursive(root_);
+  }
+
+  void insert(const Key& key, Nodes::Value value) {
+    Encoded encoded(key);
+    Actions::insert(root_, encoded.data(), encoded.size(), value);
+  }
+
+  bool find(const Key& key, Nodes::Value& out) const {
+    Encoded encoded(key);
+    const Nodes::Value* value =
+        Actions::search(root_, encoded.data(), encoded.size());
+    if (value == nullptr) {
+      return false;
+    }
+    out = *value;
+    return true;
+  }
+
+  // Each key after the first one is found as the successor of the previous.
+  // Keys are copied out, with LEAF_SUFFIXES they are rebuilt in a buffer
+  // which the next query reuses.
+  Nodes::Value scan(const Key& key, size_t n) const {
+    Encoded encoded(key);
+    const uint8_t* out_key;
+    size_t out_len;
+    Nodes::Value value;
+    Nodes::Value sum = 0;
+    std::vector<uint8_t> previous;
+    bool found = Actions::lowerBound(root_, encoded.data(), encoded.size(),
+                                     out_key, out_len, value);
+    for (; found && n > 0; --n) {
+      sum += value;
+      previous.assign(out_key, out_key + out_len);
+      found = Actions::upperBound(root_, previous.data(), previous.size(),
+                                  out_key, out_len, value);
+    }
+    return sum;
+  }
+
+private:
+  Nodes::Header* root_;
+};
+
+template <typename Key> class MapAdapter {
+public:
+  void insert(const Key& key, Nodes::Value value) { map_[key] = value; }
+
+  bool find(const Key& key, Nodes::Value& out) const {
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      return false;
+    }
+    out = it->second;
+    return true;
+  }
+
+  Nodes::Value scan(const Key& key, size_t n) const {
+    Nodes::Value sum = 0;
+    for (auto it = map_.lower_bound(key); it != map_.end() && n > 0;
+         ++it, --n) {
+      sum += it->second;
+    }
+    return sum;
+  }
+
+private:
+  std::map<Key, Nodes::Value> map_;
+};
+
+// Unordered, so it does not take part in the scans
+template <typename Key> class HashAdapter {
+public:
+  void insert(const Key& key, Nodes::Value value) { map_[key] = value; }
+
+  bool find(const Key& key, Nodes::Value& out) const {
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      return false;
+    }
+    out = it->second;
+    return true;
+  }
+
+private:
+  std::unordered_map<Key, Nodes::Value> map_;
+};
+
+template <typename Key> class BPlusTreeAdapter {
+public:
+  void insert(const Key& key, Nodes::Value value) { tree_.insert(key, value); }
+
+  bool find(const Key& key, Nodes::Value& out) const {
+    return tree_.find(key, out);
+  }
+
+  Nodes::Value scan(const Key& key, size_t n) const {
+    Nodes::Value sum = 0;
+    tree_.scan(key, n, [&](const Key&, Nodes::Value value) { sum += value; });
+    return sum;
+  }
+
+private:
+  BPlusTree<Key> tree_;
+};
+
+template <typename Key> struct Workload {
+  std::string name;
+  // In insertion order
+  std::vector<Key> keys;
+  // Keys which are not inserted
+  std::vector<Key> misses;
+};
+
+size_t heapBytes() { return mallinfo2().uordblks; }
+
+template <typename F> double nsPerOp(size_t ops, F fn) {
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  return (double)duration / std::max(ops, (size_t)1);
+}
+
+template <typename Adapter> struct HasScan {
+  template <typename A>
+  static char test(decltype(&A::scan));
+  template <typename A> static long test(...);
+  static const bool value = sizeof(test<Adapter>(nullptr)) == sizeof(char);
+};
+
+template <typename Adapter, typename Key>
+typename std::enable_if<HasScan<Adapter>::value, double>::type
+timeScans(const Adapter& adapter, const std::vector<Key>& starts,
+          Nodes::Value& checksum) {
+  return nsPerOp(starts.size() * SCAN_LENGTH, [&]() {
+    for (const Key& key : starts) {
+      checksum += adapter.scan(key, SCAN_LENGTH);
+    }
+  });
+}
+
+template <typename Adapter, typename Key>
+typename std::enable_if<!HasScan<Adapter>::value, double>::type
+timeScans(const Adapter&, const std::vector<Key>&, Nodes::Value&) {
+  return -1;
+}
+
+template <typename Adapter, typename Key>
+void run(const char* container, const Workload<Key>& workload) {
+  std::vector<Key> lookups = workload.keys;
+  std::vector<Key> scan_starts;
+  std::mt19937 gen(1);
+  std::shuffle(lookups.begin(), lookups.end(), gen);
+  for (size_t i = 0; i < SCAN_COUNT && !lookups.empty(); ++i) {
+    scan_starts.push_back(lookups[gen() % lookups.size()]);
+  }
+
+  Epoch::collect();
+  size_t heap_before = heapBytes();
+  auto adapter = new Adapter();
+  double insert_ns = nsPerOp(workload.keys.size(), [&]() {
+    for (size_t i = 0; i < workload.keys.size(); ++i) {
+      adapter->insert(workload.keys[i], i);
+    }
+  });
+  Epoch::collect();
+  double bytes_per_key = ((double)heapBytes() - heap_before) /
+                         std::max(workload.keys.size(), (size_t)1);
+
+  Nodes::Value checksum = 0;
+  size_t found = 0;
+  double hit_ns = nsPerOp(lookups.size(), [&]() {
+    for (const Key& key : lookups) {
+      Nodes::Value value;
+      if (adapter->find(key, value)) {
+        ++found;
+        checksum += value;
+      }
+    }
+  });
+  double miss_ns = nsPerOp(workload.misses.size(), [&]() {
+    for (const Key& key : workload.misses) {
+      Nodes::Value value;
+      if (adapter->find(key, value)) {
+        ++found;
+      }
+    }
+  });
+  double scan_ns = timeScans(*adapter, scan_starts, checksum);
+  delete adapter;
+
+  if (found != lookups.size()) {
+    std::cerr << container << " found " << found << " of " << lookups.size()
+              << " keys" << std::endl;
+    exit(1);
+  }
+
+  char scan[16] = "-";
+  if (scan_ns >= 0) {
+    snprintf(scan, sizeof(scan), "%.1f", scan_ns);
+  }
+  printf("%-16s %-14s %8.1f %8.1f %8.1f %9s %10.1f   (%ld)\n",
+         workload.name.c_str(), container, insert_ns, hit_ns, miss_ns, scan,
+         bytes_per_key, (long)checksum);
+}
+
+template <typename Key> void runAll(const Workload<Key>& workload) {
+  run<ArtAdapter<Key>>("art", workload);
+  run<MapAdapter<Key>>("std::map", workload);
+  run<HashAdapter<Key>>("unordered_map", workload);
+  run<BPlusTreeAdapter<Key>>("b+tree", workload);
+}
+
+int main() {
+  std::ifstream file("words.txt");
+  if (!file) {
+    perror("words.txt");
+    exit(1);
+  }
+  std::vector<std::string> words;
+  for (std::string word; std::getline(file, word);) {
+    words.push_back(word);
+  }
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+  std::mt19937_64 gen(42);
+  std::shuffle(words.begin(), words.end(), gen);
+  const size_t n = words.size();
+
+  printf("%-16s %-14s %8s %8s %8s %9s %10s\n", "workload", "container",
+         "insert", "hit", "miss", "scan/key", "bytes/key");
+  printf("%-16s %-14s %8s %8s %8s %9s %10s\n", "", "", "(ns)", "(ns)", "(ns)",
+         "(ns)", "");
+
+  {
+    // Half of the words are inserted, the other half are the misses
+    Workload<std::string> workload;
+    workload.name = "words";
+    workload.keys.assign(words.begin(), words.begin() + n / 2);
+    workload.misses.assign(words.begin() + n / 2, words.end());
+    runAll(workload);
+
+    workload.name = "long prefix";
+    for (auto keys : {&workload.keys, &workload.misses}) {
+      for (std::string& key : *keys) {
+        key = "https://example.com/api/v1/objects/by-name/" + key;
+      }
+    }
+    runAll(workload);
+  }
+
+  {
+    Workload<uint64_t> workload;
+    workload.name = "dense u64";
+    for (uint64_t i = 0; i < n; ++i) {
+      workload.keys.push_back(i);
+      workload.misses.push_back(n + i);
+    }
+    std::shuffle(workload.keys.begin(), workload.keys.end(), gen);
+    runAll(workload);
+
+    // Odd keys are inserted, even ones are the misses
+    workload.name = "sparse u64";
+    workload.keys.clear();
+    workload.misses.clear();
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t key = gen();
+      workload.keys.push_back(key | 1);
+      workload.misses.push_back(key & ~(uint64_t)1);
+    }
+    runAll(workload);
+  }
+}
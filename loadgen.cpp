@@ -0,0 +1,122 @@
+#include "src/remote.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Load generator for run_server: loads the keys, then each connection keeps
+// `depth` requests in flight for the given time, e.g.
+//   ./run_loadgen /tmp/art.sock [connections] [depth] [seconds] [keys]
+//                 [get %] [scan %]
+// the other requests being PUTs.
+
+typedef std::chrono::steady_clock Clock;
+
+std::string keyOf(uint64_t i) { return "key:" + std::to_string(i); }
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " socket_path [connections] [depth] [seconds] [keys] "
+                 "[get %] [scan %]"
+              << std::endl;
+    return 1;
+  }
+  const std::string path = argv[1];
+  const size_t connections = argc > 2 ? atoi(argv[2]) : 4;
+  const size_t depth = argc > 3 ? atoi(argv[3]) : 32;
+  const double seconds = argc > 4 ? atof(argv[4]) : 5;
+  const size_t keys = argc > 5 ? atoi(argv[5]) : 1000000;
+  const unsigned get_percent = argc > 6 ? atoi(argv[6]) : 90;
+  const unsigned scan_percent = argc > 7 ? atoi(argv[7]) : 0;
+
+  {
+    Remote::Client client(path);
+    Remote::Client::Response response;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < keys; ++i) {
+      std::string key = keyOf(i);
+      client.put((const uint8_t*)key.data(), key.size(), i);
+      if (client.pending() == 1024) {
+        while (client.pending() > 0) {
+          client.receive(response);
+        }
+      }
+    }
+    while (client.pending() > 0) {
+      client.receive(response);
+    }
+    const double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "loaded " << keys << " keys in " << elapsed << "s ("
+              << (uint64_t)(keys / elapsed) << " puts/s)" << std::endl;
+  }
+
+  std::vector<std::vector<uint32_t>> latencies(connections);
+  std::vector<std::thread> threads;
+  const auto start = Clock::now();
+  const auto stop = start + std::chrono::duration<double>(seconds);
+  for (size_t c = 0; c < connections; ++c) {
+    threads.emplace_back([&, c]() {
+      Remote::Client client(path);
+      Remote::Client::Response response;
+      std::mt19937_64 gen(c);
+      // send times of the requests in flight, in order
+      std::vector<Clock::time_point> sent(depth);
+      size_t next = 0;
+      auto send = [&]() {
+        std::string key = keyOf(gen() % keys);
+        unsigned dice = gen() % 100;
+        if (dice < get_percent) {
+          client.get((const uint8_t*)key.data(), key.size());
+        } else if (dice < get_percent + scan_percent) {
+          client.scan((const uint8_t*)key.data(), key.size(), 16);
+        } else {
+          client.put((const uint8_t*)key.data(), key.size(), gen());
+        }
+        sent[next++ % depth] = Clock::now();
+      };
+      for (size_t i = 0; i < depth; ++i) {
+        send();
+      }
+      for (size_t answered = 0; Clock::now() < stop; ++answered) {
+        client.receive(response);
+        latencies[c].push_back(std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(
+                                   Clock::now() - sent[answered % depth])
+                                   .count());
+        send();
+        client.flush();
+      }
+      while (client.pending() > 0) {
+        client.receive(response);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<uint32_t> all;
+  for (const auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  if (all.empty()) {
+    return 0;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    return all[std::min(all.size() - 1, (size_t)(p * all.size()))] / 1000.0;
+  };
+  std::cout << connections << " connections x " << depth << " in flight: "
+            << (uint64_t)(all.size() / elapsed) << " requests/s, latency us "
+            << "p50 " << percentile(0.5) << " p99 " << percentile(0.99)
+            << " p99.9 " << percentile(0.999) << " max " << percentile(1)
+            << std::endl;
+}
@@ -0,0 +1,30 @@
+#include "src/remote.hpp"
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+
+// Serves an empty tree on the socket until SIGINT or SIGTERM, e.g.
+//   ./run_server /tmp/art.sock [threads]
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " socket_path [threads]"
+              << std::endl;
+    return 1;
+  }
+  // the signals are waited for below, not delivered to the server threads
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  Nodes::Header* root = Nodes::makeNewRoot();
+  {
+    Remote::Server server(root, argv[1], argc > 2 ? atoi(argv[2]) : 0);
+    std::cout << "listening on " << argv[1] << std::endl;
+    int signal;
+    sigwait(&signals, &signal);
+  }
+  Nodes::freeRecursive(root);
+}
@@ -1,100 +1,221 @@
 #include "actions.hpp"
+#include "epoch.hpp"
 #include "lock.hpp"
+#include "snapshot.hpp"
 #include "utils.hpp"
 #include <algorithm>
 #include <cassert>
+#include <vector>
 
 namespace Actions {
 
-// TODO: sync
-void findMinimumKey(const void* node, const uint8_t*& out_key,
-                    size_t& out_len) {
+// Memory unlinked by writers is freed once no reader can reach it, unless it
+// belongs to a compacted block, which goes away with the tree. owner is the
+// node the memory belongs to, nullptr for leaves.
+#ifdef SNAPSHOTS
+void retireMemory(void* memory, const Nodes::Header* owner) {
+  Nodes::disown(memory);
+  Snapshot::retire(memory, free, owner == nullptr ? 0 : owner->generation);
+}
+#else
+void retireMemory(void* memory, const Nodes::Header*) {
+  Nodes::disown(memory);
+  Epoch::retire(memory, free);
+}
+#endif
+
+void retireHeader(Nodes::Header* node_header) {
+  if (!node_header->compacted) {
+    retireMemory(node_header, node_header);
+  }
+}
+
+void retireNode(Nodes::Header* node_header) {
+  if (!node_header->compacted) {
+    if (node_header->prefix_allocated) {
+      retireMemory(node_header->allocated_prefix, node_header);
+    }
+    retireMemory(node_header, node_header);
+  }
+}
+
+void retireLeaf(Nodes::Leaf* leaf) {
+  if (!leaf->compacted) {
+    retireMemory(leaf, nullptr);
+  }
+}
+
+// Queries returning keys collect the key bytes of the path they walk in a
+// buffer of the thread, if any. They are needed with LEAF_SUFFIXES only, the
+// other leaves hold their whole key.
+std::vector<uint8_t>* queryPath() {
+#ifdef LEAF_SUFFIXES
+  static thread_local std::vector<uint8_t> path;
+  path.clear();
+  return &path;
+#else
+  return nullptr;
+#endif
+}
+
+void appendPrefix(std::vector<uint8_t>* path,
+                  const Nodes::Header* node_header) {
+  if (path != nullptr) {
+    const uint8_t* prefix = Nodes::getPrefix(node_header);
+    path->insert(path->end(), prefix, prefix + node_header->prefix_len);
+  }
+}
+
+// Stores the key of the leaf found at the end of the path. The key is rebuilt
+// in the buffer of the path when the leaf only stores a suffix.
+void outputKey(Nodes::Leaf* leaf, std::vector<uint8_t>* path,
+               const uint8_t*& out_key, size_t& out_len) {
+  out_len = leaf->key_len;
+  size_t offset = Nodes::keyOffset(leaf);
+  if (offset == 0) {
+    out_key = Nodes::getKey(leaf);
+    return;
+  }
+  assert(path != nullptr && path->size() >= offset);
+  path->resize(offset);
+  path->insert(path->end(), Nodes::getKey(leaf) + offset,
+               Nodes::getKey(leaf) + leaf->key_len);
+  out_key = path->data();
+}
+
+// Appends the key bytes below node on the way to the leaf to path, if any
+bool findExtremeLeaf(const void* node, bool maximum, bool check_node,
+                     Nodes::Leaf*& out, std::vector<uint8_t>* path = nullptr) {
   while (true) {
     assert(node != nullptr);
     if (Nodes::isLeaf(node)) {
-      auto leaf = Nodes::asLeaf(node);
-      out_key = Nodes::getKey(leaf);
-      out_len = leaf->key_len;
-      return;
+      out = Nodes::asLeaf(node);
+      return true;
     }
 
     auto header = Nodes::asHeader(node);
-    if (header->children_count == 0) {
-      node = Nodes::findChildKeyEnd(header);
-      continue;
+    Nodes::version_t version;
+    if (check_node) {
+      version = Lock::awaitNodeUnlocked(header);
+      if (Lock::isObsolete(version)) {
+        return false;
+      }
     }
 
-    if (header->type == Nodes::Type::NODE4) {
-      auto next = (Nodes::Node4*)header->getNode();
-      node = next->children[0];
-      continue;
+    // The key end child precedes all the other children
+    void* next = *Nodes::findChildKeyEnd(header);
+    appendPrefix(path, header);
+    if (next != nullptr && (!maximum || header->children_count == 0)) {
+      next = Nodes::smuggleLeaf((Nodes::Leaf*)next);
+    } else {
+      uint8_t key_bit;
+      next = maximum ? Nodes::findMaximumChild(header, &key_bit)
+                     : Nodes::findMinimumChild(header, &key_bit);
+      if (path != nullptr) {
+        path->push_back(key_bit);
+      }
     }
-    if (header->type == Nodes::Type::NODE16) {
-      auto next = (Nodes::Node16*)header->getNode();
-      node = next->children[0];
-      continue;
+
+    if (check_node && !Lock::checkVersion(header, version)) {
+      return false;
     }
-    if (header->type == Nodes::Type::NODE48) {
-      auto next = (Nodes::Node48*)header->getNode();
-      node = next->children[next->child_index[header->min_key]];
-      assert(node != nullptr);
-      continue;
+    if (next == nullptr) {
+      // an empty node, we must have seen it while being modified
+      return false;
     }
-    if (header->type == Nodes::Type::NODE256) {
-      auto next = (Nodes::Node256*)header->getNode();
-      node = next->children[header->min_key];
-      assert(node != nullptr);
-      continue;
+
+    node = next;
+    check_node = true;
+  }
+}
+
+void findExtremeKey(const void* node, bool maximum, const uint8_t*& out_key,
+                    size_t& out_len) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+  std::vector<uint8_t>* path = queryPath();
+  Nodes::Leaf* leaf;
+  while (!findExtremeLeaf(node, maximum, false, leaf, path)) {
+    if (path != nullptr) {
+      path->clear();
     }
   }
+  outputKey(leaf, path, out_key, out_len);
+}
+
+void findMinimumKey(const void* node, const uint8_t*& out_key,
+                    size_t& out_len) {
+  findExtremeKey(node, false, out_key, out_len);
+}
+
+void findMaximumKey(const void* node, const uint8_t*& out_key,
+                    size_t& out_len) {
+  findExtremeKey(node, true, out_key, out_len);
 }
 
 // True only if a full match is found
 bool prefixMatches(const Nodes::Header* node_header, KEY, size_t depth,
-                   size_t& first_diff, const uint8_t*& min_key,
-                   size_t& min_key_len) {
-  min_key = nullptr;
+                   size_t& first_diff) {
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  const size_t stop =
+      std::min((size_t)node_header->prefix_len, key_len - depth);
+  size_t i = 0;
+  while (i < stop && key[i + depth] == prefix[i]) {
+    ++i;
+  }
+  first_diff = i;
+  // the new key might be exhausted before the end of the prefix
+  return i == node_header->prefix_len;
+}
 
-  size_t i;
-  {
-    const size_t prefix_len = Nodes::capPrefixSize(node_header->prefix_len);
-    const size_t stop = std::min(prefix_len, key_len - depth);
-    for (i = 0; i < stop; ++i) {
-      if (key[i + depth] != node_header->prefix[i]) {
-        first_diff = i;
-        return false;
-      }
+// Three-way comparison between the key (starting from depth) and the whole
+// prefix of the node. 0 means that the key matches the prefix, otherwise the
+// result tells how the key compares with every key stored below the node.
+int comparePrefix(const Nodes::Header* node_header, KEY, size_t depth) {
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  for (size_t i = 0; i < node_header->prefix_len; ++i) {
+    if (depth + i == key_len) {
+      // the key is a prefix of every key in the subtree
+      return -1;
+    }
+    if (key[depth + i] != prefix[i]) {
+      return key[depth + i] < prefix[i] ? -1 : 1;
     }
   }
-  // no difference found yet
+  return 0;
+}
 
-  first_diff = i;
-  if (i + depth == key_len) {
-    // new key is exhausted
-    return i == node_header->prefix_len;
-  }
-  if (i == node_header->prefix_len) {
-    // node prefix is exhausted
-    return true;
-  }
+// Lexicographic order, a key comes before all its extensions
+bool keyLess(const uint8_t* a, size_t a_len, const uint8_t* b, size_t b_len) {
+  int cmp = memcmp(a, b, std::min(a_len, b_len));
+  return cmp < 0 || (cmp == 0 && a_len < b_len);
+}
 
-  // some stuff is not in the prefix, we need to find a key
-  findMinimumKey(node_header, min_key, min_key_len);
+bool leafMatches(const Nodes::Leaf* leaf, KEY) {
+  size_t offset = Nodes::keyOffset(leaf);
+  return key_len == leaf->key_len &&
+         memcmp(Nodes::getKey((Nodes::Leaf*)leaf) + offset, key + offset,
+                key_len - offset) == 0;
+}
 
-  const size_t stop = std::min(/* should not look farther than the prefix */
-                               (size_t)node_header->prefix_len,
-                               std::min(min_key_len, key_len) - depth);
-  for (; i < stop; ++i) {
-    if (key[i + depth] != min_key[i + depth]) {
-      first_diff = i;
-      return false;
-    }
+// Three-way comparison of the key of a leaf with another key, both sharing
+// their first depth bytes
+int compareLeaf(Nodes::Leaf* leaf, KEY, size_t depth) {
+  size_t leaf_len = leaf->key_len;
+  int cmp = memcmp(Nodes::getKey(leaf) + depth, key + depth,
+                   std::min(leaf_len, key_len) - depth);
+  if (cmp != 0) {
+    return cmp;
   }
-  first_diff = i;
-  return true;
+  return leaf_len < key_len ? -1 : leaf_len > key_len ? 1 : 0;
 }
 
-const Nodes::Value* searchImpl(Nodes::Header* root, KEY) {
+// fn, if any, is called on the leaf before validating the node holding it.
+// The node and its version are returned in holder, if any.
+Nodes::Leaf* searchImpl(Nodes::Header* root, KEY, LeafReadFn fn, void* arg,
+                        Holder* holder = nullptr) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
   Nodes::Header* parent;
   Nodes::Header* node_header;
   size_t depth;
@@ -109,7 +230,7 @@ RESTART_POINT:
   while (true) {
     assert(node_header != nullptr);
     assert(!Nodes::isLeaf(node_header));
-    assert(depth < key_len);
+    assert(depth <= key_len);
 
     READ_LOCK_OR_RESTART(node_header, version)
     if (parent != nullptr) {
@@ -124,10 +245,7 @@ RESTART_POINT:
 
     {
       size_t first_diff;
-      const uint8_t* min_key;
-      size_t min_key_len;
-      bool match = prefixMatches(node_header, KARGS, depth, first_diff, min_key,
-                                 min_key_len);
+      bool match = prefixMatches(node_header, KARGS, depth, first_diff);
       if (!match) {
         READ_UNLOCK_OR_RESTART(node_header, version)
         return nullptr;
@@ -139,50 +257,475 @@ RESTART_POINT:
 
     if (depth == key_len) {
       auto key_end_child = *Nodes::findChildKeyEnd(node_header);
-      if (key_end_child == nullptr) {
-        return nullptr;
+      if (key_end_child != nullptr && fn != nullptr) {
+        fn(key_end_child, arg);
       }
       READ_UNLOCK_OR_RESTART(node_header, version)
-      return &(key_end_child->value);
+      if (holder != nullptr) {
+        *holder = Holder{node_header, version};
+      }
+      return key_end_child;
     }
 
+    // the slot is read once, it may be emptied by a concurrent remove
     void** next_src = Nodes::findChild(node_header, key[depth]);
+    void* next = next_src == nullptr ? nullptr : *next_src;
     CHECK_OR_RESTART(node_header, version)
 
-    if (next_src == nullptr) {
-      READ_UNLOCK_OR_RESTART(node_header, version)
+    if (next == nullptr) {
       return nullptr;
     }
 
-    assert(*next_src != nullptr);
     ++depth;
 
-    if (Nodes::isLeaf(*next_src)) {
-      auto leaf = Nodes::asLeaf(*next_src);
-      bool match =
-          key_len == leaf->key_len && memcmp(Nodes::getKey(leaf), KARGS) == 0;
-      READ_UNLOCK_OR_RESTART(node_header, version)
-      return match ? &leaf->value : nullptr;
-    } else if (depth == key_len) {
-      auto key_end_child =
-          *Nodes::findChildKeyEnd(*((Nodes::Header**)next_src));
-      if (key_end_child == nullptr) {
-        return nullptr;
+    if (Nodes::isLeaf(next)) {
+      auto leaf = Nodes::asLeaf(next);
+      bool match = leafMatches(leaf, KARGS);
+      if (match && fn != nullptr) {
+        fn(leaf, arg);
       }
       READ_UNLOCK_OR_RESTART(node_header, version)
-      return &key_end_child->value;
+      if (holder != nullptr) {
+        *holder = Holder{node_header, version};
+      }
+      return match ? leaf : nullptr;
     }
 
     parent = node_header;
     parent_version = version;
-    node_header = Nodes::asHeader(*next_src);
+    node_header = Nodes::asHeader(next);
   }
 }
 
 const Nodes::Value* search(Nodes::Header* root, KEY) {
-  return searchImpl(root, KARGS);
+  Nodes::Leaf* leaf = searchImpl(root, KARGS, nullptr, nullptr);
+  return leaf == nullptr ? nullptr : &leaf->value;
+}
+
+Nodes::Leaf* searchLeaf(Nodes::Header* root, KEY) {
+  return searchImpl(root, KARGS, nullptr, nullptr);
+}
+
+Nodes::Leaf* searchLeaf(Nodes::Header* root, KEY, Holder& out_holder) {
+  return searchImpl(root, KARGS, nullptr, nullptr, &out_holder);
+}
+
+bool readLeaf(Nodes::Header* root, KEY, LeafReadFn fn, void* arg) {
+  return searchImpl(root, KARGS, fn, arg) != nullptr;
+}
+
+enum class BoundResult { FOUND, NOT_FOUND, RETRY };
+
+// Walks down to the leftmost (rightmost) leaf below the candidate, the key of
+// the node of the candidate matching the first depth bytes of the key.
+// candidate_bit is the key bit of the candidate, -1 for a key end child.
+BoundResult findCandidateLeaf(void* candidate, bool maximum, KEY,
+                              size_t depth, int candidate_bit,
+                              Nodes::Leaf*& out, std::vector<uint8_t>* path) {
+  if (path != nullptr) {
+    path->assign(key, key + depth);
+    if (candidate_bit >= 0) {
+      path->push_back(candidate_bit);
+    }
+  }
+  return findExtremeLeaf(candidate, maximum, true, out, path)
+             ? BoundResult::FOUND
+             : BoundResult::RETRY;
+}
+
+// Smallest key greater than (or equal to, if inclusive) the given one in the
+// subtree of node_header, which starts at depth.
+BoundResult successorImpl(Nodes::Header* node_header, KEY, size_t depth,
+                          bool inclusive, Nodes::Leaf*& out,
+                          std::vector<uint8_t>* path) {
+  Nodes::version_t version = Lock::awaitNodeUnlocked(node_header);
+  if (Lock::isObsolete(version)) {
+    return BoundResult::RETRY;
+  }
+
+  int cmp = comparePrefix(node_header, KARGS, depth);
+  if (cmp != 0) {
+    if (!Lock::checkVersion(node_header, version)) {
+      return BoundResult::RETRY;
+    }
+    if (cmp > 0) {
+      return BoundResult::NOT_FOUND;
+    }
+    // the whole subtree is greater than the key
+    if (path != nullptr) {
+      path->assign(key, key + depth);
+    }
+    return findExtremeLeaf(node_header, false, true, out, path)
+               ? BoundResult::FOUND
+               : BoundResult::RETRY;
+  }
+
+  depth += node_header->prefix_len;
+  void* candidate;
+  uint8_t candidate_bit;
+  bool key_end = false;
+  if (depth == key_len) {
+    Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+    if (inclusive && key_end_child != nullptr) {
+      candidate = Nodes::smuggleLeaf(key_end_child);
+      key_end = true;
+    } else {
+      candidate = Nodes::findMinimumChild(node_header, &candidate_bit);
+    }
+  } else {
+    void** next_src = Nodes::findChild(node_header, key[depth]);
+    void* next = next_src == nullptr ? nullptr : *next_src;
+    if (!Lock::checkVersion(node_header, version)) {
+      return BoundResult::RETRY;
+    }
+
+    candidate = nullptr;
+    if (next != nullptr && Nodes::isLeaf(next)) {
+      int cmp = compareLeaf(Nodes::asLeaf(next), KARGS, depth + 1);
+      if ((inclusive && cmp == 0) || cmp > 0) {
+        candidate = next;
+        candidate_bit = key[depth];
+      }
+    } else if (next != nullptr) {
+      BoundResult result = successorImpl(Nodes::asHeader(next), KARGS,
+                                         depth + 1, inclusive, out, path);
+      if (result != BoundResult::NOT_FOUND) {
+        return result;
+      }
+    }
+
+    if (candidate == nullptr) {
+      // move to the right sibling
+      candidate =
+          Nodes::findChildGreater(node_header, key[depth], &candidate_bit);
+    }
+  }
+
+  if (!Lock::checkVersion(node_header, version)) {
+    return BoundResult::RETRY;
+  }
+  if (candidate == nullptr) {
+    return BoundResult::NOT_FOUND;
+  }
+  return findCandidateLeaf(candidate, false, KARGS, depth,
+                           key_end ? -1 : candidate_bit, out, path);
+}
+
+// Greatest key smaller than (or equal to, if inclusive) the given one in the
+// subtree of node_header, which starts at depth.
+BoundResult predecessorImpl(Nodes::Header* node_header, KEY, size_t depth,
+                            bool inclusive, Nodes::Leaf*& out,
+                            std::vector<uint8_t>* path) {
+  Nodes::version_t version = Lock::awaitNodeUnlocked(node_header);
+  if (Lock::isObsolete(version)) {
+    return BoundResult::RETRY;
+  }
+
+  int cmp = comparePrefix(node_header, KARGS, depth);
+  if (cmp != 0) {
+    if (!Lock::checkVersion(node_header, version)) {
+      return BoundResult::RETRY;
+    }
+    if (cmp < 0) {
+      return BoundResult::NOT_FOUND;
+    }
+    // the whole subtree is smaller than the key
+    if (path != nullptr) {
+      path->assign(key, key + depth);
+    }
+    return findExtremeLeaf(node_header, true, true, out, path)
+               ? BoundResult::FOUND
+               : BoundResult::RETRY;
+  }
+
+  depth += node_header->prefix_len;
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+  void* candidate = nullptr;
+  uint8_t candidate_bit;
+  bool key_end = false;
+  if (depth == key_len) {
+    // every other child is greater than the key
+    if (inclusive && key_end_child != nullptr) {
+      candidate = Nodes::smuggleLeaf(key_end_child);
+      key_end = true;
+    }
+  } else {
+    void** next_src = Nodes::findChild(node_header, key[depth]);
+    void* next = next_src == nullptr ? nullptr : *next_src;
+    if (!Lock::checkVersion(node_header, version)) {
+      return BoundResult::RETRY;
+    }
+
+    if (next != nullptr && Nodes::isLeaf(next)) {
+      int cmp = compareLeaf(Nodes::asLeaf(next), KARGS, depth + 1);
+      if ((inclusive && cmp == 0) || cmp < 0) {
+        candidate = next;
+        candidate_bit = key[depth];
+      }
+    } else if (next != nullptr) {
+      BoundResult result = predecessorImpl(Nodes::asHeader(next), KARGS,
+                                           depth + 1, inclusive, out, path);
+      if (result != BoundResult::NOT_FOUND) {
+        return result;
+      }
+    }
+
+    if (candidate == nullptr) {
+      // move to the left sibling, or to the key end child which precedes
+      // all of them
+      candidate = Nodes::findChildLess(node_header, key[depth], &candidate_bit);
+      if (candidate == nullptr && key_end_child != nullptr) {
+        candidate = Nodes::smuggleLeaf(key_end_child);
+        key_end = true;
+      }
+    }
+  }
+
+  if (!Lock::checkVersion(node_header, version)) {
+    return BoundResult::RETRY;
+  }
+  if (candidate == nullptr) {
+    return BoundResult::NOT_FOUND;
+  }
+  return findCandidateLeaf(candidate, true, KARGS, depth,
+                           key_end ? -1 : candidate_bit, out, path);
 }
 
+bool leafToOutput(BoundResult result, Nodes::Leaf* leaf,
+                  std::vector<uint8_t>* path, const uint8_t*& out_key,
+                  size_t& out_len, Nodes::Value& out_value) {
+  assert(result != BoundResult::RETRY);
+  if (result == BoundResult::NOT_FOUND) {
+    return false;
+  }
+  outputKey(leaf, path, out_key, out_len);
+  out_value = leaf->value;
+  return true;
+}
+
+#define BOUND_QUERY(impl, inclusive)                                           \
+  Epoch::Guard guard;                                                          \
+  Lock::OptimisticReads reads;                                                 \
+  std::vector<uint8_t>* path = queryPath();                                    \
+  Nodes::Leaf* leaf;                                                           \
+  BoundResult result;                                                          \
+  do {                                                                         \
+    result = impl(root, KARGS, 0, inclusive, leaf, path);                      \
+  } while (result == BoundResult::RETRY);                                      \
+  return leafToOutput(result, leaf, path, out_key, out_len, out_value);
+
+bool lowerBound(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                size_t& out_len, Nodes::Value& out_value) {
+  BOUND_QUERY(successorImpl, true)
+}
+
+bool upperBound(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                size_t& out_len, Nodes::Value& out_value) {
+  BOUND_QUERY(successorImpl, false)
+}
+
+bool predecessor(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                 size_t& out_len, Nodes::Value& out_value) {
+  BOUND_QUERY(predecessorImpl, false)
+}
+
+bool floorKey(Nodes::Header* root, KEY, const uint8_t*& out_key,
+              size_t& out_len, Nodes::Value& out_value) {
+  BOUND_QUERY(predecessorImpl, true)
+}
+
+bool minimum(Nodes::Header* root, const uint8_t*& out_key, size_t& out_len,
+             Nodes::Value& out_value) {
+  // the empty key precedes every other key
+  return lowerBound(root, nullptr, 0, out_key, out_len, out_value);
+}
+
+bool maximum(Nodes::Header* root, const uint8_t*& out_key, size_t& out_len,
+             Nodes::Value& out_value) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+  std::vector<uint8_t>* path = queryPath();
+  Nodes::Leaf* leaf;
+  BoundResult result;
+  do {
+    if (path != nullptr) {
+      path->clear();
+    }
+    Nodes::version_t version = Lock::awaitNodeUnlocked(root);
+    bool empty = root->children_count == 0 &&
+                 *Nodes::findChildKeyEnd(root) == nullptr;
+    if (!Lock::checkVersion(root, version)) {
+      result = BoundResult::RETRY;
+    } else if (empty) {
+      result = BoundResult::NOT_FOUND;
+    } else {
+      result = findExtremeLeaf(root, true, true, leaf, path)
+                   ? BoundResult::FOUND
+                   : BoundResult::RETRY;
+    }
+  } while (result == BoundResult::RETRY);
+  return leafToOutput(result, leaf, path, out_key, out_len, out_value);
+}
+
+#ifdef ORDER_STATS
+uint64_t rank(Nodes::Header* root, KEY) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+  Nodes::Header* node_header;
+  size_t depth;
+  uint64_t result;
+  Nodes::version_t version;
+
+RESTART_POINT:
+  node_header = root;
+  depth = 0;
+  result = 0;
+
+  while (true) {
+    READ_LOCK_OR_RESTART(node_header, version)
+
+    int cmp = comparePrefix(node_header, KARGS, depth);
+    if (cmp != 0) {
+      if (cmp > 0) {
+        result += Nodes::subtreeCount(node_header);
+      }
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      return result;
+    }
+
+    depth += node_header->prefix_len;
+    if (depth == key_len) {
+      // only the key end child could be equal, nothing is smaller
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      return result;
+    }
+
+    // Keys below the node, which must add up to its count
+    uint64_t total = 0;
+    if (*Nodes::findChildKeyEnd(node_header) != nullptr) {
+      ++result;
+      ++total;
+    }
+
+    void* next = nullptr;
+    const uint8_t key_bit = key[depth];
+    Nodes::forEachChild(node_header, [&](uint8_t child_bit, void* child) {
+      const uint64_t count = Nodes::subtreeCount(child);
+      total += count;
+      if (child_bit < key_bit) {
+        result += count;
+      } else if (child_bit == key_bit) {
+        next = child;
+      }
+    });
+    CHECK_OR_RESTART(node_header, version)
+    if (total != Nodes::subtreeCount(node_header)) {
+      // a writer is adding to the counts below, see WritePath
+      RESTART
+    }
+
+    if (next == nullptr) {
+      return result;
+    }
+
+    ++depth;
+    if (Nodes::isLeaf(next)) {
+      if (compareLeaf(Nodes::asLeaf(next), KARGS, depth) < 0) {
+        ++result;
+      }
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      return result;
+    }
+
+    node_header = Nodes::asHeader(next);
+  }
+}
+
+bool select(Nodes::Header* root, uint64_t k, const uint8_t*& out_key,
+            size_t& out_len, Nodes::Value& out_value) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+  std::vector<uint8_t>* path = queryPath();
+  Nodes::Header* node_header;
+  uint64_t residual;
+  Nodes::version_t version;
+
+RESTART_POINT:
+  node_header = root;
+  residual = k;
+  if (path != nullptr) {
+    path->clear();
+  }
+
+  while (true) {
+    READ_LOCK_OR_RESTART(node_header, version)
+    appendPrefix(path, node_header);
+
+    // Keys below the node, which must add up to its count
+    uint64_t total = 0;
+    void* next = *Nodes::findChildKeyEnd(node_header);
+    if (next != nullptr) {
+      ++total;
+      if (residual == 0) {
+        next = Nodes::smuggleLeaf((Nodes::Leaf*)next);
+      } else {
+        --residual;
+        next = nullptr;
+      }
+    }
+
+    Nodes::forEachChild(node_header, [&](uint8_t key_bit, void* child) {
+      const uint64_t count = Nodes::subtreeCount(child);
+      total += count;
+      if (next != nullptr) {
+        return;
+      }
+      if (residual < count) {
+        next = child;
+        if (path != nullptr) {
+          path->push_back(key_bit);
+        }
+      } else {
+        residual -= count;
+      }
+    });
+    CHECK_OR_RESTART(node_header, version)
+    if (total != Nodes::subtreeCount(node_header)) {
+      // a writer is adding to the counts below, see WritePath
+      RESTART
+    }
+
+    if (next == nullptr) {
+      if (node_header == root) {
+        return false;
+      }
+      // the count seen from the parent was changed since
+      RESTART
+    }
+
+    if (Nodes::isLeaf(next)) {
+      auto leaf = Nodes::asLeaf(next);
+      outputKey(leaf, path, out_key, out_len);
+      out_value = leaf->value;
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      return true;
+    }
+
+    node_header = Nodes::asHeader(next);
+  }
+}
+
+uint64_t countRange(Nodes::Header* root, const uint8_t* lo, size_t lo_len,
+                    const uint8_t* hi, size_t hi_len) {
+  if (!keyLess(lo, lo_len, hi, hi_len)) {
+    return 0;
+  }
+  uint64_t hi_rank = rank(root, hi, hi_len);
+  uint64_t lo_rank = rank(root, lo, lo_len);
+  return hi_rank > lo_rank ? hi_rank - lo_rank : 0;
+}
+#endif
+
 void insertInOrder(Nodes::Node4* new_node, uint8_t k1, uint8_t k2, void* v1,
                    void* v2) {
   assert(new_node->keys[0] == 0);
@@ -203,79 +746,223 @@ void insertInOrder(Nodes::Node4* new_node, uint8_t k1, uint8_t k2, void* v1,
   }
 }
 
-// Returns the new header
-void* splitLeafPrefix(Nodes::Leaf* old_leaf, KEY, Nodes::Value value,
+// Runs fn on a key which is already in the tree, under the write lock of the
+// node holding its leaf. Stores the leaf fn returns in place of the old one.
+bool updateLeaf(Nodes::Leaf** slot, KEY, size_t depth, LeafUpsertFn fn,
+                void* arg) {
+  Nodes::Leaf* leaf = fn(*slot, KARGS, depth, arg);
+  if (leaf == nullptr) {
+    return false;
+  }
+  *slot = leaf;
+  return true;
+}
+
+bool updateLeaf(void** slot, KEY, size_t depth, LeafUpsertFn fn,
+                void* arg) {
+  Nodes::Leaf* leaf = Nodes::asLeaf(*slot);
+  if (!updateLeaf(&leaf, KARGS, depth, fn, arg)) {
+    return false;
+  }
+  *slot = Nodes::smuggleLeaf(leaf);
+  return true;
+}
+
+// Depth at which the leaf of the key goes when splitLeafPrefix makes the
+// node holding it and old_leaf, both sharing their first depth bytes
+size_t splitDepth(Nodes::Leaf* old_leaf, KEY, size_t depth) {
+  const size_t stop = std::min(key_len, (size_t)old_leaf->key_len);
+  while (depth < stop && key[depth] == Nodes::getKey(old_leaf)[depth]) {
+    ++depth;
+  }
+  return depth == key_len ? depth : depth + 1;
+}
+
+// Returns the new header. The key of new_leaf, which may only store its end,
+// must differ from the one of old_leaf.
+void* splitLeafPrefix(Nodes::Leaf* old_leaf, Nodes::Leaf* new_leaf, KEY,
                       size_t depth) {
   // What is the common key segment?
   size_t i = depth;
-  const size_t stop = std::min(key_len, old_leaf->key_len);
+  const size_t stop = std::min(key_len, (size_t)old_leaf->key_len);
   while (i < stop && key[i] == Nodes::getKey(old_leaf)[i]) {
     ++i;
   }
-  if (i == key_len && key_len == old_leaf->key_len) {
-    old_leaf->value = value;
-    return Nodes::smuggleLeaf(old_leaf);
-  }
+  assert(i < key_len || key_len != old_leaf->key_len);
   assert(i == key_len || i == old_leaf->key_len ||
          key[i] != Nodes::getKey(old_leaf)[i]);
-
   // The new parent of both leaf and the new value
   Nodes::Header* new_node_header =
       Nodes::makeNewNode<Nodes::Type::NODE4, true>();
   Nodes::Node4* new_node = (Nodes::Node4*)new_node_header->getNode();
 
-  new_node_header->prefix_len = i - depth;
-  size_t actual_prefix_size = Nodes::capPrefixSize(new_node_header->prefix_len);
-  new_node_header->prefix = (uint8_t*)malloc(actual_prefix_size);
-  memcpy(new_node_header->prefix, Nodes::getKey(old_leaf) + depth,
-         actual_prefix_size);
+  memcpy(Nodes::initPrefix(new_node_header, i - depth),
+         Nodes::getKey(old_leaf) + depth, i - depth);
 
   if (i == key_len) {
-    Nodes::addChildKeyEnd(new_node_header, KARGS, value);
+    Nodes::addChildKeyEnd(new_node_header, new_leaf);
     Nodes::addChild(new_node_header, Nodes::getKey(old_leaf)[i],
                     Nodes::smuggleLeaf(old_leaf));
-    new_node_header->children_count = 1;
   } else if (i == old_leaf->key_len) {
-    Nodes::addChild(new_node_header, KARGS, value, i);
+    Nodes::addChild(new_node_header, key[i], Nodes::smuggleLeaf(new_leaf));
     Nodes::addChildKeyEnd(new_node_header, old_leaf);
-    new_node_header->children_count = 1;
   } else {
-    Nodes::Leaf* new_leaf = Nodes::makeNewLeaf(KARGS, value);
     insertInOrder(new_node, key[i], Nodes::getKey(old_leaf)[i],
                   Nodes::smuggleLeaf(new_leaf), Nodes::smuggleLeaf(old_leaf));
     new_node_header->children_count = 2;
   }
+#ifdef ORDER_STATS
+  new_node_header->subtree_count = 2;
+#endif
   return new_node_header;
 }
 
-void insertImpl(Nodes::Header* root, KEY, Nodes::Value value) {
+// Ancestors of the node modified by an insert or a remove, with the version
+// they had when the descent went through them. With ORDER_STATS, a write
+// changing the number of keys pins the ancestors it does not write-lock (see
+// pin) before modifying the tree, and adds to their subtree counts once the
+// change is made. The adds are atomic and the ancestors stay unlocked, so
+// writers do not serialize on the root and readers are not restarted. A node
+// whose count is copied waits for its pins to be released (see
+// Nodes::settledSubtreeCount), so no add is lost in the copy.
+struct WritePath {
+#ifdef ORDER_STATS
+  std::vector<std::pair<Nodes::Header*, Nodes::version_t>> nodes;
+  // The nodes pinned by pin
+  std::vector<Nodes::Header*> pinned;
+
+  void clear() {
+    nodes.clear();
+    pinned.clear();
+  }
+  void push(Nodes::Header* node_header, Nodes::version_t version) {
+    nodes.push_back({node_header, version});
+  }
+  // Pins the nodes but the ones the caller holds. Fails, with none of them
+  // left pinned, if one of them changed since it was pushed: it may have been
+  // copied already, or have a new node above it. The caller restarts.
+  bool pin(const Nodes::Header* held = nullptr,
+           const Nodes::Header* other_held = nullptr) {
+    for (const auto& node : nodes) {
+      if (node.first == held || node.first == other_held) {
+        continue;
+      }
+      if (!Lock::checkVersion(node.first, node.second)) {
+        unpin();
+        return false;
+      }
+      Nodes::pinSubtreeCount(node.first);
+      pinned.push_back(node.first);
+      // a node locked before the pin may be copying its count
+      if (!Lock::checkVersion(node.first, node.second)) {
+        unpin();
+        return false;
+      }
+    }
+    return true;
+  }
+  // From the bottom, so that a count never holds a change its children do
+  // not: rank and select restart on a node whose children do not add up
+  void commit(int64_t delta = 1) {
+    for (auto node = nodes.rbegin(); node != nodes.rend(); ++node) {
+      Nodes::addSubtreeCount(node->first, delta);
+    }
+  }
+  void unpin() {
+    for (Nodes::Header* node_header : pinned) {
+      Nodes::unpinSubtreeCount(node_header);
+    }
+    pinned.clear();
+  }
+#else
+  void clear() {}
+  void push(Nodes::Header*, Nodes::version_t) {}
+  bool pin(const Nodes::Header* = nullptr, const Nodes::Header* = nullptr) {
+    return true;
+  }
+  void commit(int64_t = 1) {}
+  void unpin() {}
+#endif
+};
+
+#ifdef SNAPSHOTS
+// Writers copy a node which snapshots may reach before going through it, and
+// restart on the copy. Copies are made from the top, so the parent of a node
+// being copied is never shared.
+#define COPY_IF_SHARED_OR_RESTART(parent, parent_version, node_header,         \
+                                  version, node_header_ptr)                    \
+  if (Snapshot::isShared(node_header)) {                                       \
+    UPGRADE_TO_WRITE_LOCK_OR_RESTART(parent, parent_version)                   \
+    UPGRADE_TO_WRITE_LOCK_OR_RESTART_WITH_LOCKED_NODE(node_header, version,    \
+                                                      parent)                  \
+    *node_header_ptr = Nodes::clone(node_header);                              \
+    Lock::writeUnlockObsolete(node_header);                                    \
+    Lock::writeUnlock(parent);                                                 \
+    retireNode(node_header);                                                   \
+    RESTART                                                                    \
+  }
+#else
+#define COPY_IF_SHARED_OR_RESTART(parent, parent_version, node_header,         \
+                                  version, node_header_ptr)
+#endif
+
+// Modifications of the tree go through here: fn decides the leaf to store
+// while the node which holds (or will hold) it is write-locked.
+bool insertImpl(Nodes::Header* root, KEY, LeafUpsertFn fn, void* arg) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+#ifdef SNAPSHOTS
+  Snapshot::WriteGuard writing;
+#endif
   Nodes::Header** node_header_ptr;
   Nodes::Header* parent;
   size_t depth;
   Nodes::version_t parent_version;
   Nodes::version_t version;
+  Nodes::Leaf* new_leaf;
+  WritePath path;
 
 RESTART_POINT:
   parent = nullptr;
+  path.clear();
 
   READ_LOCK_OR_RESTART(root, version)
   void** next_src = Nodes::findChild(root, key[0]);
+  void* next = next_src == nullptr ? nullptr : *next_src;
   CHECK_OR_RESTART(root, version)
 
-  if (next_src == nullptr || *next_src == nullptr) {
+  if (next == nullptr) {
     assert(!Nodes::isFull(root));
     UPGRADE_TO_WRITE_LOCK_OR_RESTART(root, version)
-    Nodes::addChild(root, KARGS, value, 0);
+    if ((new_leaf = fn(nullptr, KARGS, 1, arg)) == nullptr) {
+      Lock::writeUnlock(root);
+      return false;
+    }
+    Nodes::addChild(root, key[0], Nodes::smuggleLeaf(new_leaf));
+    path.push(root, version);
+    path.commit();
     Lock::writeUnlock(root);
-    return;
+    return true;
   }
 
   depth = 1;
-  if (Nodes::isLeaf(*next_src)) {
+  path.push(root, version);
+  if (Nodes::isLeaf(next)) {
     UPGRADE_TO_WRITE_LOCK_OR_RESTART(root, version)
-    *next_src = splitLeafPrefix(Nodes::asLeaf(*next_src), KARGS, value, depth);
+    bool modified;
+    Nodes::Leaf* leaf = Nodes::asLeaf(next);
+    if (leafMatches(leaf, KARGS)) {
+      modified = updateLeaf(next_src, KARGS, depth, fn, arg);
+    } else if ((new_leaf = fn(nullptr, KARGS, splitDepth(leaf, KARGS, depth),
+                              arg)) != nullptr) {
+      *next_src = splitLeafPrefix(leaf, new_leaf, KARGS, depth);
+      path.commit();
+      modified = true;
+    } else {
+      modified = false;
+    }
     Lock::writeUnlock(root);
-    return;
+    return modified;
   }
 
   parent = root;
@@ -283,24 +970,38 @@ RESTART_POINT:
   node_header_ptr = (Nodes::Header**)next_src;
 
   while (true) {
-    Nodes::Header* node_header = *node_header_ptr;
+    // *node_header_ptr may have changed since the parent was checked, the
+    // parent lock is upgraded before node_header_ptr is written
+    Nodes::Header* node_header = Nodes::asHeader(next);
     READ_LOCK_OR_RESTART(node_header, version)
+    COPY_IF_SHARED_OR_RESTART(parent, parent_version, node_header, version,
+                              node_header_ptr)
 
     assert(node_header_ptr != nullptr);
     assert(node_header != nullptr);
     assert(!Nodes::isLeaf(node_header));
-    assert(depth < key_len);
+    assert(depth <= key_len);
 
     size_t first_diff;
-    const uint8_t* min_key;
-    size_t min_key_len;
-    bool prefix_matches = prefixMatches(node_header, KARGS, depth, first_diff,
-                                        min_key, min_key_len);
+    bool prefix_matches =
+        prefixMatches(node_header, KARGS, depth, first_diff);
     depth += first_diff;
-    if (!prefix_matches && depth < key_len) {
+    if (!prefix_matches) {
       UPGRADE_TO_WRITE_LOCK_OR_RESTART(parent, parent_version)
       UPGRADE_TO_WRITE_LOCK_OR_RESTART_WITH_LOCKED_NODE(node_header, version,
                                                         parent)
+      if (!path.pin(parent)) {
+        Lock::writeUnlock(node_header);
+        Lock::writeUnlock(parent);
+        RESTART
+      }
+      if ((new_leaf = fn(nullptr, KARGS, std::min(depth + 1, key_len),
+                         arg)) == nullptr) {
+        path.unpin();
+        Lock::writeUnlock(node_header);
+        Lock::writeUnlock(parent);
+        return false;
+      }
 
       Nodes::Header* new_node_header =
           Nodes::makeNewNode<Nodes::Type::NODE4, true>();
@@ -308,109 +1009,148 @@ RESTART_POINT:
 
       // handle new prefix: it will contain a prefix of the old prefix, the
       // common section with the new key
-      new_node_header->prefix_len = first_diff;
-      size_t actual_prefix_len =
-          Nodes::capPrefixSize(new_node_header->prefix_len);
-      new_node_header->prefix = (uint8_t*)malloc(actual_prefix_len);
-      memcpy(new_node_header->prefix, node_header->prefix, actual_prefix_len);
+      uint8_t* prefix = Nodes::getPrefix(node_header);
+      memcpy(Nodes::initPrefix(new_node_header, first_diff), prefix,
+             first_diff);
 
       // shorten old prefix: it'll be a suffix of the old prefix.
       // +1 because an element of the prefix (the first diff) will
       // be part of the new parent.
-      Nodes::prefix_size_t old_prefix_len = node_header->prefix_len;
-      node_header->prefix_len -= (1 + new_node_header->prefix_len);
-
-      if (min_key == nullptr) {
-        // How much materialized prefix do we have?
-        Nodes::prefix_size_t residual_prefix =
-            Nodes::capPrefixSize(old_prefix_len) - (first_diff + 1);
-        if (Nodes::capPrefixSize(node_header->prefix_len) > residual_prefix) {
-          findMinimumKey(node_header, min_key, min_key_len);
-        }
-      }
+      node_header->prefix_len -= (1 + first_diff);
+      uint8_t diff_bit = prefix[first_diff];
+      memmove(prefix, prefix + first_diff + 1, node_header->prefix_len);
 
-      uint8_t diff_bit;
-      if (min_key == nullptr) {
-        diff_bit = node_header->prefix[first_diff];
-        memmove(node_header->prefix, node_header->prefix + first_diff + 1,
-                Nodes::capPrefixSize(node_header->prefix_len));
+      if (depth == key_len) {
+        // the new key ends inside the old prefix
+        Nodes::addChild(new_node_header, diff_bit, node_header);
+        Nodes::addChildKeyEnd(new_node_header, new_leaf);
       } else {
-        diff_bit = min_key[depth];
-        memcpy(node_header->prefix, min_key + depth + 1,
-               Nodes::capPrefixSize(node_header->prefix_len));
+        insertInOrder(new_node, key[depth], diff_bit,
+                      Nodes::smuggleLeaf(new_leaf), node_header);
+        new_node_header->children_count = 2;
       }
-
-      Nodes::Leaf* new_leaf = Nodes::makeNewLeaf(KARGS, value);
-      insertInOrder(new_node, key[depth], diff_bit,
-                    Nodes::smuggleLeaf(new_leaf), node_header);
-      new_node_header->children_count = 2;
+#ifdef ORDER_STATS
+      new_node_header->subtree_count =
+          Nodes::settledSubtreeCount(node_header) + 1;
+#endif
       assert(*node_header_ptr != root);
       *node_header_ptr = new_node_header;
+      path.commit();
 
+      path.unpin();
       Lock::writeUnlock(node_header);
       Lock::writeUnlock(parent);
 
-      return;
+      return true;
     }
 
     if (depth == key_len) {
       UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
       READ_UNLOCK_OR_RESTART_WITH_LOCKED_NODE(parent, parent_version,
                                               node_header)
-      Nodes::addChildKeyEnd(node_header, KARGS, value);
+      Nodes::Leaf** key_end_src = Nodes::findChildKeyEnd(node_header);
+      if (*key_end_src != nullptr) {
+        bool modified = updateLeaf(key_end_src, KARGS, depth, fn, arg);
+        Lock::writeUnlock(node_header);
+        return modified;
+      }
+      path.push(node_header, version);
+      if (!path.pin(node_header)) {
+        Lock::writeUnlock(node_header);
+        RESTART
+      }
+      if ((new_leaf = fn(nullptr, KARGS, depth, arg)) != nullptr) {
+        Nodes::addChildKeyEnd(node_header, new_leaf);
+        path.commit();
+      }
+      path.unpin();
       Lock::writeUnlock(node_header);
-      return;
+      return new_leaf != nullptr;
     }
 
     assert(depth < key_len);
     void** next_src = Nodes::findChild(node_header, key[depth]);
+    next = next_src == nullptr ? nullptr : *next_src;
     CHECK_OR_RESTART(node_header, version)
 
-    if (next_src == nullptr || *next_src == nullptr) {
-      if (!Nodes::isFull(node_header) || depth == key_len) {
+    if (next == nullptr) {
+      if (!Nodes::isFull(node_header)) {
         UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
         READ_UNLOCK_OR_RESTART_WITH_LOCKED_NODE(parent, parent_version,
                                                 node_header)
-        if (depth < key_len) {
-          Nodes::addChild(*node_header_ptr, KARGS, value, depth);
-        } else {
-          Nodes::addChildKeyEnd(node_header, KARGS, value);
+        path.push(node_header, version);
+        if (!path.pin(node_header)) {
+          Lock::writeUnlock(node_header);
+          RESTART
+        }
+        new_leaf = fn(nullptr, KARGS, depth + 1, arg);
+        if (new_leaf != nullptr) {
+          Nodes::addChild(node_header, key[depth],
+                          Nodes::smuggleLeaf(new_leaf));
+          path.commit();
         }
+        path.unpin();
         Lock::writeUnlock(node_header);
-      } else {
-        UPGRADE_TO_WRITE_LOCK_OR_RESTART(parent, parent_version)
-        UPGRADE_TO_WRITE_LOCK_OR_RESTART_WITH_LOCKED_NODE(node_header, version,
-                                                          parent)
-
-        assert(*node_header_ptr != root); // root should not need to be grown
-        Nodes::grow(node_header_ptr);
-        Nodes::addChild(*node_header_ptr, KARGS, value, depth);
+        return new_leaf != nullptr;
+      }
 
-        Lock::writeUnlockObsolete(node_header);
+      UPGRADE_TO_WRITE_LOCK_OR_RESTART(parent, parent_version)
+      UPGRADE_TO_WRITE_LOCK_OR_RESTART_WITH_LOCKED_NODE(node_header, version,
+                                                        parent)
+      path.push(node_header, version);
+      if (!path.pin(parent, node_header)) {
+        Lock::writeUnlock(node_header);
         Lock::writeUnlock(parent);
-
-        assert(*node_header_ptr != node_header);
-        // TODO: Should not free until nobody references it
-        free(node_header);
+        RESTART
       }
-      return;
+      if ((new_leaf = fn(nullptr, KARGS, depth + 1, arg)) == nullptr) {
+        path.unpin();
+        Lock::writeUnlock(node_header);
+        Lock::writeUnlock(parent);
+        return false;
+      }
+
+      // counted before the grown copy takes the count
+      path.commit();
+      assert(*node_header_ptr != root); // root should not need to be grown
+      Nodes::grow(node_header_ptr);
+      Nodes::addChild(*node_header_ptr, key[depth],
+                      Nodes::smuggleLeaf(new_leaf));
+
+      path.unpin();
+      Lock::writeUnlockObsolete(node_header);
+      Lock::writeUnlock(parent);
+
+      assert(*node_header_ptr != node_header);
+      retireHeader(node_header);
+      return true;
     }
 
     READ_UNLOCK_OR_RESTART(parent, parent_version)
 
     depth += 1;
+    path.push(node_header, version);
 
-    if (Nodes::isLeaf(*next_src)) {
-      UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
-      *next_src =
-          splitLeafPrefix(Nodes::asLeaf(*next_src), KARGS, value, depth);
-      Lock::writeUnlock(node_header);
-      return;
-    } else if (depth == key_len) {
+    if (Nodes::isLeaf(next)) {
       UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
-      Nodes::addChildKeyEnd(*((Nodes::Header**)next_src), KARGS, value);
+      Nodes::Leaf* leaf = Nodes::asLeaf(next);
+      if (leafMatches(leaf, KARGS)) {
+        bool modified = updateLeaf(next_src, KARGS, depth, fn, arg);
+        Lock::writeUnlock(node_header);
+        return modified;
+      }
+      if (!path.pin(node_header)) {
+        Lock::writeUnlock(node_header);
+        RESTART
+      }
+      new_leaf = fn(nullptr, KARGS, splitDepth(leaf, KARGS, depth), arg);
+      if (new_leaf != nullptr) {
+        *next_src = splitLeafPrefix(leaf, new_leaf, KARGS, depth);
+        path.commit();
+      }
+      path.unpin();
       Lock::writeUnlock(node_header);
-      return;
+      return new_leaf != nullptr;
     }
 
     parent = node_header;
@@ -419,9 +1159,1055 @@ RESTART_POINT:
   }
 }
 
+// Keys of insertBatch without duplicates, a key given more than once keeps
+// its last value
+struct Batch {
+  const uint8_t* const* keys;
+  const size_t* key_lens;
+  const Nodes::Value* values;
+  std::vector<size_t> index;
+  // Keys diverging inside the prefix of a node, inserted one by one later
+  std::vector<size_t> deferred;
+  // Leaves swapped out for new ones, retired once the batch is in
+  std::vector<Nodes::Leaf*> replaced;
+  // Keys which were not in the tree
+  size_t added;
+
+  const uint8_t* key(size_t i) const { return keys[index[i]]; }
+  size_t keyLen(size_t i) const { return key_lens[index[i]]; }
+  Nodes::Value value(size_t i) const { return values[index[i]]; }
+
+  // End of the keys from lo on with the same byte at depth as key lo
+  size_t groupEnd(size_t lo, size_t hi, size_t depth) const {
+    size_t i = lo + 1;
+    while (i < hi && key(i)[depth] == key(lo)[depth]) {
+      ++i;
+    }
+    return i;
+  }
+};
+
+Nodes::Leaf* updateValue(Batch& batch, Nodes::Leaf* leaf, Nodes::Value value) {
+#ifdef SNAPSHOTS
+  // snapshots may still read the old value
+  if (Snapshot::active()) {
+    batch.replaced.push_back(leaf);
+    return Nodes::makeNewLeaf(Nodes::getKey(leaf), leaf->key_len, value,
+                              Nodes::keyOffset(leaf));
+  }
+#else
+  (void)batch;
+#endif
+  // readers access the value without locks
+  __atomic_store_n(&leaf->value, value, __ATOMIC_SEQ_CST);
+  return leaf;
+}
+
+// Leaves of keys [lo, hi), with the leaf already in the tree in its place
+// in key order, if any. The keys share their first depth bytes.
+void collectLeaves(Batch& batch, size_t lo, size_t hi, size_t depth,
+                   Nodes::Leaf* existing, std::vector<Nodes::Leaf*>& leaves) {
+  for (size_t i = lo; i < hi; ++i) {
+    const uint8_t* key = batch.key(i);
+    size_t key_len = batch.keyLen(i);
+    if (existing != nullptr) {
+      int cmp = compareLeaf(existing, KARGS, depth);
+      if (cmp == 0) {
+        leaves.push_back(updateValue(batch, existing, batch.value(i)));
+        existing = nullptr;
+        continue;
+      }
+      if (cmp < 0) {
+        leaves.push_back(existing);
+        existing = nullptr;
+      }
+    }
+    leaves.push_back(Nodes::makeNewLeaf(KARGS, batch.value(i), depth));
+    ++batch.added;
+  }
+  if (existing != nullptr) {
+    leaves.push_back(existing);
+  }
+}
+
+// Subtree holding the given leaves, sorted by key, whose keys share their
+// first depth bytes. Nodes are made with the type they need.
+void* buildSubtree(Nodes::Leaf* const* leaves, size_t n, size_t depth) {
+  if (n == 1) {
+    return Nodes::smuggleLeaf(leaves[0]);
+  }
+
+  // Only the first key may end in the node, as a prefix of the others
+  const uint8_t* first = Nodes::getKey(leaves[0]);
+  const uint8_t* last = Nodes::getKey(leaves[n - 1]);
+  size_t end = depth;
+  size_t stop = std::min(leaves[0]->key_len, leaves[n - 1]->key_len);
+  while (end < stop && first[end] == last[end]) {
+    ++end;
+  }
+  size_t i = end == leaves[0]->key_len ? 1 : 0;
+
+  size_t children_count = 0;
+  for (size_t j = i; j < n;) {
+    uint8_t key = Nodes::getKey(leaves[j])[end];
+    while (j < n && Nodes::getKey(leaves[j])[end] == key) {
+      ++j;
+    }
+    ++children_count;
+  }
+
+  Nodes::Header* node_header =
+      Nodes::makeNewNode(Nodes::fittingType(children_count));
+  memcpy(Nodes::initPrefix(node_header, end - depth), first + depth,
+         end - depth);
+#ifdef ORDER_STATS
+  node_header->subtree_count = n;
+#endif
+
+  if (i == 1) {
+    Nodes::addChildKeyEnd(node_header, leaves[0]);
+  }
+  while (i < n) {
+    uint8_t key = Nodes::getKey(leaves[i])[end];
+    size_t j = i;
+    while (j < n && Nodes::getKey(leaves[j])[end] == key) {
+      ++j;
+    }
+    Nodes::addChild(node_header, key, buildSubtree(leaves + i, j - i, end + 1));
+    i = j;
+  }
+  return node_header;
+}
+
+// Inserts keys [lo, hi) of the batch, which share the path down to
+// node_header, at depth (before its prefix). node_header is write-locked, as
+// are the children it goes through, each once for all the keys below it.
+// A node which needs more room grows once, to the type it needs in the end:
+// the parent must then be write-locked, either by the caller (parent is
+// nullptr) or here, which fails without modifying the tree if the parent
+// changed since parent_version. node_header is left locked.
+bool insertBatchInto(Batch& batch, size_t lo, size_t hi, size_t depth,
+                     Nodes::Header*& node_header,
+                     Nodes::Header** node_header_ptr, Nodes::Header* parent,
+                     Nodes::version_t parent_version) {
+#ifdef ORDER_STATS
+  const size_t added = batch.added;
+#endif
+
+  // Keys are sorted, so the ones matching the prefix are contiguous
+  const size_t prefix_len = node_header->prefix_len;
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  auto matches = [&](size_t i) {
+    return prefix_len == 0 ||
+           (batch.keyLen(i) - depth >= prefix_len &&
+            memcmp(batch.key(i) + depth, prefix, prefix_len) == 0);
+  };
+  size_t match_lo = lo;
+  while (match_lo < hi && !matches(match_lo)) {
+    ++match_lo;
+  }
+  size_t match_hi = hi;
+  while (match_hi > match_lo && !matches(match_hi - 1)) {
+    --match_hi;
+  }
+  depth += prefix_len;
+
+  size_t i = match_lo;
+  const bool key_end = i < match_hi && batch.keyLen(i) == depth;
+  if (key_end) {
+    ++i;
+  }
+
+  size_t new_children = 0;
+  for (size_t j = i; j < match_hi; j = batch.groupEnd(j, match_hi, depth)) {
+    void** child_src = Nodes::findChild(node_header, batch.key(j)[depth]);
+    if (child_src == nullptr || *child_src == nullptr) {
+      ++new_children;
+    }
+  }
+  Nodes::Type nt =
+      Nodes::fittingType(node_header->children_count + new_children);
+  if (nt > node_header->type) {
+    assert(node_header_ptr != nullptr); // the root is never grown
+    if (parent != nullptr &&
+        !Lock::upgradeToWriteLock(parent, parent_version)) {
+      return false;
+    }
+    Nodes::Header* grown = node_header;
+    Nodes::resize(&grown, nt);
+    Lock::tryWriteLock(grown);
+    *node_header_ptr = grown;
+    if (parent != nullptr) {
+      Lock::writeUnlock(parent);
+    }
+    Lock::writeUnlockObsolete(node_header);
+    retireHeader(node_header);
+    node_header = grown;
+  }
+
+  for (size_t j = lo; j < match_lo; ++j) {
+    batch.deferred.push_back(batch.index[j]);
+  }
+  for (size_t j = match_hi; j < hi; ++j) {
+    batch.deferred.push_back(batch.index[j]);
+  }
+
+  if (key_end) {
+    Nodes::Leaf** key_end_src = Nodes::findChildKeyEnd(node_header);
+    if (*key_end_src != nullptr) {
+      *key_end_src = updateValue(batch, *key_end_src, batch.value(match_lo));
+    } else {
+      Nodes::addChildKeyEnd(node_header,
+                            Nodes::makeNewLeaf(batch.key(match_lo), depth,
+                                               batch.value(match_lo), depth));
+      ++batch.added;
+    }
+  }
+
+  std::vector<Nodes::Leaf*> leaves;
+  while (i < match_hi) {
+    size_t end = batch.groupEnd(i, match_hi, depth);
+    uint8_t key = batch.key(i)[depth];
+    void** child_src = Nodes::findChild(node_header, key);
+    void* child = child_src == nullptr ? nullptr : *child_src;
+
+    if (child == nullptr || Nodes::isLeaf(child)) {
+      leaves.clear();
+      collectLeaves(batch, i, end, depth + 1,
+                    child == nullptr ? nullptr : Nodes::asLeaf(child), leaves);
+      void* subtree = buildSubtree(leaves.data(), leaves.size(), depth + 1);
+      if (child == nullptr) {
+        Nodes::addChild(node_header, key, subtree);
+      } else {
+        *child_src = subtree;
+      }
+    } else {
+      // Writers holding the child never wait for its parent, which is ours
+      Nodes::Header* child_header = Nodes::asHeader(child);
+      while (!Lock::tryWriteLock(child_header)) {
+      }
+#ifdef SNAPSHOTS
+      if (Snapshot::isShared(child_header)) {
+        Nodes::Header* copy = Nodes::clone(child_header);
+        Lock::tryWriteLock(copy);
+        *child_src = copy;
+        Lock::writeUnlockObsolete(child_header);
+        retireNode(child_header);
+        child_header = copy;
+      }
+#endif
+      bool inserted = insertBatchInto(batch, i, end, depth + 1, child_header,
+                                      (Nodes::Header**)child_src, nullptr, 0);
+      assert(inserted);
+      (void)inserted;
+      Lock::writeUnlock(child_header);
+    }
+    i = end;
+  }
+
+#ifdef ORDER_STATS
+  Nodes::addSubtreeCount(node_header, batch.added - added);
+#endif
+  return true;
+}
+
+// Inserts keys [lo, hi) of the batch, which share their first byte. They are
+// followed down the tree as long as they all take the same child, the node
+// where they part is write-locked once for all of them.
+void insertRun(Nodes::Header* root, Batch& batch, size_t lo, size_t hi) {
+  Nodes::Header** node_header_ptr;
+  Nodes::Header* parent;
+  Nodes::Header* node_header;
+  size_t depth;
+  Nodes::version_t parent_version;
+  Nodes::version_t version;
+  WritePath path;
+
+RESTART_POINT:
+  path.clear();
+  node_header_ptr = nullptr;
+  parent = nullptr;
+  parent_version = 0;
+  node_header = root;
+  depth = 0;
+  READ_LOCK_OR_RESTART(root, version)
+
+  while (true) {
+    // Keys are sorted: whatever the first and last keys share, all do
+    const uint8_t* key = batch.key(lo);
+    const size_t key_len = batch.keyLen(lo);
+    const uint8_t* last = batch.key(hi - 1);
+    const size_t last_len = batch.keyLen(hi - 1);
+
+    size_t first_diff;
+    if (!prefixMatches(node_header, KARGS, depth, first_diff) ||
+        !prefixMatches(node_header, last, last_len, depth, first_diff)) {
+      break;
+    }
+    size_t child_depth = depth + node_header->prefix_len;
+    if (key_len == child_depth || key[child_depth] != last[child_depth]) {
+      break;
+    }
+
+    void** next_src = Nodes::findChild(node_header, key[child_depth]);
+    void* next = next_src == nullptr ? nullptr : *next_src;
+    CHECK_OR_RESTART(node_header, version)
+    if (next == nullptr || Nodes::isLeaf(next)) {
+      break;
+    }
+    if (parent != nullptr) {
+      READ_UNLOCK_OR_RESTART(parent, parent_version)
+    }
+
+    path.push(node_header, version);
+    parent = node_header;
+    parent_version = version;
+    node_header_ptr = (Nodes::Header**)next_src;
+    node_header = Nodes::asHeader(next);
+    depth = child_depth + 1;
+    READ_LOCK_OR_RESTART(node_header, version)
+    COPY_IF_SHARED_OR_RESTART(parent, parent_version, node_header, version,
+                              node_header_ptr)
+  }
+
+  UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
+  if (parent != nullptr) {
+    READ_UNLOCK_OR_RESTART_WITH_LOCKED_NODE(parent, parent_version,
+                                            node_header)
+  }
+  if (!path.pin(node_header)) {
+    Lock::writeUnlock(node_header);
+    RESTART
+  }
+  const size_t added = batch.added;
+  if (!insertBatchInto(batch, lo, hi, depth, node_header, node_header_ptr,
+                       parent, parent_version)) {
+    path.unpin();
+    Lock::writeUnlock(node_header);
+    RESTART
+  }
+  path.commit(batch.added - added);
+  path.unpin();
+  Lock::writeUnlock(node_header);
+}
+
+struct Merge {
+  MergeFn fn;
+  void* arg;
+  // Set while a subtree of dst is merged into one of src, which then takes
+  // its place
+  bool swapped;
+  // Keys found in both trees
+  size_t conflicts;
+};
+
+// Nodes of the target tree are locked while they are modified. The tree is
+// only read concurrently, so locking never fails.
+void lockForMerge(Nodes::Header* node_header) {
+  bool locked = Lock::tryWriteLock(node_header);
+  assert(locked);
+  (void)locked;
+}
+
+// Stores child in the slot of parent, nullptr for slots outside of a tree
+void publish(Nodes::Header* parent, void** slot, void* child) {
+  if (parent != nullptr) {
+    lockForMerge(parent);
+  }
+  *slot = child;
+  if (parent != nullptr) {
+    Lock::writeUnlock(parent);
+  }
+}
+
+// Replaces the node in the slot of parent with its copy, or with a resized
+// node which took over its prefix
+void replaceNode(Nodes::Header* parent, Nodes::Header** slot,
+                 Nodes::Header* replacement, bool prefix_moved) {
+  Nodes::Header* node_header = *slot;
+  lockForMerge(node_header);
+  publish(parent, (void**)slot, replacement);
+  Lock::writeUnlockObsolete(node_header);
+  if (prefix_moved) {
+    retireHeader(node_header);
+  } else {
+    retireNode(node_header);
+  }
+}
+
+// Drops the first count bytes of the prefix of the node
+void dropPrefix(Nodes::Header* node_header, size_t count) {
+  uint8_t* prefix = Nodes::getPrefix(node_header);
+  node_header->prefix_len -= count;
+  memmove(prefix, prefix + count, node_header->prefix_len);
+}
+
+void mergeInto(Merge& merge, Nodes::Header* parent, void** slot, void* src,
+               size_t depth);
+
+// Merges src into the child of the node in *slot at key, or makes it the
+// child
+void mergeChild(Merge& merge, Nodes::Header** slot, uint8_t key, void* src,
+                size_t depth) {
+  Nodes::Header* node_header = *slot;
+#ifdef ORDER_STATS
+  const uint64_t src_count = Nodes::subtreeCount(src);
+  const size_t conflicts = merge.conflicts;
+#endif
+  void** child_src = Nodes::findChild(node_header, key);
+  if (child_src == nullptr || *child_src == nullptr) {
+    lockForMerge(node_header);
+    Nodes::addChild(node_header, key, src);
+    Lock::writeUnlock(node_header);
+  } else {
+    mergeInto(merge, node_header, child_src, src, depth);
+  }
+#ifdef ORDER_STATS
+  Nodes::addSubtreeCount(node_header,
+                         src_count - (merge.conflicts - conflicts));
+#endif
+}
+
+// Value to keep for a key found in both trees, target being the leaf staying
+// in the tree. Returns the leaf holding the value.
+Nodes::Leaf* resolveConflict(Merge& merge, Nodes::Leaf* target,
+                             Nodes::Leaf* src) {
+  ++merge.conflicts;
+  Nodes::Value value = merge.swapped
+                           ? merge.fn(src->value, target->value, merge.arg)
+                           : merge.fn(target->value, src->value, merge.arg);
+  retireLeaf(src);
+#ifdef SNAPSHOTS
+  // snapshots may still read the old value
+  if (Snapshot::active()) {
+    retireLeaf(target);
+    return Nodes::makeNewLeaf(Nodes::getKey(target), target->key_len, value,
+                              Nodes::keyOffset(target));
+  }
+#endif
+  // readers access the value without locks
+  __atomic_store_n(&target->value, value, __ATOMIC_SEQ_CST);
+  return target;
+}
+
+// Merges a leaf whose key ends in the node
+void mergeKeyEnd(Merge& merge, Nodes::Header* node_header,
+                 Nodes::Leaf* src_leaf) {
+  Nodes::Leaf** key_end_src = Nodes::findChildKeyEnd(node_header);
+  Nodes::Leaf* leaf = src_leaf;
+  if (*key_end_src != nullptr) {
+    leaf = resolveConflict(merge, *key_end_src, src_leaf);
+  }
+  lockForMerge(node_header);
+  if (*key_end_src == nullptr) {
+    Nodes::addChildKeyEnd(node_header, leaf);
+  } else {
+    *key_end_src = leaf;
+  }
+  Lock::writeUnlock(node_header);
+#ifdef ORDER_STATS
+  if (leaf == src_leaf) {
+    Nodes::addSubtreeCount(node_header, 1);
+  }
+#endif
+}
+
+// Merges src into the node in *slot, whose keys share their first depth bytes
+// with the ones of src
+void mergeIntoNode(Merge& merge, Nodes::Header* parent, Nodes::Header** slot,
+                   void* src, size_t depth) {
+#ifdef SNAPSHOTS
+  // Copies are made from the top, like in insertImpl
+  if (Snapshot::isShared(*slot)) {
+    replaceNode(parent, slot, Nodes::clone(*slot), false);
+  }
+#endif
+  Nodes::Header* node_header = *slot;
+
+  // A leaf is handled like a node whose prefix is the rest of its key
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  size_t prefix_len = node_header->prefix_len;
+  const uint8_t* src_prefix;
+  size_t src_prefix_len;
+  if (Nodes::isLeaf(src)) {
+    src_prefix = Nodes::getKey(Nodes::asLeaf(src)) + depth;
+    src_prefix_len = Nodes::asLeaf(src)->key_len - depth;
+  } else {
+    Nodes::Header* src_header = Nodes::asHeader(src);
+#ifdef SNAPSHOTS
+    // src may be reachable from snapshots of its own tree
+    if (Snapshot::isShared(src_header)) {
+      Nodes::Header* copy = Nodes::clone(src_header);
+      retireNode(src_header);
+      src = src_header = copy;
+    }
+#endif
+    src_prefix = Nodes::getPrefix(src_header);
+    src_prefix_len = src_header->prefix_len;
+  }
+
+  size_t common = 0;
+  while (common < std::min(prefix_len, src_prefix_len) &&
+         prefix[common] == src_prefix[common]) {
+    ++common;
+  }
+
+  if (common < prefix_len) {
+    // Same as the prefix mismatch of insertImpl: a new node holds the common
+    // part of the prefix, with the node below it
+    Nodes::Header* new_node_header = Nodes::makeNewNode<Nodes::Type::NODE4,
+                                                        true>();
+    memcpy(Nodes::initPrefix(new_node_header, common), prefix, common);
+#ifdef ORDER_STATS
+    new_node_header->subtree_count = node_header->subtree_count;
+#endif
+    Nodes::addChild(new_node_header, prefix[common], node_header);
+
+    lockForMerge(node_header);
+    publish(parent, (void**)slot, new_node_header);
+    dropPrefix(node_header, common + 1);
+    Lock::writeUnlock(node_header);
+    node_header = new_node_header;
+    prefix_len = common;
+  }
+  depth += prefix_len;
+
+  if (Nodes::isLeaf(src) || common < src_prefix_len) {
+    if (common == src_prefix_len) {
+      mergeKeyEnd(merge, node_header, Nodes::asLeaf(src));
+      return;
+    }
+    // src goes below a single child
+    uint8_t key_bit = src_prefix[common];
+    if (!Nodes::isLeaf(src)) {
+      dropPrefix(Nodes::asHeader(src), common + 1);
+    }
+    if (Nodes::findChild(node_header, key_bit) == nullptr &&
+        Nodes::isFull(node_header)) {
+      Nodes::Header* grown = node_header;
+      Nodes::grow(&grown);
+      replaceNode(parent, slot, grown, true);
+    }
+    mergeChild(merge, slot, key_bit, src, depth + 1);
+    return;
+  }
+
+  // Same prefixes: the children of src move over one by one. The node grows
+  // once, to the type it needs in the end.
+  Nodes::Header* src_header = Nodes::asHeader(src);
+  std::vector<std::pair<uint8_t, void*>> children;
+  size_t new_children = 0;
+  Nodes::forEachChild(src_header, [&](uint8_t key_bit, void* child) {
+    children.emplace_back(key_bit, child);
+    void** child_src = Nodes::findChild(node_header, key_bit);
+    if (child_src == nullptr || *child_src == nullptr) {
+      ++new_children;
+    }
+  });
+  Nodes::Type nt =
+      Nodes::fittingType(node_header->children_count + new_children);
+  if (nt > node_header->type) {
+    Nodes::Header* grown = node_header;
+    Nodes::resize(&grown, nt);
+    replaceNode(parent, slot, grown, true);
+  }
+
+  Nodes::Leaf* src_key_end = *Nodes::findChildKeyEnd(src_header);
+  retireNode(src_header);
+  if (src_key_end != nullptr) {
+    mergeKeyEnd(merge, *slot, src_key_end);
+  }
+  for (const auto& child : children) {
+    mergeChild(merge, slot, child.first, child.second, depth + 1);
+  }
+}
+
+// Merges src into the subtree in the slot of parent (nullptr for slots
+// outside of a tree). The keys of both share their first depth bytes.
+void mergeInto(Merge& merge, Nodes::Header* parent, void** slot, void* src,
+               size_t depth) {
+  void* target = *slot;
+  if (!Nodes::isLeaf(target)) {
+    mergeIntoNode(merge, parent, (Nodes::Header**)slot, src, depth);
+    return;
+  }
+
+  Nodes::Leaf* target_leaf = Nodes::asLeaf(target);
+  if (!Nodes::isLeaf(src)) {
+    // The leaf moves into src, which takes its place
+    void* top = src;
+    merge.swapped = !merge.swapped;
+    mergeIntoNode(merge, nullptr, (Nodes::Header**)&top, target, depth);
+    merge.swapped = !merge.swapped;
+    publish(parent, slot, top);
+    return;
+  }
+
+  Nodes::Leaf* src_leaf = Nodes::asLeaf(src);
+  int cmp = compareLeaf(target_leaf, Nodes::getKey(src_leaf),
+                        src_leaf->key_len, depth);
+  if (cmp == 0) {
+    Nodes::Leaf* leaf = resolveConflict(merge, target_leaf, src_leaf);
+    if (leaf != target_leaf) {
+      publish(parent, slot, Nodes::smuggleLeaf(leaf));
+    }
+    return;
+  }
+  Nodes::Leaf* leaves[2] = {target_leaf, src_leaf};
+  if (cmp > 0) {
+    std::swap(leaves[0], leaves[1]);
+  }
+  publish(parent, slot, buildSubtree(leaves, 2, depth));
+}
+
+// Builds the node replacing node_header, which is left with a single inner
+// child and no key end: a copy of the child, whose prefix is preceded by the
+// prefix of node_header and the key bit of the child. The child must be
+// write-locked.
+Nodes::Header* mergeWithChild(Nodes::Header* node_header, uint8_t key,
+                              Nodes::Header* child) {
+  Nodes::Header* merged = Nodes::clone(child);
+  Nodes::freePrefix(merged);
+  merged->prefix_allocated = false;
+  merged->prefix_len = 0;
+
+  size_t i = node_header->prefix_len;
+  uint8_t* prefix = Nodes::initPrefix(merged, i + 1 + child->prefix_len);
+  memcpy(prefix, Nodes::getPrefix(node_header), i);
+  prefix[i++] = key;
+  memcpy(prefix + i, Nodes::getPrefix(child), child->prefix_len);
+  return merged;
+}
+
+// Leaf to link at depth in place of one linked deeper, the first depth bytes
+// of its key being path_key. With LEAF_SUFFIXES, a leaf storing less than
+// its key from depth on is copied.
+Nodes::Leaf* moveLeafUp(Nodes::Leaf* leaf, const uint8_t* path_key,
+                        size_t depth) {
+  size_t offset = Nodes::keyOffset(leaf);
+  if (offset <= depth) {
+    return leaf;
+  }
+  assert(leaf->payload_len == 0);
+  std::vector<uint8_t> suffix(path_key + depth, path_key + offset);
+  suffix.insert(suffix.end(), Nodes::getKey(leaf) + offset,
+                Nodes::getKey(leaf) + leaf->key_len);
+  return Nodes::makeNewLeaf(suffix.data() - depth, leaf->key_len, leaf->value,
+                            depth);
+}
+
+// Unlinks the leaf of the key, nullptr if the key is not in the tree or fn,
+// if any, keeps it. A node left with a single entry is replaced by it, so
+// that every node but the root keeps at least two.
+Nodes::Leaf* removeImpl(Nodes::Header* root, KEY, LeafRemoveFn fn = nullptr,
+                        void* arg = nullptr) {
+  Epoch::Guard guard;
+  Lock::OptimisticReads reads;
+#ifdef SNAPSHOTS
+  Snapshot::WriteGuard writing;
+#endif
+  Nodes::Header** node_header_ptr;
+  Nodes::Header* parent;
+  size_t depth;
+  Nodes::version_t parent_version;
+  Nodes::version_t version;
+  WritePath path;
+
+RESTART_POINT:
+  path.clear();
+
+  READ_LOCK_OR_RESTART(root, version)
+  void** next_src = Nodes::findChild(root, key[0]);
+  void* child = next_src == nullptr ? nullptr : *next_src;
+  CHECK_OR_RESTART(root, version)
+  if (child == nullptr) {
+    return nullptr;
+  }
+
+  path.push(root, version);
+  if (Nodes::isLeaf(child)) {
+    Nodes::Leaf* leaf = Nodes::asLeaf(child);
+    bool match = leafMatches(leaf, KARGS) && (fn == nullptr || fn(leaf, arg));
+    if (!match) {
+      READ_UNLOCK_OR_RESTART(root, version)
+      return nullptr;
+    }
+    UPGRADE_TO_WRITE_LOCK_OR_RESTART(root, version)
+    if (fn != nullptr && !fn(leaf, arg)) {
+      Lock::writeUnlock(root);
+      return nullptr;
+    }
+    Nodes::removeChild(root, key[0]);
+    path.commit(-1);
+    Lock::writeUnlock(root);
+    return leaf;
+  }
+
+  depth = 1;
+  parent = root;
+  parent_version = version;
+  node_header_ptr = (Nodes::Header**)next_src;
+
+  while (true) {
+    Nodes::Header* node_header = Nodes::asHeader(child);
+    READ_LOCK_OR_RESTART(node_header, version)
+    COPY_IF_SHARED_OR_RESTART(parent, parent_version, node_header, version,
+                              node_header_ptr)
+
+    size_t first_diff;
+    bool prefix_matches =
+        prefixMatches(node_header, KARGS, depth, first_diff);
+    depth += first_diff;
+    if (!prefix_matches) {
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      READ_UNLOCK_OR_RESTART(parent, parent_version)
+      return nullptr;
+    }
+
+    const bool key_end = depth == key_len;
+    Nodes::Leaf* leaf;
+    if (key_end) {
+      leaf = *Nodes::findChildKeyEnd(node_header);
+      CHECK_OR_RESTART(node_header, version)
+    } else {
+      next_src = Nodes::findChild(node_header, key[depth]);
+      child = next_src == nullptr ? nullptr : *next_src;
+      CHECK_OR_RESTART(node_header, version)
+      if (child != nullptr && !Nodes::isLeaf(child)) {
+        READ_UNLOCK_OR_RESTART(parent, parent_version)
+        depth += 1;
+        path.push(node_header, version);
+        parent = node_header;
+        parent_version = version;
+        node_header_ptr = (Nodes::Header**)next_src;
+        continue;
+      }
+      leaf = child == nullptr ? nullptr : Nodes::asLeaf(child);
+    }
+
+    bool match = leaf != nullptr && leafMatches(leaf, KARGS) &&
+                 (fn == nullptr || fn(leaf, arg));
+    if (!match) {
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      READ_UNLOCK_OR_RESTART(parent, parent_version)
+      return nullptr;
+    }
+
+    // Entries left once the leaf is gone, validated by the upgrades below
+    Nodes::Leaf* key_end_child =
+        key_end ? nullptr : *Nodes::findChildKeyEnd(node_header);
+    size_t children_left = node_header->children_count - (key_end ? 0 : 1);
+
+    if (children_left + (key_end_child != nullptr ? 1 : 0) > 1) {
+      UPGRADE_TO_WRITE_LOCK_OR_RESTART(node_header, version)
+      READ_UNLOCK_OR_RESTART_WITH_LOCKED_NODE(parent, parent_version,
+                                              node_header)
+      if (fn != nullptr && !fn(leaf, arg)) {
+        Lock::writeUnlock(node_header);
+        return nullptr;
+      }
+      path.push(node_header, version);
+      if (!path.pin(node_header)) {
+        Lock::writeUnlock(node_header);
+        RESTART
+      }
+      if (key_end) {
+        Nodes::addChildKeyEnd(node_header, nullptr);
+      } else {
+        Nodes::removeChild(node_header, key[depth]);
+      }
+      // counted before a shrunk copy takes the count
+      path.commit(-1);
+
+      // Shrinking is best effort, it is skipped if the parent changed
+      path.unpin();
+      if (!Nodes::isUnderfull(node_header) ||
+          !Lock::upgradeToWriteLock(parent, parent_version)) {
+        Lock::writeUnlock(node_header);
+        return leaf;
+      }
+      Nodes::shrink(node_header_ptr);
+      Lock::writeUnlockObsolete(node_header);
+      Lock::writeUnlock(parent);
+      retireHeader(node_header);
+      return leaf;
+    }
+
+    UPGRADE_TO_WRITE_LOCK_OR_RESTART(parent, parent_version)
+    UPGRADE_TO_WRITE_LOCK_OR_RESTART_WITH_LOCKED_NODE(node_header, version,
+                                                      parent)
+    if (fn != nullptr && !fn(leaf, arg)) {
+      Lock::writeUnlock(node_header);
+      Lock::writeUnlock(parent);
+      return nullptr;
+    }
+    void* remaining = Nodes::smuggleLeaf(key_end_child);
+    uint8_t remaining_key = 0;
+    Nodes::forEachChild(node_header, [&](uint8_t child_key, void* child) {
+      if (key_end || child_key != key[depth]) {
+        remaining_key = child_key;
+        remaining = child;
+      }
+    });
+
+    Nodes::Header* merged_child = nullptr;
+    if (!Nodes::isLeaf(remaining)) {
+      merged_child = Nodes::asHeader(remaining);
+      if (!Lock::tryWriteLock(merged_child)) {
+        Lock::writeUnlock(node_header);
+        Lock::writeUnlock(parent);
+        RESTART
+      }
+    }
+    if (!path.pin(parent)) {
+      if (merged_child != nullptr) {
+        Lock::writeUnlock(merged_child);
+      }
+      Lock::writeUnlock(node_header);
+      Lock::writeUnlock(parent);
+      RESTART
+    }
+    if (merged_child != nullptr) {
+      remaining = mergeWithChild(node_header, remaining_key, merged_child);
+    }
+    Nodes::Leaf* moved = nullptr;
+    if (Nodes::isLeaf(remaining) &&
+        Nodes::keyOffset(Nodes::asLeaf(remaining)) >
+            depth - node_header->prefix_len) {
+      // the bytes the leaf leaves out are the ones of the key up to depth,
+      // followed by the key bit of the leaf
+      std::vector<uint8_t> path_key(key, key + depth);
+      path_key.push_back(remaining_key);
+      moved = Nodes::asLeaf(remaining);
+      remaining = Nodes::smuggleLeaf(moveLeafUp(
+          moved, path_key.data(), depth - node_header->prefix_len));
+    }
+    *(void**)node_header_ptr = remaining;
+    path.commit(-1);
+
+    if (merged_child != nullptr) {
+      Lock::writeUnlockObsolete(merged_child);
+    }
+    Lock::writeUnlockObsolete(node_header);
+    Lock::writeUnlock(parent);
+    path.unpin();
+    if (merged_child != nullptr) {
+      retireNode(merged_child);
+    }
+    if (moved != nullptr) {
+      retireLeaf(moved);
+    }
+    retireNode(node_header);
+    return leaf;
+  }
+}
+
+struct ValueUpsertArg {
+  UpsertFn fn;
+  void* arg;
+  // Leaf which has been swapped out instead of being updated in place
+  Nodes::Leaf* replaced;
+};
+
+Nodes::Leaf* upsertValue(Nodes::Leaf* old_leaf, KEY, size_t depth,
+                         void* arg) {
+  auto value_upsert = (ValueUpsertArg*)arg;
+  Nodes::Value value;
+  if (!value_upsert->fn(old_leaf == nullptr ? nullptr : &old_leaf->value,
+                        value, value_upsert->arg)) {
+    return nullptr;
+  }
+
+  if (old_leaf == nullptr) {
+    return Nodes::makeNewLeaf(KARGS, value, depth);
+  }
+#ifdef SNAPSHOTS
+  // snapshots may still read the old value
+  if (Snapshot::active()) {
+    value_upsert->replaced = old_leaf;
+    return Nodes::makeNewLeaf(KARGS, value, depth);
+  }
+#endif
+  // readers access the value without locks
+  __atomic_store_n(&old_leaf->value, value, __ATOMIC_SEQ_CST);
+#ifdef CACHE_MODE
+  // as for new keys, see Nodes::initLeaf
+  __atomic_store_n(&old_leaf->referenced, 1, __ATOMIC_RELAXED);
+#endif
+  return old_leaf;
+}
+
+bool storeValue(const Nodes::Value*, Nodes::Value& new_value, void* arg) {
+  new_value = *(const Nodes::Value*)arg;
+  return true;
+}
+
 void insert(Nodes::Header* root, KEY, Nodes::Value value) {
+  upsert(root, KARGS, storeValue, &value);
+}
+
+bool upsert(Nodes::Header* root, KEY, UpsertFn fn, void* arg) {
+  ValueUpsertArg value_upsert = {fn, arg, nullptr};
+  bool modified = upsertLeaf(root, KARGS, upsertValue, &value_upsert);
+  if (value_upsert.replaced != nullptr) {
+    retireLeaf(value_upsert.replaced);
+  }
+  return modified;
+}
+
+bool upsertLeaf(Nodes::Header* root, KEY, LeafUpsertFn fn, void* arg) {
+  assert(key_len > 0);
+  return insertImpl(root, KARGS, fn, arg);
+}
+
+bool remove(Nodes::Header* root, KEY) {
+  Nodes::Leaf* leaf = removeLeaf(root, KARGS);
+  if (leaf == nullptr) {
+    return false;
+  }
+  retireLeaf(leaf);
+  return true;
+}
+
+Nodes::Leaf* removeLeaf(Nodes::Header* root, KEY) {
   assert(key_len > 0);
-  insertImpl(root, KARGS, value);
+  return removeImpl(root, KARGS);
+}
+
+Nodes::Leaf* removeLeafIf(Nodes::Header* root, KEY, LeafRemoveFn fn,
+                          void* arg) {
+  assert(key_len > 0);
+  return removeImpl(root, KARGS, fn, arg);
+}
+
+bool removeIf(Nodes::Header* root, KEY, LeafRemoveFn fn, void* arg) {
+  assert(key_len > 0);
+  Nodes::Leaf* leaf = removeImpl(root, KARGS, fn, arg);
+  if (leaf == nullptr) {
+    return false;
+  }
+  retireLeaf(leaf);
+  return true;
+}
+
+void insertBatch(Nodes::Header* root, const uint8_t* const* keys,
+                 const size_t* key_lens, const Nodes::Value* values,
+                 size_t n) {
+  Batch batch = {keys, key_lens, values, {}, {}, {}, 0};
+  for (size_t i = 0; i < n; ++i) {
+    assert(key_lens[i] > 0);
+    assert(i == 0 ||
+           !keyLess(keys[i], key_lens[i], keys[i - 1], key_lens[i - 1]));
+    bool duplicate = i + 1 < n && key_lens[i] == key_lens[i + 1] &&
+                     memcmp(keys[i], keys[i + 1], key_lens[i]) == 0;
+    if (!duplicate) {
+      batch.index.push_back(i);
+    }
+  }
+
+  {
+    Epoch::Guard guard;
+    Lock::OptimisticReads reads;
+#ifdef SNAPSHOTS
+    Snapshot::WriteGuard writing;
+#endif
+    for (size_t lo = 0; lo < batch.index.size();) {
+      size_t hi = batch.groupEnd(lo, batch.index.size(), 0);
+      insertRun(root, batch, lo, hi);
+      lo = hi;
+    }
+  }
+
+  for (Nodes::Leaf* leaf : batch.replaced) {
+    retireLeaf(leaf);
+  }
+  for (size_t i : batch.deferred) {
+    insert(root, keys[i], key_lens[i], values[i]);
+  }
+}
+
+size_t merge(Nodes::Header* dst, Nodes::Header* src, MergeFn fn, void* arg) {
+  assert(dst != src);
+  assert(!src->compacted);
+  Merge merge = {fn, arg, false, 0};
+  std::vector<std::pair<uint8_t, void*>> children;
+  Nodes::forEachChild(src, [&](uint8_t key_bit, void* child) {
+    children.emplace_back(key_bit, child);
+  });
+
+  {
+    Epoch::Guard guard;
+    Lock::OptimisticReads reads;
+#ifdef SNAPSHOTS
+    Snapshot::WriteGuard writing;
+#endif
+    // Roots are never replaced
+    for (const auto& child : children) {
+      Nodes::removeChild(src, child.first);
+      mergeChild(merge, &dst, child.first, child.second, 1);
+    }
+  }
+#ifdef ORDER_STATS
+  src->subtree_count = 0;
+#endif
+  return merge.conflicts;
+}
+
+struct FetchAddArg {
+  Nodes::Value delta;
+  Nodes::Value previous;
+};
+
+bool fetchAddValue(const Nodes::Value* old_value, Nodes::Value& new_value,
+                   void* arg) {
+  auto fetch_add = (FetchAddArg*)arg;
+  fetch_add->previous = old_value == nullptr ? 0 : *old_value;
+  new_value = fetch_add->previous + fetch_add->delta;
+  return true;
+}
+
+Nodes::Value fetchAdd(Nodes::Header* root, KEY, Nodes::Value delta) {
+  FetchAddArg arg = {delta, 0};
+  upsert(root, KARGS, fetchAddValue, &arg);
+  return arg.previous;
+}
+
+struct CompareExchangeArg {
+  Nodes::Value* expected;
+  Nodes::Value desired;
+};
+
+bool compareExchangeValue(const Nodes::Value* old_value,
+                          Nodes::Value& new_value, void* arg) {
+  auto compare_exchange = (CompareExchangeArg*)arg;
+  if (old_value == nullptr) {
+    return false;
+  }
+  if (*old_value != *compare_exchange->expected) {
+    *compare_exchange->expected = *old_value;
+    return false;
+  }
+  new_value = compare_exchange->desired;
+  return true;
+}
+
+bool compareExchange(Nodes::Header* root, KEY, Nodes::Value& expected,
+                     Nodes::Value desired) {
+  CompareExchangeArg arg = {&expected, desired};
+  return upsert(root, KARGS, compareExchangeValue, &arg);
+}
+
+bool storeIfAbsent(const Nodes::Value* old_value, Nodes::Value& new_value,
+                   void* arg) {
+  if (old_value != nullptr) {
+    return false;
+  }
+  new_value = *(const Nodes::Value*)arg;
+  return true;
+}
+
+bool insertIfAbsent(Nodes::Header* root, KEY, Nodes::Value value) {
+  return upsert(root, KARGS, storeIfAbsent, &value);
 }
 
 } // namespace Actions
@@ -6,8 +6,20 @@
 
 namespace Actions {
 
+// Leftmost (rightmost) key below node. The caller is responsible for the
+// synchronization of node itself, the nodes below it are validated. With
+// LEAF_SUFFIXES, node must be a root: leaves do not store the bytes above it.
 void findMinimumKey(const void* node, const uint8_t*& out_key, size_t& out_len);
+void findMaximumKey(const void* node, const uint8_t*& out_key, size_t& out_len);
 
+// Whether the leaf holds the key. The key bytes before the ones stored in
+// the leaf are the ones of its path, which the caller has matched.
+bool leafMatches(const Nodes::Leaf* leaf, KEY);
+
+// Values and keys returned by the queries point into the leaf of the key,
+// which stays valid until the key is removed. With LEAF_SUFFIXES, keys are
+// rebuilt from the path to the leaf in a buffer of the calling thread, valid
+// until its next query returning a key.
 const Nodes::Value* search(Nodes::Header* node_header, KEY);
 
 inline const Nodes::Value* search(Nodes::Header* node_header, const char* key) {
@@ -15,6 +27,40 @@ inline const Nodes::Value* search(Nodes::Header* node_header, const char* key) {
   return search(node_header, (const uint8_t*)key, len);
 }
 
+Nodes::Leaf* searchLeaf(Nodes::Header* node_header, KEY);
+
+// Node holding a leaf, and its version when the leaf was found in it. The
+// version changes once the leaf is unlinked or its value updated in place.
+// The node stays allocated while the caller is in the Epoch::Guard it
+// entered before the lookup.
+struct Holder {
+  Nodes::Header* node;
+  Nodes::version_t version;
+};
+
+Nodes::Leaf* searchLeaf(Nodes::Header* root, KEY, Holder& out_holder);
+
+// The following queries return false if there is no such key in the tree.
+// They descend the tree once, moving to the closest sibling subtree when the
+// key is not found.
+
+bool minimum(Nodes::Header* root, const uint8_t*& out_key, size_t& out_len,
+             Nodes::Value& out_value);
+bool maximum(Nodes::Header* root, const uint8_t*& out_key, size_t& out_len,
+             Nodes::Value& out_value);
+// Smallest key >= the given one
+bool lowerBound(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                size_t& out_len, Nodes::Value& out_value);
+// Smallest key > the given one (i.e. its successor)
+bool upperBound(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                size_t& out_len, Nodes::Value& out_value);
+// Greatest key < the given one
+bool predecessor(Nodes::Header* root, KEY, const uint8_t*& out_key,
+                 size_t& out_len, Nodes::Value& out_value);
+// Greatest key <= the given one
+bool floorKey(Nodes::Header* root, KEY, const uint8_t*& out_key,
+              size_t& out_len, Nodes::Value& out_value);
+
 void insert(Nodes::Header* root, KEY, Nodes::Value value);
 
 inline void insert(Nodes::Header* root, const char* key, Nodes::Value value) {
@@ -22,6 +68,133 @@ inline void insert(Nodes::Header* root, const char* key, Nodes::Value value) {
   insert(root, (const uint8_t*)key, len, value);
 }
 
+// Decides the value to store for a key. old_value is nullptr if the key is
+// not in the tree. Returning false leaves the tree untouched.
+typedef bool (*UpsertFn)(const Nodes::Value* old_value, Nodes::Value& new_value,
+                         void* arg);
+
+// Runs fn while holding the write lock of the node which holds (or will hold)
+// the key, in the same traversal which finds it. Returns true if the tree
+// was modified.
+bool upsert(Nodes::Header* root, KEY, UpsertFn fn, void* arg);
+
+// fn(old_value, new_value) -> bool, see UpsertFn
+template <typename F> bool upsert(Nodes::Header* root, KEY, F fn) {
+  return upsert(
+      root, KARGS,
+      [](const Nodes::Value* old_value, Nodes::Value& new_value, void* arg) {
+        return (*(F*)arg)(old_value, new_value);
+      },
+      &fn);
+}
+
+// Adds delta to the value of the key, which is inserted with value delta if
+// missing. Returns the previous value (0 for missing keys).
+Nodes::Value fetchAdd(Nodes::Header* root, KEY, Nodes::Value delta);
+
+inline Nodes::Value fetchAdd(Nodes::Header* root, const char* key,
+                             Nodes::Value delta) {
+  size_t len = strlen(key) + 1;
+  return fetchAdd(root, (const uint8_t*)key, len, delta);
+}
+
+// Stores desired if the key holds expected. Otherwise returns false and, if
+// the key is in the tree, writes its current value into expected.
+bool compareExchange(Nodes::Header* root, KEY, Nodes::Value& expected,
+                     Nodes::Value desired);
+
+// Returns false if the key was already in the tree
+bool insertIfAbsent(Nodes::Header* root, KEY, Nodes::Value value);
+
+// Returns false if the key was not in the tree
+bool remove(Nodes::Header* root, KEY);
+
+inline bool remove(Nodes::Header* root, const char* key) {
+  size_t len = strlen(key) + 1;
+  return remove(root, (const uint8_t*)key, len);
+}
+// Like remove, but hands the unlinked leaf over to the caller, who frees it
+// through Epoch::retire. Returns nullptr if the key was not in the tree.
+Nodes::Leaf* removeLeaf(Nodes::Header* root, KEY);
+
+// Decides whether to remove the leaf of the key. It runs before the node
+// holding the leaf is write-locked, the removal restarting if the node
+// changes in the meantime, then once more under the lock: the leaf removed
+// is the one fn saw, and fn sees what was done to it until it is unlinked.
+// fn may run more than once.
+typedef bool (*LeafRemoveFn)(const Nodes::Leaf* leaf, void* arg);
+// Same as removeLeaf, only removing the leaf if fn agrees
+Nodes::Leaf* removeLeafIf(Nodes::Header* root, KEY, LeafRemoveFn fn,
+                          void* arg);
+// Same as remove, only removing the key if fn agrees
+bool removeIf(Nodes::Header* root, KEY, LeafRemoveFn fn, void* arg);
+
+// Same as inserting the n keys one by one, but the keys must be sorted (the
+// last of equal keys wins). Keys going through the same node are inserted
+// under a single write lock of the node, which grows at most once, and new
+// subtrees are built whole before being linked.
+void insertBatch(Nodes::Header* root, const uint8_t* const* keys,
+                 const size_t* key_lens, const Nodes::Value* values, size_t n);
+
+// Decides the value of a key found in both trees of a merge
+typedef Nodes::Value (*MergeFn)(Nodes::Value dst_value,
+                                Nodes::Value src_value, void* arg);
+
+// Moves the keys of src into dst, leaving src empty. Both trees are walked at
+// once: subtrees of src holding no key of dst move over whole, so the cost
+// depends on how much the trees overlap rather than on their size. Returns
+// the number of keys found in both trees.
+//
+// dst may be read concurrently, but neither tree may be written during the
+// merge, and src must not be compacted.
+size_t merge(Nodes::Header* dst, Nodes::Header* src, MergeFn fn, void* arg);
+
+// fn(dst_value, src_value) -> Value, see MergeFn
+template <typename F>
+size_t merge(Nodes::Header* dst, Nodes::Header* src, F fn) {
+  return merge(
+      dst, src,
+      [](Nodes::Value dst_value, Nodes::Value src_value, void* arg) {
+        return (*(F*)arg)(dst_value, src_value);
+      },
+      &fn);
+}
+
+// Low-level form of UpsertFn, for leaves carrying a payload. old_leaf is
+// nullptr if the key is not in the tree. Returns the leaf to store for the
+// key: old_leaf itself after an in-place update, a new leaf (old_leaf is
+// then left to the caller to free), or nullptr to leave the tree untouched.
+// A new leaf may leave out the first depth bytes of the key, see
+// Nodes::initLeaf.
+typedef Nodes::Leaf* (*LeafUpsertFn)(Nodes::Leaf* old_leaf, KEY, size_t depth,
+                                     void* arg);
+bool upsertLeaf(Nodes::Header* root, KEY, LeafUpsertFn fn, void* arg);
+
+// Called on the leaf of a key before validating the version of the node
+// holding it. fn may run again if a concurrent write forces the lookup to
+// restart, so it should only copy data out of the leaf.
+typedef void (*LeafReadFn)(const Nodes::Leaf* leaf, void* arg);
+// Returns false if the key is not in the tree
+bool readLeaf(Nodes::Header* root, KEY, LeafReadFn fn, void* arg);
+
+#ifdef ORDER_STATS
+// Writes adding or removing keys add to the subtree counts of the nodes above
+// the key once it is in (or out), without locking them. The queries below
+// restart on a node whose count does not match its children yet.
+
+// Number of keys strictly smaller than the given one
+uint64_t rank(Nodes::Header* root, KEY);
+
+// Finds the k-th smallest key (starting from 0). Returns false if the tree
+// holds k keys or less.
+bool select(Nodes::Header* root, uint64_t k, const uint8_t*& out_key,
+            size_t& out_len, Nodes::Value& out_value);
+
+// Number of keys in [lo, hi)
+uint64_t countRange(Nodes::Header* root, const uint8_t* lo, size_t lo_len,
+                    const uint8_t* hi, size_t hi_len);
+#endif
+
 } // namespace Actions
 
 #endif // ACTIONS
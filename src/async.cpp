@@ -0,0 +1,204 @@
+#if __cplusplus >= 202002L
+
+#include "async.hpp"
+#include "actions.hpp"
+#include "epoch.hpp"
+#include "lock.hpp"
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+namespace Async {
+
+namespace {
+
+void prefetchLines(const void* start, size_t size) {
+  for (size_t offset = 0; offset < size; offset += 64) {
+    __builtin_prefetch((const uint8_t*)start + offset);
+  }
+}
+
+// Prefetches the lines past the header which Nodes::findChild reads for the
+// key bit. In bitmap nodes, the slot of the child is guessed from the number
+// of children.
+void prefetchChild(Nodes::Header* node_header, uint8_t key_bit) {
+  void* node = node_header->getNode();
+  switch (node_header->type) {
+  case Nodes::Type::NODE4:
+    prefetchLines(node, sizeof(Nodes::Node4));
+    break;
+  case Nodes::Type::NODE16:
+    prefetchLines(node, sizeof(Nodes::Node16));
+    break;
+  case Nodes::Type::NODE32:
+    prefetchLines(node, sizeof(Nodes::Node32));
+    break;
+  case Nodes::Type::NODE48: {
+    auto node48 = (Nodes::Node48*)node;
+    __builtin_prefetch(&node48->child_index[key_bit]);
+    prefetchLines(node48->children, sizeof(node48->children));
+    break;
+  }
+  case Nodes::Type::NODE64: {
+    auto node64 = (Nodes::Node64*)node;
+    __builtin_prefetch(node64->bitmap);
+    __builtin_prefetch(
+        &node64->children[key_bit * node_header->children_count / 256]);
+    break;
+  }
+  case Nodes::Type::NODE128: {
+    auto node128 = (Nodes::Node128*)node;
+    __builtin_prefetch(node128->bitmap);
+    __builtin_prefetch(
+        &node128->children[key_bit * node_header->children_count / 256]);
+    break;
+  }
+  case Nodes::Type::NODE256:
+    __builtin_prefetch(&((Nodes::Node256*)node)->children[key_bit]);
+    break;
+  }
+}
+
+} // namespace
+
+Lookup& Lookup::operator=(Lookup&& other) noexcept {
+  if (this != &other) {
+    if (handle_) {
+      handle_.destroy();
+    }
+    handle_ = other.handle_;
+    other.handle_ = nullptr;
+  }
+  return *this;
+}
+
+Lookup::~Lookup() {
+  if (handle_) {
+    handle_.destroy();
+  }
+}
+
+// Same traversal as Actions::searchImpl, suspending before each node or leaf
+// it reads: once its header is prefetched, and once more with the lines of
+// the child search, which depend on the header. The version of the node read
+// last is held across the suspensions: the next READ_UNLOCK_OR_RESTART
+// notices any change made in the meantime.
+Lookup search(Nodes::Header* root, KEY) {
+  // keeps the nodes of the path allocated while suspended, see Epoch::Pin
+  Epoch::Pin pin;
+  Nodes::Header* parent;
+  Nodes::Header* node_header;
+  size_t depth;
+  Nodes::version_t version;
+  Nodes::version_t parent_version;
+
+RESTART_POINT:
+  // a lookup restarting again and again does not hold back the epoch
+  pin.renew();
+  node_header = root;
+  parent = nullptr;
+  depth = 0;
+
+  while (true) {
+    assert(node_header != nullptr);
+    assert(!Nodes::isLeaf(node_header));
+    assert(depth <= key_len);
+
+    READ_LOCK_OR_RESTART(node_header, version)
+    if (parent != nullptr) {
+      READ_UNLOCK_OR_RESTART(parent, parent_version)
+    }
+
+    {
+      size_t prefix_len = node_header->prefix_len;
+      if (key_len - depth < prefix_len ||
+          (prefix_len > 0 && memcmp(Nodes::getPrefix(node_header),
+                                    key + depth, prefix_len) != 0)) {
+        READ_UNLOCK_OR_RESTART(node_header, version)
+        co_return Result{false, 0};
+      }
+      depth += prefix_len;
+    }
+
+    if (depth == key_len) {
+      __builtin_prefetch(Nodes::findChildKeyEnd(node_header));
+    } else {
+      prefetchChild(node_header, key[depth]);
+    }
+    co_await std::suspend_always();
+
+    void* next;
+    if (depth == key_len) {
+      Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+      next = key_end_child == nullptr ? nullptr
+                                      : Nodes::smuggleLeaf(key_end_child);
+    } else {
+      // the slot is read once, it may be emptied by a concurrent remove
+      void** next_src = Nodes::findChild(node_header, key[depth]);
+      next = next_src == nullptr ? nullptr : *next_src;
+      ++depth;
+    }
+    CHECK_OR_RESTART(node_header, version)
+
+    if (next == nullptr) {
+      co_return Result{false, 0};
+    }
+
+    if (Nodes::isLeaf(next)) {
+      Nodes::Leaf* leaf = Nodes::asLeaf(next);
+      __builtin_prefetch(leaf);
+      co_await std::suspend_always();
+      bool match = Actions::leafMatches(leaf, KARGS);
+      Nodes::Value value = leaf->value;
+      READ_UNLOCK_OR_RESTART(node_header, version)
+      co_return Result{match, value};
+    }
+
+    parent = node_header;
+    parent_version = version;
+    node_header = Nodes::asHeader(next);
+    __builtin_prefetch(node_header);
+    co_await std::suspend_always();
+  }
+}
+
+Scheduler::Scheduler(size_t width) : width_(width) { slots_.reserve(width); }
+
+bool Scheduler::submit(Lookup&& lookup, Completion done, void* arg) {
+  if (slots_.size() >= width_) {
+    return false;
+  }
+  slots_.push_back(Slot{std::move(lookup), done, arg});
+  return true;
+}
+
+size_t Scheduler::step() {
+  size_t i = 0;
+  while (i < slots_.size()) {
+    slots_[i].lookup.resume();
+    if (!slots_[i].lookup.done()) {
+      ++i;
+      continue;
+    }
+    // the slot is freed first, the completion may submit a lookup
+    Result result = slots_[i].lookup.result();
+    Completion done = slots_[i].done;
+    void* arg = slots_[i].arg;
+    if (i + 1 != slots_.size()) {
+      slots_[i] = std::move(slots_.back());
+    }
+    slots_.pop_back();
+    done(result, arg);
+    // the slot now holds a lookup which did not run in this step, if any
+  }
+  return slots_.size();
+}
+
+void Scheduler::drain() {
+  while (step() != 0) {
+  }
+}
+
+} // namespace Async
+
+#endif // C++20
@@ -0,0 +1,111 @@
+#ifndef ASYNC
+#define ASYNC
+
+#if __cplusplus >= 202002L
+
+#include "nodes.hpp"
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+// Lookups as C++20 coroutines, for builds with -std=c++20 (make test-async).
+//
+// A lookup prefetches the next node of its path, and then the leaf, and
+// suspends before reading them: a thread running dozens of lookups
+// interleaved overlaps their cache misses instead of waiting for each one.
+// Versions are validated as in Actions::search, the version of the node read
+// last is kept while suspended and checked after resuming, and the lookup
+// restarts from the root when a node changed in the meantime.
+namespace Async {
+
+// Lookups a Scheduler runs at once by default
+#define ASYNC_WIDTH 16
+
+struct Result {
+  bool found;
+  Nodes::Value value;
+};
+
+// Handle of a lookup, which starts suspended and is destroyed with it
+class Lookup {
+public:
+  struct promise_type {
+    Result result = {false, 0};
+
+    Lookup get_return_object() {
+      return Lookup(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(Result r) { result = r; }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Lookup(Lookup&& other) noexcept : handle_(other.handle_) {
+    other.handle_ = nullptr;
+  }
+  Lookup& operator=(Lookup&& other) noexcept;
+  ~Lookup();
+
+  Lookup(const Lookup&) = delete;
+  Lookup& operator=(const Lookup&) = delete;
+
+  bool done() const { return handle_.done(); }
+  // Runs until the next node or leaf to read has been prefetched, or until
+  // the lookup is done
+  void resume() { handle_.resume(); }
+  // Valid once done
+  const Result& result() const { return handle_.promise().result; }
+
+private:
+  explicit Lookup(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// The key must stay valid until the lookup is done. The lookup holds an
+// Epoch::Pin from its first resume until it is done or destroyed, so lookups
+// kept in flight (e.g. submitted again by completions) do not hold back the
+// memory retired after they started.
+Lookup search(Nodes::Header* root, KEY);
+
+// Called when a lookup submitted to a Scheduler is done, it may submit
+// another one
+typedef void (*Completion)(const Result& result, void* arg);
+
+// Runs lookups in turns on the calling thread
+class Scheduler {
+public:
+  explicit Scheduler(size_t width = ASYNC_WIDTH);
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // Takes the lookup over, unless `width` lookups are in flight already
+  bool submit(Lookup&& lookup, Completion done, void* arg);
+  // Resumes every lookup in flight once, calling the completions of those
+  // which are done. Returns the number of lookups still in flight.
+  size_t step();
+  // Steps until no lookup is in flight
+  void drain();
+
+  size_t inFlight() const { return slots_.size(); }
+  size_t width() const { return width_; }
+
+private:
+  struct Slot {
+    Lookup lookup;
+    Completion done;
+    void* arg;
+  };
+
+  std::vector<Slot> slots_;
+  size_t width_;
+};
+
+} // namespace Async
+
+#endif // C++20
+
+#endif // ASYNC
@@ -0,0 +1,138 @@
+#ifdef CACHE_MODE
+
+#include "cache.hpp"
+#include "actions.hpp"
+#include "epoch.hpp"
+
+namespace Cache {
+
+namespace {
+
+// Counter of the innermost Counting of the thread
+thread_local ByteCount* counted = nullptr;
+
+// Copies the value out and marks the key as read, see Actions::LeafReadFn
+void readLeaf(const Nodes::Leaf* leaf, void* arg) {
+  *(Nodes::Value*)arg = leaf->value;
+  touch(leaf);
+}
+
+// Clears the CLOCK bit of the leaf about to be unlinked, which is kept if
+// the bit was set, see Actions::LeafRemoveFn. It runs again under the write
+// lock, so a read setting the bit after the first test keeps the key, and a
+// key seen referenced once is kept: the bit is only ever recorded, never
+// forgotten.
+bool unreferenced(const Nodes::Leaf* leaf, void* arg) {
+  auto referenced = (uint8_t*)&leaf->referenced;
+  if (__atomic_exchange_n(referenced, 0, __ATOMIC_RELAXED) != 0) {
+    *(bool*)arg = true;
+  }
+  return !*(bool*)arg;
+}
+
+} // namespace
+
+Counting::Counting(ByteCount& bytes) : previous_(counted) {
+  counted = &bytes;
+}
+
+Counting::~Counting() { counted = previous_; }
+
+void countBytes(int64_t delta) {
+  if (counted != nullptr) {
+    counted->fetch_add(delta, std::memory_order_relaxed);
+  }
+}
+
+Tree::Tree(size_t budget)
+    : bytes_(0), root_(nullptr), budget_(budget), evictions_(0) {
+  Counting counting(bytes_);
+  root_ = Nodes::makeNewRoot();
+  // the hands start spread over the first key byte
+  for (size_t i = 0; i < CACHE_HANDS; ++i) {
+    if (i != 0) {
+      hands_[i].key.push_back((char)(i * 256 / CACHE_HANDS));
+    }
+  }
+}
+
+Tree::~Tree() {
+  Counting counting(bytes_);
+  Nodes::freeRecursive(root_);
+}
+
+bool Tree::get(KEY, Nodes::Value& out) {
+  return Actions::readLeaf(root_, KARGS, readLeaf, &out);
+}
+
+void Tree::put(KEY, Nodes::Value value) {
+  Counting counting(bytes_);
+  Actions::insert(root_, KARGS, value);
+  while (bytes_.load() > (int64_t)budget_ &&
+         evict(CACHE_EVICT_STEPS) != 0) {
+  }
+}
+
+bool Tree::remove(KEY) {
+  Counting counting(bytes_);
+  return Actions::remove(root_, KARGS);
+}
+
+// Threads start from a hand of their own, and go on with the next ones if it
+// is taken
+Tree::Hand* Tree::takeHand() {
+  static std::atomic<size_t> next_hand(0);
+  static thread_local size_t first = next_hand++ % CACHE_HANDS;
+  for (size_t i = 0; i < CACHE_HANDS; ++i) {
+    Hand& hand = hands_[(first + i) % CACHE_HANDS];
+    bool taken = false;
+    if (hand.taken.compare_exchange_strong(taken, true)) {
+      return &hand;
+    }
+  }
+  return nullptr;
+}
+
+size_t Tree::evict(size_t steps) {
+  Hand* hand = takeHand();
+  if (hand == nullptr) {
+    return 0;
+  }
+
+  Counting counting(bytes_);
+  size_t evicted = 0;
+  for (size_t i = 0; i < steps; ++i) {
+    // keeps the leaf of the key found alive until it is copied
+    Epoch::Guard guard;
+    const uint8_t* key;
+    size_t key_len;
+    Nodes::Value value;
+    bool found = hand->key.empty()
+                     ? Actions::minimum(root_, key, key_len, value)
+                     : Actions::upperBound(root_,
+                                           (const uint8_t*)hand->key.data(),
+                                           hand->key.size(), key, key_len,
+                                           value);
+    if (!found) {
+      hand->key.clear();
+      continue;
+    }
+    hand->key.assign((const char*)key, key_len);
+
+    // the bit is tested on the leaf unlinked, in the same traversal: a
+    // read or a write of the key in the meantime is not lost
+    bool referenced = false;
+    if (Actions::removeIf(root_, (const uint8_t*)hand->key.data(),
+                          hand->key.size(), unreferenced, &referenced)) {
+      ++evicted;
+    }
+  }
+
+  hand->taken.store(false);
+  evictions_.fetch_add(evicted);
+  return evicted;
+}
+
+} // namespace Cache
+
+#endif // CACHE_MODE
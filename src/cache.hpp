@@ -0,0 +1,113 @@
+#ifndef CACHE
+#define CACHE
+
+#ifdef CACHE_MODE
+
+#include "nodes.hpp"
+#include <atomic>
+#include <string>
+
+// Bounded-memory mode, built with -DCACHE_MODE: a tree serving as an ordered
+// cache, whose cold keys are evicted once the memory of the nodes, prefixes
+// and leaves goes over a budget.
+//
+// Every leaf carries a CLOCK bit, set by the reads and writes of the key.
+// Writes which leave the memory over the budget move a clock hand over a few
+// keys, in key order: the keys whose bit is set get it cleared, the others
+// are removed, the bit being tested on the leaf unlinked. There are several
+// hands, a writer which finds its own taken by another writer skips
+// eviction, so there is no global lock and reads never wait for an eviction.
+//
+// The budget is a limit on the memory of the tree: nodes, prefixes and leaves
+// allocated for it and still linked in it, counted by Nodes::allocate and
+// deallocate while one of its operations runs (see Counting). A write evicts
+// until the tree is back within the budget, or until a round of
+// CACHE_EVICT_STEPS keys evicts none: they were all read since the hand last
+// went by, or all the hands are taken by writers evicting already.
+namespace Cache {
+
+// Keys a round of eviction visits at most
+#define CACHE_EVICT_STEPS 16
+#define CACHE_HANDS 8
+
+// Bytes of nodes, prefixes and leaves of a tree
+typedef std::atomic<int64_t> ByteCount;
+
+// Memory the thread allocates or frees while a Counting is alive counts in
+// its counter (the innermost one's). Memory retired through Epoch stops
+// counting when it is unlinked, see Nodes::disown.
+class Counting {
+public:
+  explicit Counting(ByteCount& bytes);
+  ~Counting();
+
+  Counting(const Counting&) = delete;
+  Counting& operator=(const Counting&) = delete;
+
+private:
+  ByteCount* previous_;
+};
+
+// Called by Nodes::allocate and deallocate
+void countBytes(int64_t delta);
+
+// Marks the key of the leaf as recently read
+inline void touch(const Nodes::Leaf* leaf) {
+  // the cache line is only written when the bit changes
+  auto referenced = (uint8_t*)&leaf->referenced;
+  if (__atomic_load_n(referenced, __ATOMIC_RELAXED) == 0) {
+    __atomic_store_n(referenced, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// All the operations can run concurrently.
+class Tree {
+public:
+  // budget is in bytes of the tree's memory, see above
+  explicit Tree(size_t budget);
+  // Frees the tree, no operation may be running on it
+  ~Tree();
+
+  Tree(const Tree&) = delete;
+  Tree& operator=(const Tree&) = delete;
+
+  // Returns false if the key is not cached
+  bool get(KEY, Nodes::Value& out);
+  // Inserts or updates the key, then evicts if over the budget
+  void put(KEY, Nodes::Value value);
+  // Returns false if the key was not cached
+  bool remove(KEY);
+
+  // Moves a clock hand over up to `steps` keys, called by put. Returns the
+  // number of keys evicted, 0 if all the hands are taken.
+  size_t evict(size_t steps);
+
+  // Memory is only counted in Tree's operations: the tree must not be
+  // written through its root
+  Nodes::Header* root() const { return root_; }
+  int64_t allocatedBytes() const { return bytes_.load(); }
+  uint64_t evictions() const { return evictions_.load(); }
+
+private:
+  struct alignas(64) Hand {
+    // Set by the thread moving the hand
+    std::atomic<bool> taken{false};
+    // Key visited last, the hand starts over from the smallest key when
+    // empty
+    std::string key;
+  };
+
+  Hand* takeHand();
+
+  ByteCount bytes_;
+  Nodes::Header* root_;
+  size_t budget_;
+  Hand hands_[CACHE_HANDS];
+  std::atomic<uint64_t> evictions_;
+};
+
+} // namespace Cache
+
+#endif // CACHE_MODE
+
+#endif // CACHE
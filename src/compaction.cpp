@@ -0,0 +1,118 @@
+#include "compaction.hpp"
+#include "utils.hpp"
+#include <vector>
+
+namespace Compaction {
+
+namespace {
+
+inline size_t align8(size_t size) { return (size + 7) & ~(size_t)7; }
+
+// Smallest node type which holds all the children. The root is never grown,
+// so it stays a Node256.
+Nodes::Type fittingType(const Nodes::Header* node_header, bool is_root) {
+  return is_root ? Nodes::Type::NODE256
+                 : Nodes::fittingType(node_header->children_count);
+}
+
+size_t nodeBytes(Nodes::Type nt) {
+  return align8(sizeof(Nodes::Header) + Nodes::nodeSize(nt) + sizeof(void*));
+}
+
+// Inline prefixes are copied with the header
+size_t prefixBytes(const Nodes::Header* node_header) {
+  if (!node_header->prefix_allocated) {
+    return 0;
+  }
+  return align8(node_header->prefix_len);
+}
+
+size_t blockSize(void* node, bool is_root) {
+  if (Nodes::isLeaf(node)) {
+    return align8(Nodes::leafSize(Nodes::asLeaf(node)));
+  }
+
+  auto node_header = Nodes::asHeader(node);
+  size_t size =
+      nodeBytes(fittingType(node_header, is_root)) + prefixBytes(node_header);
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+  if (key_end_child != nullptr) {
+    size += align8(Nodes::leafSize(key_end_child));
+  }
+  Nodes::forEachChild(node_header, [&](uint8_t, void* child) {
+    size += blockSize(child, false);
+  });
+  return size;
+}
+
+Nodes::Leaf* copyLeaf(const Nodes::Leaf* leaf, uint8_t*& cursor) {
+  size_t leaf_size = Nodes::leafSize(leaf);
+  auto new_leaf = (Nodes::Leaf*)cursor;
+  memcpy(new_leaf, leaf, leaf_size);
+  new_leaf->compacted = true;
+  cursor += align8(leaf_size);
+  return new_leaf;
+}
+
+Nodes::Header* copyNode(Nodes::Header* node_header, uint8_t*& cursor,
+                        bool is_root) {
+  Nodes::Type nt = fittingType(node_header, is_root);
+  Nodes::Header* new_header = Nodes::initNode(cursor, nt, true);
+  // The root owns the block, see Nodes::freeHeader
+  new_header->compacted = !is_root;
+#ifdef ORDER_STATS
+  new_header->subtree_count = Nodes::subtreeCount(node_header);
+#endif
+  cursor += nodeBytes(nt);
+
+  size_t prefix_size = node_header->prefix_len;
+  new_header->prefix_len = prefix_size;
+  new_header->prefix_allocated = node_header->prefix_allocated;
+  if (node_header->prefix_allocated) {
+    new_header->allocated_prefix = cursor;
+    cursor += align8(prefix_size);
+  }
+  memcpy(Nodes::getPrefix(new_header), Nodes::getPrefix(node_header),
+         prefix_size);
+
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+  if (key_end_child != nullptr) {
+    Nodes::addChildKeyEnd(new_header, copyLeaf(key_end_child, cursor));
+  }
+
+  // Leaves go right after their parent, inner nodes after all of them
+  std::vector<std::pair<uint8_t, void*>> children;
+  Nodes::forEachChild(node_header, [&](uint8_t key, void* child) {
+    if (Nodes::isLeaf(child)) {
+      child = Nodes::smuggleLeaf(copyLeaf(Nodes::asLeaf(child), cursor));
+    }
+    children.push_back(std::make_pair(key, child));
+  });
+  for (auto& child : children) {
+    if (!Nodes::isLeaf(child.second)) {
+      child.second = copyNode(Nodes::asHeader(child.second), cursor, false);
+    }
+    Nodes::addChild(new_header, child.first, child.second);
+  }
+
+  return new_header;
+}
+
+} // namespace
+
+Nodes::Header* compact(Nodes::Header* root) {
+  size_t size = blockSize(root, true);
+  auto block = (uint8_t*)Nodes::allocate(size);
+  uint8_t* cursor = block;
+  Nodes::Header* new_root = copyNode(root, cursor, true);
+  assert((uint8_t*)new_root == block);
+  assert(cursor == block + size);
+  return new_root;
+}
+
+Nodes::Header* compactAndSwap(Nodes::Header** root) {
+  Nodes::Header* new_root = compact(*root);
+  return __atomic_exchange_n(root, new_root, __ATOMIC_SEQ_CST);
+}
+
+} // namespace Compaction
@@ -0,0 +1,28 @@
+#ifndef COMPACTION
+#define COMPACTION
+
+#include "nodes.hpp"
+
+// Copies a tree into a single block of memory, laid out in depth-first order:
+// every node is followed by its prefix and by the leaves it holds, then by the
+// subtrees of its children, in key order. A lookup then walks forward through
+// a few neighbouring cache lines and pages instead of jumping across the heap.
+//
+// The copy is a regular tree. Nodes are copied into the smallest node type
+// which holds their children, so partially filled nodes shrink. Writes keep
+// working: nodes and leaves which are replaced afterwards stay in the block,
+// which is freed together with the root at its start by freeRecursive.
+//
+// No concurrent writers are allowed on the tree being copied.
+namespace Compaction {
+
+Nodes::Header* compact(Nodes::Header* root);
+
+// Publishes a compacted copy of *root with an atomic store. Readers which
+// loaded the old root finish their operation on the old tree. Returns the old
+// root, which the caller frees once those readers are done.
+Nodes::Header* compactAndSwap(Nodes::Header** root);
+
+} // namespace Compaction
+
+#endif // COMPACTION
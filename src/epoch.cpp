@@ -0,0 +1,148 @@
+#include "epoch.hpp"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace Epoch {
+
+namespace {
+
+struct Retired {
+  void* memory;
+  Deleter deleter;
+  uint64_t epoch;
+};
+
+// One per thread, recycled once the thread exits
+struct Participant {
+  // 0 while the thread is outside of any Guard
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> in_use{true};
+  size_t depth = 0;
+  std::vector<Retired> retired;
+  Participant* next = nullptr;
+};
+
+std::atomic<uint64_t> global_epoch(1);
+// Never shrinks
+std::atomic<Participant*> participants(nullptr);
+
+// Memory retired by threads which exited before it could be freed
+std::mutex orphans_mutex;
+std::vector<Retired> orphans;
+
+Participant* acquire() {
+  for (Participant* p = participants.load(); p != nullptr; p = p->next) {
+    bool in_use = false;
+    if (p->in_use.compare_exchange_strong(in_use, true)) {
+      return p;
+    }
+  }
+
+  auto p = new Participant();
+  Participant* head = participants.load();
+  do {
+    p->next = head;
+  } while (!participants.compare_exchange_weak(head, p));
+  return p;
+}
+
+uint64_t minimumActiveEpoch() {
+  uint64_t minimum = UINT64_MAX;
+  for (Participant* p = participants.load(); p != nullptr; p = p->next) {
+    uint64_t epoch = p->epoch.load();
+    if (epoch != 0) {
+      minimum = std::min(minimum, epoch);
+    }
+  }
+  return minimum;
+}
+
+void reclaim(std::vector<Retired>& retired, uint64_t minimum) {
+  size_t kept = 0;
+  for (const Retired& r : retired) {
+    if (r.epoch < minimum) {
+      r.deleter(r.memory);
+    } else {
+      retired[kept++] = r;
+    }
+  }
+  retired.resize(kept);
+}
+
+struct Local {
+  Participant* participant;
+
+  Local() : participant(acquire()) {}
+
+  ~Local() {
+    {
+      std::lock_guard<std::mutex> guard(orphans_mutex);
+      orphans.insert(orphans.end(), participant->retired.begin(),
+                     participant->retired.end());
+    }
+    participant->retired.clear();
+    participant->in_use.store(false);
+  }
+};
+
+Participant& self() {
+  static thread_local Local local;
+  return *local.participant;
+}
+
+} // namespace
+
+Guard::Guard() {
+  Participant& p = self();
+  if (p.depth++ == 0) {
+    p.epoch.store(global_epoch.load());
+  }
+}
+
+Guard::~Guard() {
+  Participant& p = self();
+  if (--p.depth == 0) {
+    p.epoch.store(0);
+  }
+}
+
+// A participant of its own, as a thread has
+Pin::Pin() : participant_(acquire()) {
+  ((Participant*)participant_)->epoch.store(global_epoch.load());
+}
+
+void Pin::renew() {
+  ((Participant*)participant_)->epoch.store(global_epoch.load());
+}
+
+Pin::~Pin() {
+  Participant* p = (Participant*)participant_;
+  p->epoch.store(0);
+  p->in_use.store(false);
+}
+
+uint64_t current() { return self().epoch.load(); }
+
+void retire(void* memory, Deleter deleter) {
+  Participant& p = self();
+  Retired r = {memory, deleter, global_epoch.load()};
+  p.retired.push_back(r);
+  if (p.retired.size() >= EPOCH_RETIRE_BATCH) {
+    collect();
+  }
+}
+
+size_t collect() {
+  Participant& p = self();
+  global_epoch.fetch_add(1);
+  uint64_t minimum = minimumActiveEpoch();
+  reclaim(p.retired, minimum);
+
+  std::lock_guard<std::mutex> guard(orphans_mutex);
+  reclaim(orphans, minimum);
+  return p.retired.size() + orphans.size();
+}
+
+} // namespace Epoch
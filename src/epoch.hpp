@@ -0,0 +1,61 @@
+#ifndef EPOCH
+#define EPOCH
+
+#include <cstddef>
+#include <cstdint>
+
+// Epoch-based reclamation of nodes and leaves unlinked from a tree.
+// Operations run inside a Guard, which announces the global epoch the thread
+// entered in. Memory retired while the global epoch is e is freed once every
+// thread inside a Guard has entered in an epoch later than e: those threads
+// started after the memory was unlinked, so they cannot reach it.
+namespace Epoch {
+
+typedef void (*Deleter)(void* memory);
+
+// Retired memory is freed by batches of this size
+#define EPOCH_RETIRE_BATCH 64
+
+// Guards can be nested, only the outermost one announces an epoch
+class Guard {
+public:
+  Guard();
+  ~Guard();
+  Guard(const Guard&) = delete;
+  Guard& operator=(const Guard&) = delete;
+};
+
+// Announces the global epoch on its own, apart from the Guards of the
+// thread. For work interleaved on a thread, e.g. Async lookups: as nested
+// Guards, they would keep the thread in the epoch of the first one for as
+// long as others keep starting, and no memory would be freed meanwhile.
+class Pin {
+public:
+  Pin();
+  ~Pin();
+  Pin(const Pin&) = delete;
+  Pin& operator=(const Pin&) = delete;
+
+  // Announces the current global epoch instead, once the memory reached
+  // since the Pin was made (or renewed) is no longer used
+  void renew();
+
+private:
+  void* participant_;
+};
+
+// Epoch the calling thread announced in its outermost Guard, 0 outside of
+// any Guard. Memory the thread reaches in a Guard of epoch e is not freed
+// while any thread is inside a Guard of an epoch <= e.
+uint64_t current();
+
+// memory must already be unreachable for threads entering from now on
+void retire(void* memory, Deleter deleter);
+
+// Frees whatever can be freed now, e.g. before measuring memory. Returns the
+// number of retired blocks which are still waiting.
+size_t collect();
+
+} // namespace Epoch
+
+#endif // EPOCH
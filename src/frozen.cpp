@@ -0,0 +1,306 @@
+#include "frozen.hpp"
+#include "utils.hpp"
+#include <stdexcept>
+
+namespace Frozen {
+
+namespace {
+
+// Every node and leaf starts with a tag byte and the length of the bytes
+// it consumes from the key (prefix or leaf suffix). Lengths below 255 take
+// one byte, longer ones are escaped and take 4 more.
+//
+// Leaf:   tag, length, suffix, value
+// Node:   tag, length, prefix, [value], children
+// SPARSE: count, keys[count], offsets[count]
+// DENSE:  bitmap[256 / 8], offsets[popcount(bitmap)]
+// Children come after their parent, offsets count from the tag of the parent.
+enum Tag : uint8_t { LEAF = 0, SPARSE = 1, DENSE = 2 };
+// Or-ed to the tag of nodes where a key ends
+constexpr uint8_t HAS_VALUE = 4;
+constexpr uint8_t KIND_MASK = 3;
+
+// A key array costs 5 bytes per child, a bitmap 32 bytes plus 4 per child
+constexpr size_t SPARSE_MAX_CHILDREN = 32;
+constexpr uint8_t LONG_LENGTH = 255;
+
+typedef uint32_t offset_t;
+
+void put(std::vector<uint8_t>& out, const void* data, size_t size) {
+  out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+void putLength(std::vector<uint8_t>& out, size_t length) {
+  if (length < LONG_LENGTH) {
+    out.push_back((uint8_t)length);
+  } else {
+    out.push_back(LONG_LENGTH);
+    uint32_t long_length = length;
+    put(out, &long_length, sizeof(long_length));
+  }
+}
+
+inline size_t readLength(const uint8_t*& p) {
+  size_t length = *p++;
+  if (length == LONG_LENGTH) {
+    uint32_t long_length;
+    memcpy(&long_length, p, sizeof(long_length));
+    p += sizeof(long_length);
+    length = long_length;
+  }
+  return length;
+}
+
+inline offset_t readOffset(const uint8_t* offsets, size_t index) {
+  offset_t offset;
+  memcpy(&offset, offsets + index * sizeof(offset_t), sizeof(offset_t));
+  return offset;
+}
+
+inline Nodes::Value readValue(const uint8_t* p) {
+  Nodes::Value value;
+  memcpy(&value, p, sizeof(Nodes::Value));
+  return value;
+}
+
+// Both return the position of the node or leaf in the buffer
+size_t writeLeaf(std::vector<uint8_t>& out, Nodes::Leaf* leaf, size_t depth) {
+  size_t position = out.size();
+  out.push_back(LEAF);
+  putLength(out, leaf->key_len - depth);
+  put(out, Nodes::getKey(leaf) + depth, leaf->key_len - depth);
+  put(out, &leaf->value, sizeof(Nodes::Value));
+  return position;
+}
+
+size_t writeNode(std::vector<uint8_t>& out, Nodes::Header* node_header,
+                 size_t depth) {
+  size_t position = out.size();
+
+  std::vector<std::pair<uint8_t, void*>> children;
+  Nodes::forEachChild(node_header, [&](uint8_t key, void* child) {
+    children.push_back(std::make_pair(key, child));
+  });
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+
+  uint8_t tag = children.size() > SPARSE_MAX_CHILDREN ? DENSE : SPARSE;
+  out.push_back(tag | (key_end_child != nullptr ? HAS_VALUE : 0));
+
+  size_t prefix_len = node_header->prefix_len;
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  putLength(out, prefix_len);
+  put(out, prefix, prefix_len);
+  depth += prefix_len;
+
+  if (key_end_child != nullptr) {
+    put(out, &key_end_child->value, sizeof(Nodes::Value));
+  }
+
+  if (tag == SPARSE) {
+    out.push_back((uint8_t)children.size());
+    for (const auto& child : children) {
+      out.push_back(child.first);
+    }
+  } else {
+    uint64_t bitmap[4] = {0, 0, 0, 0};
+    for (const auto& child : children) {
+      bitmap[child.first / 64] |= (uint64_t)1 << (child.first % 64);
+    }
+    put(out, bitmap, sizeof(bitmap));
+  }
+
+  // Children are written after their parent, the offsets patched later
+  size_t offsets = out.size();
+  out.resize(out.size() + children.size() * sizeof(offset_t));
+  for (size_t i = 0; i < children.size(); ++i) {
+    void* child = children[i].second;
+    size_t child_position =
+        Nodes::isLeaf(child)
+            ? writeLeaf(out, Nodes::asLeaf(child), depth + 1)
+            : writeNode(out, Nodes::asHeader(child), depth + 1);
+    // the subtrees of the children before this one lie in between
+    if (child_position - position > UINT32_MAX) {
+      throw std::length_error("Frozen::freeze: child over 4 GiB past parent");
+    }
+    offset_t child_offset = child_position - position;
+    memcpy(&out[offsets + i * sizeof(offset_t)], &child_offset,
+           sizeof(offset_t));
+  }
+
+  return position;
+}
+
+// p points right after the value of the node, if any
+bool findChild(uint8_t tag, const uint8_t* p, uint8_t key, offset_t& offset) {
+  if ((tag & KIND_MASK) == SPARSE) {
+    uint8_t count = *p++;
+    auto found = (const uint8_t*)memchr(p, key, count);
+    if (found == nullptr) {
+      return false;
+    }
+    offset = readOffset(p + count, found - p);
+    return true;
+  }
+
+  uint64_t bitmap[4];
+  memcpy(bitmap, p, sizeof(bitmap));
+  uint64_t bit = (uint64_t)1 << (key % 64);
+  if ((bitmap[key / 64] & bit) == 0) {
+    return false;
+  }
+  size_t index = __builtin_popcountll(bitmap[key / 64] & (bit - 1));
+  for (size_t i = 0; i < key / 64; ++i) {
+    index += __builtin_popcountll(bitmap[i]);
+  }
+  offset = readOffset(p + sizeof(bitmap), index);
+  return true;
+}
+
+struct ScanState {
+  // Key of the node being visited
+  std::vector<uint8_t> key;
+  // Lower bound of the scan
+  const uint8_t* start;
+  size_t start_len;
+  const Callback& callback;
+};
+
+// When bounded, state.key is a prefix of the lower bound and the keys below
+// which are smaller than the bound must be skipped. Returns false once the
+// callback asks to stop.
+bool scanNode(ScanState& state, const uint8_t* node, bool bounded) {
+  const uint8_t* p = node;
+  uint8_t tag = *p++;
+  size_t length = readLength(p);
+  size_t depth = state.key.size();
+
+  if (bounded) {
+    size_t common = std::min(length, state.start_len - depth);
+    int cmp = memcmp(p, state.start + depth, common);
+    if (cmp < 0) {
+      return true;
+    }
+    // past the bound, or the bound ends inside the prefix
+    bounded = cmp == 0 && common == length;
+  }
+  state.key.insert(state.key.end(), p, p + length);
+  p += length;
+  if (bounded && state.key.size() == state.start_len) {
+    bounded = false;
+  }
+
+  bool keep_going = true;
+  if ((tag & KIND_MASK) == LEAF) {
+    // a bounded leaf key is a proper prefix of the bound
+    if (!bounded) {
+      keep_going = state.callback(state.key.data(), state.key.size(),
+                                  readValue(p));
+    }
+    state.key.resize(depth);
+    return keep_going;
+  }
+
+  if (tag & HAS_VALUE) {
+    if (!bounded) {
+      keep_going = state.callback(state.key.data(), state.key.size(),
+                                  readValue(p));
+    }
+    p += sizeof(Nodes::Value);
+  }
+
+  auto visit = [&](uint8_t key, offset_t child_offset) {
+    bool child_bounded = bounded;
+    if (bounded) {
+      uint8_t bound = state.start[state.key.size()];
+      if (key < bound) {
+        return;
+      }
+      child_bounded = key == bound;
+    }
+    state.key.push_back(key);
+    keep_going = scanNode(state, node + child_offset, child_bounded);
+    state.key.pop_back();
+  };
+
+  if ((tag & KIND_MASK) == SPARSE) {
+    uint8_t count = *p++;
+    for (size_t i = 0; keep_going && i < count; ++i) {
+      visit(p[i], readOffset(p + count, i));
+    }
+  } else {
+    uint64_t bitmap[4];
+    memcpy(bitmap, p, sizeof(bitmap));
+    size_t index = 0;
+    for (size_t key = 0; keep_going && key < 256; ++key) {
+      if (bitmap[key / 64] & ((uint64_t)1 << (key % 64))) {
+        visit((uint8_t)key, readOffset(p + sizeof(bitmap), index++));
+      }
+    }
+  }
+
+  state.key.resize(depth);
+  return keep_going;
+}
+
+} // namespace
+
+Tree freeze(Nodes::Header* root) {
+  Tree tree;
+  writeNode(tree.data, root, 0);
+  tree.data.shrink_to_fit();
+  return tree;
+}
+
+bool search(const Tree& tree, KEY, Nodes::Value& out_value) {
+  const uint8_t* node = tree.data.data();
+  size_t depth = 0;
+
+  while (true) {
+    const uint8_t* p = node;
+    uint8_t tag = *p++;
+    size_t length = readLength(p);
+
+    if ((tag & KIND_MASK) == LEAF) {
+      if (key_len - depth != length || memcmp(p, key + depth, length) != 0) {
+        return false;
+      }
+      out_value = readValue(p + length);
+      return true;
+    }
+
+    if (key_len - depth < length || memcmp(p, key + depth, length) != 0) {
+      return false;
+    }
+    p += length;
+    depth += length;
+
+    if (tag & HAS_VALUE) {
+      if (depth == key_len) {
+        out_value = readValue(p);
+        return true;
+      }
+      p += sizeof(Nodes::Value);
+    } else if (depth == key_len) {
+      return false;
+    }
+
+    offset_t offset;
+    if (!findChild(tag, p, key[depth], offset)) {
+      return false;
+    }
+    node += offset;
+    ++depth;
+  }
+}
+
+void scan(const Tree& tree, const Callback& callback) {
+  ScanState state = {{}, nullptr, 0, callback};
+  scanNode(state, tree.data.data(), false);
+}
+
+void scan(const Tree& tree, KEY, const Callback& callback) {
+  ScanState state = {{}, key, key_len, callback};
+  scanNode(state, tree.data.data(), true);
+}
+
+} // namespace Frozen
@@ -0,0 +1,40 @@
+#ifndef FROZEN
+#define FROZEN
+
+#include "nodes.hpp"
+#include <functional>
+#include <vector>
+
+// Read-only copy of a tree, packed into a single buffer:
+// - nodes are exactly as large as their children need: a sorted key array
+//   for up to 32 children, a 256-bit bitmap above that;
+// - children are referenced with 32-bit offsets from their parent;
+// - prefixes and the key suffix of each leaf are stored inline, together
+//   with the value;
+// - there are no version words, lookups never check or take locks.
+// The buffer holds no pointers, it can be written out and mapped back as is.
+namespace Frozen {
+
+struct Tree {
+  std::vector<uint8_t> data;
+};
+
+// No concurrent writers are allowed on the tree being frozen. Throws
+// std::length_error if a child would start 4 GiB or more past its parent,
+// i.e. only if the subtrees of its smaller siblings take that much.
+Tree freeze(Nodes::Header* root);
+
+// Returns false if the key is not in the tree
+bool search(const Tree& tree, KEY, Nodes::Value& out_value);
+
+// Called in key order, returning false stops the scan. The key is only valid
+// during the call.
+typedef std::function<bool(KEY, Nodes::Value value)> Callback;
+
+void scan(const Tree& tree, const Callback& callback);
+// Starts from the first key greater than or equal to `key`
+void scan(const Tree& tree, KEY, const Callback& callback);
+
+} // namespace Frozen
+
+#endif // FROZEN
@@ -0,0 +1,175 @@
+#include "hot.hpp"
+#include "actions.hpp"
+#include "epoch.hpp"
+#include "lock.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace Hot {
+
+namespace {
+
+// FNV-1a, with the high bits mixed down for the set index
+uint64_t hashKey(KEY) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < key_len; ++i) {
+    hash = (hash ^ key[i]) * 1099511628211ull;
+  }
+  return hash ^ (hash >> 29);
+}
+
+uint16_t tagOf(uint64_t hash) { return (uint16_t)(hash >> 48); }
+
+template <typename T> T load(const T& field) {
+  return __atomic_load_n(&field, __ATOMIC_RELAXED);
+}
+
+template <typename T> void store(T& field, T value) {
+  __atomic_store_n(&field, value, __ATOMIC_RELAXED);
+}
+
+} // namespace
+
+Cache::Cache(Nodes::Header* root, size_t sets) : root_(root) {
+  size_t count = 1;
+  while (count < sets) {
+    count *= 2;
+  }
+  void* memory;
+  if (posix_memalign(&memory, alignof(Set), count * sizeof(Set)) != 0) {
+    throw std::bad_alloc();
+  }
+  memset(memory, 0, count * sizeof(Set));
+  sets_ = (Set*)memory;
+  mask_ = count - 1;
+}
+
+Cache::~Cache() { free(sets_); }
+
+bool Cache::search(KEY, Nodes::Value& out_value) {
+  // keeps the leaf found alive until the entry is made
+  Epoch::Guard guard;
+  uint64_t hash = hashKey(KARGS);
+  bool stale = false;
+  if (probe(hash, KARGS, out_value, stale)) {
+    return true;
+  }
+
+  Actions::Holder holder;
+  Nodes::Leaf* leaf = Actions::searchLeaf(root_, KARGS, holder);
+  if (leaf == nullptr) {
+    return false;
+  }
+  out_value = leaf->value;
+  // the key of a stale entry was hot already, it goes back in right away
+  static thread_local uint32_t misses = 0;
+  if (stale || ++misses % HOT_ADMIT == 0) {
+    fill(hash, leaf, holder.node, holder.version);
+  }
+  return true;
+}
+
+bool Cache::find(KEY, Nodes::Value& out_value) {
+  Epoch::Guard guard;
+  bool stale = false;
+  return probe(hashKey(KARGS), KARGS, out_value, stale);
+}
+
+// Called inside a Guard. stale is set if the key may have an entry which can
+// no longer be used: made in an older epoch, or outdated by a write.
+bool Cache::probe(uint64_t hash, KEY, Nodes::Value& out_value,
+                  bool& stale) const {
+  const Set& set = setOf(hash);
+  uint32_t seq = set.seq.load(std::memory_order_acquire);
+  if ((seq & 1) != 0) {
+    return false;
+  }
+  // the memory of the entries may be freed for the threads of later epochs,
+  // only the tags can be looked at
+  if (load(set.epoch) < Epoch::current()) {
+    for (size_t i = 0; i < HOT_WAYS; ++i) {
+      stale = stale || (load(set.tags[i]) == tagOf(hash) &&
+                        load(set.ways[i].leaf) != nullptr);
+    }
+    return false;
+  }
+  Way way = {nullptr, nullptr, 0};
+  for (size_t i = 0; i < HOT_WAYS; ++i) {
+    if (load(set.tags[i]) == tagOf(hash)) {
+      way = {load(set.ways[i].leaf), load(set.ways[i].node),
+             load(set.ways[i].version)};
+      if (way.leaf != nullptr) {
+        break;
+      }
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (way.leaf == nullptr ||
+      set.seq.load(std::memory_order_relaxed) != seq) {
+    return false;
+  }
+
+  Nodes::Leaf* leaf = way.leaf;
+  if (leaf->key_len != key_len ||
+      memcmp(Nodes::getKey(leaf), key, key_len) != 0) {
+    return false;
+  }
+  Nodes::Value value = leaf->value;
+  // the leaf is still in the node, with the same value
+  if (!Lock::checkVersion(way.node, way.version)) {
+    stale = true;
+    return false;
+  }
+  out_value = value;
+  return true;
+}
+
+// Called inside the Guard of the lookup which found the leaf. The set is
+// skipped while another lookup fills it.
+void Cache::fill(uint64_t hash, Nodes::Leaf* leaf, Nodes::Header* node,
+                 Nodes::version_t version) {
+  // the key of the other leaves cannot be checked without the path
+  if (Nodes::keyOffset(leaf) != 0) {
+    return;
+  }
+  const uint64_t epoch = Epoch::current();
+  Set& set = setOf(hash);
+  uint32_t seq = set.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) != 0 ||
+      !set.seq.compare_exchange_strong(seq, seq + 1,
+                                       std::memory_order_acquire)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (set.epoch < epoch) {
+    // the entries of older epochs are of no use from now on
+    for (size_t i = 0; i < HOT_WAYS; ++i) {
+      store(set.ways[i].leaf, (Nodes::Leaf*)nullptr);
+    }
+    store(set.epoch, epoch);
+  }
+  if (set.epoch == epoch) {
+    // the way of the key if cached already (stale maybe), else an empty
+    // one, else the ways are replaced in turns
+    size_t victim = (seq >> 1) % HOT_WAYS;
+    for (size_t i = 0; i < HOT_WAYS; ++i) {
+      if (set.ways[i].leaf != nullptr && set.tags[i] == tagOf(hash)) {
+        victim = i;
+        break;
+      }
+      if (set.ways[i].leaf == nullptr) {
+        victim = i;
+      }
+    }
+    store(set.tags[victim], tagOf(hash));
+    store(set.ways[victim].leaf, leaf);
+    store(set.ways[victim].node, node);
+    store(set.ways[victim].version, version);
+  }
+
+  set.seq.store(seq + 2, std::memory_order_release);
+}
+
+} // namespace Hot
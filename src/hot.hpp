@@ -0,0 +1,80 @@
+#ifndef HOT
+#define HOT
+
+#include "nodes.hpp"
+#include <atomic>
+
+// A small front cache for skewed lookups, mapping recently read keys to their
+// leaves so that a hit skips the walk down the tree.
+//
+// The cache is set-associative, a set being one cache line indexed by a hash
+// of the key. Besides the leaf, an entry records the node holding it and the
+// version of that node. A hit reads the value, then checks that the version
+// did not change: writers bump it when they update the value in place,
+// remove the leaf or move it to another node, so stale entries are detected
+// without writers knowing about the cache. Results are the ones of
+// Actions::search.
+//
+// Entries point to memory which Epoch only keeps allocated for threads of the
+// epoch the entry was made in, older entries are ignored. Writes advance the
+// epoch as they retire memory, so the keys of ignored entries are admitted
+// again on their next miss. With LEAF_SUFFIXES, only the leaves holding their
+// whole key are cached.
+namespace Hot {
+
+// Default number of sets
+#define HOT_SETS 4096
+#define HOT_WAYS 2
+// A lookup missing the cache makes an entry once every HOT_ADMIT misses of
+// its thread, so that cold keys rarely push out hot ones
+#define HOT_ADMIT 4
+
+// All the operations can run concurrently with each other and with writes to
+// the tree. The tree must not be compacted or freed while the cache is in
+// use.
+class Cache {
+public:
+  // sets is rounded up to a power of two
+  explicit Cache(Nodes::Header* root, size_t sets = HOT_SETS);
+  ~Cache();
+
+  Cache(const Cache&) = delete;
+  Cache& operator=(const Cache&) = delete;
+
+  // Returns false if the key is not in the tree
+  bool search(KEY, Nodes::Value& out_value);
+  // Looks at the cache only, returns false on a miss
+  bool find(KEY, Nodes::Value& out_value);
+
+  Nodes::Header* root() const { return root_; }
+
+private:
+  struct Way {
+    Nodes::Leaf* leaf;
+    Nodes::Header* node;
+    Nodes::version_t version;
+  };
+
+  struct alignas(64) Set {
+    // Odd while a lookup fills the set
+    std::atomic<uint32_t> seq;
+    // Hash bits telling the ways apart before reading their leaves
+    uint16_t tags[HOT_WAYS];
+    // Epoch of the Guards the ways were filled in
+    uint64_t epoch;
+    Way ways[HOT_WAYS];
+  };
+
+  Set& setOf(uint64_t hash) const { return sets_[hash & mask_]; }
+  bool probe(uint64_t hash, KEY, Nodes::Value& out_value, bool& stale) const;
+  void fill(uint64_t hash, Nodes::Leaf* leaf, Nodes::Header* node,
+            Nodes::version_t version);
+
+  Nodes::Header* root_;
+  Set* sets_;
+  size_t mask_;
+};
+
+} // namespace Hot
+
+#endif // HOT
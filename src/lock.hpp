@@ -3,7 +3,36 @@
 
 #include "nodes.hpp"
 
+#if defined(__SANITIZE_THREAD__)
+#define LOCK_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define LOCK_TSAN
+#endif
+#endif
+
+#ifdef LOCK_TSAN
+extern "C" void AnnotateIgnoreReadsBegin(const char* file, int line);
+extern "C" void AnnotateIgnoreReadsEnd(const char* file, int line);
+#endif
+
 namespace Lock {
+// Marks the scope of an optimistic descent. Its reads of nodes race with
+// writers by design: they are validated against the node version afterwards
+// and dropped if a writer got in. Under ThreadSanitizer the reads made in the
+// scope are left out of race detection, while its writes are still checked.
+class OptimisticReads {
+public:
+#ifdef LOCK_TSAN
+  OptimisticReads() { AnnotateIgnoreReadsBegin(__FILE__, __LINE__); }
+  ~OptimisticReads() { AnnotateIgnoreReadsEnd(__FILE__, __LINE__); }
+#else
+  OptimisticReads() {}
+#endif
+  OptimisticReads(const OptimisticReads&) = delete;
+  OptimisticReads& operator=(const OptimisticReads&) = delete;
+};
+
 inline Nodes::version_t awaitNodeUnlocked(Nodes::Header* node_header) {
   Nodes::version_t version;
   __atomic_load(&(node_header->version), &version, __ATOMIC_SEQ_CST);
@@ -24,6 +53,33 @@ inline void writeUnlockObsolete(Nodes::Header* node_header) {
 inline uint64_t setLockedBit(Nodes::version_t version) { return version + 2; }
 
 inline bool isObsolete(Nodes::version_t version) { return (version & 1) == 1; }
+
+// Non-restarting counterpart of READ_UNLOCK_OR_RESTART
+inline bool checkVersion(Nodes::Header* node_header,
+                         Nodes::version_t expected) {
+  Nodes::version_t actual;
+  __atomic_load(&(node_header->version), &actual, __ATOMIC_SEQ_CST);
+  return expected == actual;
+}
+
+// Non-restarting counterpart of UPGRADE_TO_WRITE_LOCK_OR_RESTART
+inline bool upgradeToWriteLock(Nodes::Header* node_header,
+                               Nodes::version_t expected) {
+  return __atomic_compare_exchange_n(&(node_header->version), &expected,
+                                     setLockedBit(expected), false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Locks a node whose version was not read beforehand. Fails without waiting
+// if the node is locked or obsolete.
+inline bool tryWriteLock(Nodes::Header* node_header) {
+  Nodes::version_t version;
+  __atomic_load(&(node_header->version), &version, __ATOMIC_SEQ_CST);
+  return (version & 3) == 0 &&
+         __atomic_compare_exchange_n(&(node_header->version), &version,
+                                     setLockedBit(version), false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
 } // namespace Lock
 
 #define RESTART goto RESTART_POINT;
@@ -0,0 +1,365 @@
+#include "multi.hpp"
+#include "actions.hpp"
+#include "epoch.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+namespace Multi {
+
+namespace {
+
+// Sorted values of a key, followed by room for capacity of them
+struct Array {
+  uint32_t count;
+  uint32_t capacity;
+};
+
+// Values of a key holding more than MULTI_ARRAY_MAX of them, stored as the
+// keys of a tree, see encodeValue
+struct Large {
+  size_t count;
+  Nodes::Header* root;
+};
+
+// The leaf value points to either, large ones being tagged
+inline bool isLarge(Nodes::Value list) { return (list & 1) == 1; }
+
+inline Array* asArray(Nodes::Value list) { return (Array*)list; }
+
+inline Large* asLarge(Nodes::Value list) { return (Large*)(list & ~1l); }
+
+inline Nodes::Value* valuesOf(Array* array) {
+  return (Nodes::Value*)(array + 1);
+}
+
+inline Nodes::Value listOf(const Nodes::Leaf* leaf) {
+  return __atomic_load_n(&leaf->value, __ATOMIC_SEQ_CST);
+}
+
+inline void setList(Nodes::Leaf* leaf, Nodes::Value list) {
+  __atomic_store_n(&leaf->value, list, __ATOMIC_SEQ_CST);
+}
+
+Array* makeArray(size_t capacity) {
+  Array* array =
+      (Array*)Nodes::allocate(sizeof(Array) + capacity * sizeof(Nodes::Value));
+  array->count = 0;
+  array->capacity = capacity;
+  return array;
+}
+
+// Big endian, with the sign bit flipped so that the keys sort as the values
+void encodeValue(Nodes::Value value, uint8_t* out) {
+  uint64_t bits = (uint64_t)value ^ (1ull << 63);
+  for (int i = 7; i >= 0; --i) {
+    out[i] = bits & 0xff;
+    bits >>= 8;
+  }
+}
+
+Nodes::Value decodeValue(const uint8_t* key) {
+  uint64_t bits = 0;
+  for (int i = 0; i < 8; ++i) {
+    bits = (bits << 8) | key[i];
+  }
+  return (Nodes::Value)(bits ^ (1ull << 63));
+}
+
+bool forEachLarge(Nodes::Header* root, const Tree::Callback& callback) {
+  const uint8_t* key;
+  size_t key_len;
+  Nodes::Value unused;
+  bool found = Actions::minimum(root, key, key_len, unused);
+  while (found) {
+    Nodes::Value value = decodeValue(key);
+    if (!callback(value)) {
+      return false;
+    }
+    uint8_t bytes[8];
+    encodeValue(value, bytes);
+    found = Actions::upperBound(root, bytes, 8, key, key_len, unused);
+  }
+  return true;
+}
+
+void freeLarge(void* memory) {
+  Large* large = (Large*)memory;
+  Nodes::freeRecursive(large->root);
+  Nodes::deallocate(large);
+}
+
+// Once no reader can reach it
+void retireList(Nodes::Value list) {
+  if (isLarge(list)) {
+    Epoch::retire(asLarge(list), freeLarge);
+  } else {
+    Epoch::retire(asArray(list), Nodes::deallocate);
+  }
+}
+
+void freeLists(void* node) {
+  if (Nodes::isLeaf(node)) {
+    Nodes::Value list = Nodes::asLeaf(node)->value;
+    if (isLarge(list)) {
+      freeLarge(asLarge(list));
+    } else {
+      Nodes::deallocate(asArray(list));
+    }
+    return;
+  }
+  Nodes::Header* node_header = Nodes::asHeader(node);
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+  if (key_end_child != nullptr) {
+    freeLists(Nodes::smuggleLeaf(key_end_child));
+  }
+  Nodes::forEachChild(node_header,
+                      [](uint8_t, void* child) { freeLists(child); });
+}
+
+struct Change {
+  Nodes::Value value;
+  // The value was added (removed)
+  bool done;
+  // The value to remove is the last one of the key
+  bool last;
+};
+
+// Called with the node holding the leaf write-locked, see
+// Actions::LeafUpsertFn. Readers racing with the changes made in place fail
+// their validation.
+Nodes::Leaf* addValue(Nodes::Leaf* old_leaf, KEY, size_t depth, void* arg) {
+  Change* change = (Change*)arg;
+  if (old_leaf == nullptr) {
+    Array* array = makeArray(1);
+    array->count = 1;
+    valuesOf(array)[0] = change->value;
+    change->done = true;
+    return Nodes::makeNewLeaf(KARGS, (Nodes::Value)array, depth);
+  }
+
+  Nodes::Value list = old_leaf->value;
+  if (isLarge(list)) {
+    Large* large = asLarge(list);
+    uint8_t bytes[8];
+    encodeValue(change->value, bytes);
+    change->done = Actions::insertIfAbsent(large->root, bytes, 8, 0);
+    if (!change->done) {
+      return nullptr;
+    }
+    __atomic_store_n(&large->count, large->count + 1, __ATOMIC_SEQ_CST);
+    return old_leaf;
+  }
+
+  Array* array = asArray(list);
+  Nodes::Value* values = valuesOf(array);
+  const size_t count = array->count;
+  size_t index = std::lower_bound(values, values + count, change->value) -
+                 values;
+  if (index < count && values[index] == change->value) {
+    change->done = false;
+    return nullptr;
+  }
+  change->done = true;
+
+  if (count < array->capacity) {
+    memmove(values + index + 1, values + index,
+            (count - index) * sizeof(Nodes::Value));
+    values[index] = change->value;
+    __atomic_store_n(&array->count, count + 1, __ATOMIC_SEQ_CST);
+    return old_leaf;
+  }
+
+  if (count == MULTI_ARRAY_MAX) {
+    Large* large = (Large*)Nodes::allocate(sizeof(Large));
+    large->count = count + 1;
+    large->root = Nodes::makeNewRoot();
+    for (size_t i = 0; i <= count; ++i) {
+      uint8_t bytes[8];
+      encodeValue(i == count ? change->value : values[i], bytes);
+      Actions::insert(large->root, bytes, 8, 0);
+    }
+    setList(old_leaf, (Nodes::Value)large | 1);
+  } else {
+    Array* grown = makeArray(array->capacity * 2);
+    Nodes::Value* grown_values = valuesOf(grown);
+    memcpy(grown_values, values, index * sizeof(Nodes::Value));
+    grown_values[index] = change->value;
+    memcpy(grown_values + index + 1, values + index,
+           (count - index) * sizeof(Nodes::Value));
+    grown->count = count + 1;
+    setList(old_leaf, (Nodes::Value)grown);
+  }
+  retireList(list);
+  return old_leaf;
+}
+
+// Same as addValue. The last value of a key is left to removeLeafIf.
+Nodes::Leaf* removeValue(Nodes::Leaf* old_leaf, KEY, size_t, void* arg) {
+  Change* change = (Change*)arg;
+  change->done = false;
+  if (old_leaf == nullptr) {
+    return nullptr;
+  }
+
+  Nodes::Value list = old_leaf->value;
+  if (isLarge(list)) {
+    Large* large = asLarge(list);
+    uint8_t bytes[8];
+    encodeValue(change->value, bytes);
+    if (large->count - 1 > MULTI_ARRAY_MAX / 4) {
+      change->done = Actions::remove(large->root, bytes, 8);
+      if (!change->done) {
+        return nullptr;
+      }
+      __atomic_store_n(&large->count, large->count - 1, __ATOMIC_SEQ_CST);
+      return old_leaf;
+    }
+    if (Actions::search(large->root, bytes, 8) == nullptr) {
+      return nullptr;
+    }
+    // back to an array, with room to grow
+    Array* array = makeArray(MULTI_ARRAY_MAX / 2);
+    forEachLarge(large->root, [&](Nodes::Value value) {
+      if (value != change->value) {
+        valuesOf(array)[array->count++] = value;
+      }
+      return true;
+    });
+    setList(old_leaf, (Nodes::Value)array);
+    retireList(list);
+    change->done = true;
+    return old_leaf;
+  }
+
+  Array* array = asArray(list);
+  Nodes::Value* values = valuesOf(array);
+  const size_t count = array->count;
+  size_t index = std::lower_bound(values, values + count, change->value) -
+                 values;
+  if (index == count || values[index] != change->value) {
+    return nullptr;
+  }
+  if (count == 1) {
+    change->last = true;
+    return nullptr;
+  }
+  change->done = true;
+
+  if ((count - 1) * 4 > array->capacity) {
+    memmove(values + index, values + index + 1,
+            (count - index - 1) * sizeof(Nodes::Value));
+    __atomic_store_n(&array->count, count - 1, __ATOMIC_SEQ_CST);
+    return old_leaf;
+  }
+  Array* shrunk = makeArray(array->capacity / 2);
+  Nodes::Value* shrunk_values = valuesOf(shrunk);
+  memcpy(shrunk_values, values, index * sizeof(Nodes::Value));
+  memcpy(shrunk_values + index, values + index + 1,
+         (count - index - 1) * sizeof(Nodes::Value));
+  shrunk->count = count - 1;
+  setList(old_leaf, (Nodes::Value)shrunk);
+  retireList(list);
+  return old_leaf;
+}
+
+// See Actions::LeafRemoveFn
+bool onlyHolds(const Nodes::Leaf* leaf, void* arg) {
+  Nodes::Value list = listOf(leaf);
+  if (isLarge(list)) {
+    return false;
+  }
+  Array* array = asArray(list);
+  return __atomic_load_n(&array->count, __ATOMIC_SEQ_CST) == 1 &&
+         valuesOf(array)[0] == *(Nodes::Value*)arg;
+}
+
+struct Read {
+  std::vector<Nodes::Value> values;
+  // Set instead of values for large keys
+  Nodes::Header* large_root;
+};
+
+// See Actions::LeafReadFn
+void readCount(const Nodes::Leaf* leaf, void* arg) {
+  Nodes::Value list = listOf(leaf);
+  *(size_t*)arg =
+      isLarge(list)
+          ? __atomic_load_n(&asLarge(list)->count, __ATOMIC_SEQ_CST)
+          : __atomic_load_n(&asArray(list)->count, __ATOMIC_SEQ_CST);
+}
+
+void readValues(const Nodes::Leaf* leaf, void* arg) {
+  Read* read = (Read*)arg;
+  Nodes::Value list = listOf(leaf);
+  if (isLarge(list)) {
+    read->values.clear();
+    read->large_root = asLarge(list)->root;
+    return;
+  }
+  Array* array = asArray(list);
+  // a torn count is still within the capacity of the array
+  size_t count = __atomic_load_n(&array->count, __ATOMIC_SEQ_CST);
+  read->values.assign(valuesOf(array), valuesOf(array) + count);
+  read->large_root = nullptr;
+}
+
+} // namespace
+
+Tree::Tree() : root_(Nodes::makeNewRoot()) {}
+
+Tree::~Tree() {
+  freeLists(root_);
+  Nodes::freeRecursive(root_);
+}
+
+bool Tree::add(KEY, Nodes::Value value) {
+  Change change = {value, false, false};
+  Actions::upsertLeaf(root_, KARGS, addValue, &change);
+  return change.done;
+}
+
+bool Tree::remove(KEY, Nodes::Value value) {
+  Change change = {value, false, false};
+  while (true) {
+    Actions::upsertLeaf(root_, KARGS, removeValue, &change);
+    if (!change.last) {
+      return change.done;
+    }
+    Nodes::Leaf* leaf = Actions::removeLeafIf(root_, KARGS, onlyHolds, &value);
+    if (leaf != nullptr) {
+      retireList(leaf->value);
+      Epoch::retire(leaf, Nodes::deallocate);
+      return true;
+    }
+    // a value was added in the meantime, or the key removed
+    change.last = false;
+  }
+}
+
+size_t Tree::count(KEY) {
+  size_t count = 0;
+  Actions::readLeaf(root_, KARGS, readCount, &count);
+  return count;
+}
+
+void Tree::forEach(KEY, const Callback& callback) {
+  // keeps the tree of a large key alive while it is walked
+  Epoch::Guard guard;
+  Read read;
+  if (!Actions::readLeaf(root_, KARGS, readValues, &read)) {
+    return;
+  }
+  if (read.large_root != nullptr) {
+    forEachLarge(read.large_root, callback);
+    return;
+  }
+  for (Nodes::Value value : read.values) {
+    if (!callback(value)) {
+      return;
+    }
+  }
+}
+
+} // namespace Multi
@@ -0,0 +1,58 @@
+#ifndef MULTI
+#define MULTI
+
+#include "nodes.hpp"
+#include <functional>
+
+// Trees mapping a key to a set of values, e.g. secondary indexes mapping a
+// key to row ids.
+//
+// The leaf of a key points to its values rather than holding one: a sorted
+// array growing by doubling, switching to a tree of its own once it holds
+// more than MULTI_ARRAY_MAX values, and back to an array when it gets small
+// again. The values of a key are modified under the write lock of the node
+// holding its leaf, readers copy them optimistically and validate the node
+// as for any lookup. Values of large keys are read through their own tree,
+// so an iteration concurrent with writes of the key sees each value present
+// during the whole iteration, and maybe some of the others.
+//
+// The leaves do not hold values usable by Actions, the tree is only to be
+// used through Multi::Tree, and without snapshots.
+namespace Multi {
+
+// Values of a key above which they move to a tree
+#define MULTI_ARRAY_MAX 128
+
+// All the operations can run concurrently.
+class Tree {
+public:
+  Tree();
+  // Frees the tree, no operation may be running on it
+  ~Tree();
+
+  Tree(const Tree&) = delete;
+  Tree& operator=(const Tree&) = delete;
+
+  // Returns false if the key already had the value
+  bool add(KEY, Nodes::Value value);
+  // Returns false if the key did not have the value. The key leaves the tree
+  // with its last value.
+  bool remove(KEY, Nodes::Value value);
+
+  // Number of values of the key, 0 if it is not in the tree
+  size_t count(KEY);
+
+  // Called in ascending order of the values of the key, returning false
+  // stops the iteration
+  typedef std::function<bool(Nodes::Value value)> Callback;
+  void forEach(KEY, const Callback& callback);
+
+  Nodes::Header* root() const { return root_; }
+
+private:
+  Nodes::Header* root_;
+};
+
+} // namespace Multi
+
+#endif // MULTI
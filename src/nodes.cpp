@@ -1,7 +1,17 @@
 #include "nodes.hpp"
+#include "cache.hpp"
+#include "snapshot.hpp"
 #include "utils.hpp"
 #include <algorithm>
+#include <atomic>
 #include <emmintrin.h>
+#include <limits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef CACHE_MODE
+#include <malloc.h>
+#endif
 
 namespace Nodes {
 
@@ -14,8 +24,14 @@ void* Header::getNode() const {
     action(4);                                                                 \
   if (nt == Type::NODE16)                                                      \
     action(16);                                                                \
+  if (nt == Type::NODE32)                                                      \
+    action(32);                                                                \
   if (nt == Type::NODE48)                                                      \
     action(48);                                                                \
+  if (nt == Type::NODE64)                                                      \
+    action(64);                                                                \
+  if (nt == Type::NODE128)                                                     \
+    action(128);                                                               \
   if (nt == Type::NODE256)                                                     \
     action(256);                                                               \
   ShouldNotReachHere;
@@ -31,16 +47,80 @@ template <Type NT, bool END_CHILD> Header* makeNewNode() {
   // templating
   size_t node_size = nodeSize(NT);
   node_size += END_CHILD ? sizeof(void*) : 0;
+  return initNode(allocate(sizeof(Header) + node_size), NT, END_CHILD);
+}
+
+#ifdef CACHE_MODE
+void* allocate(size_t size) {
+  void* memory = malloc(size);
+  Cache::countBytes(malloc_usable_size(memory));
+  return memory;
+}
+
+void deallocate(void* memory) {
+  disown(memory);
+  free(memory);
+}
+
+void disown(void* memory) {
+  Cache::countBytes(-(int64_t)malloc_usable_size(memory));
+}
+#endif
+
+Header* makeNewNode(Type nt) {
+  return initNode(allocate(sizeof(Header) + nodeSize(nt) + sizeof(void*)),
+                  nt, true);
+}
+
+size_t capacity(Type nt) {
+#define CAPACITY_ACTION(N) return N
+  DISPATCH_CHILDREN_COUNT(CAPACITY_ACTION, nt)
+  return 0;
+}
+
+namespace {
+std::atomic<TypeSet> node_types(DEFAULT_TYPES);
+}
 
-  Header* header = (Header*)malloc(sizeof(Header) + node_size);
-  header->type = NT;
+void setNodeTypes(TypeSet types) {
+  node_types.store(types | typeBit(Type::NODE4) | typeBit(Type::NODE256));
+}
+
+TypeSet nodeTypes() { return node_types.load(std::memory_order_relaxed); }
+
+Type fittingType(size_t children_count) {
+  TypeSet types = nodeTypes();
+  for (size_t i = 0; i < TYPE_COUNT; ++i) {
+    Type nt = (Type)i;
+    if ((types & typeBit(nt)) != 0 && capacity(nt) >= children_count) {
+      return nt;
+    }
+  }
+  ShouldNotReachHere;
+  return Type::NODE256;
+}
+
+Header* initNode(void* memory, Type nt, bool end_child) {
+  size_t node_size = nodeSize(nt);
+  node_size += end_child ? sizeof(void*) : 0;
+
+  Header* header = (Header*)memory;
+  header->type = nt;
+  header->compacted = false;
   header->prefix_len = 0;
-  header->prefix = nullptr;
+  header->prefix_allocated = false;
   header->version = 0;
   header->min_key = 255;
   header->children_count = 0;
-
-  if (NT == Type::NODE48) {
+#ifdef ORDER_STATS
+  header->subtree_count = 0;
+  header->subtree_pins = 0;
+#endif
+#ifdef SNAPSHOTS
+  header->generation = Snapshot::generation();
+#endif
+
+  if (nt == Type::NODE48) {
     memset(header->getNode(), Node48::EMPTY, 256);
     memset(((uint8_t*)header->getNode()) + 256, 0, node_size - 256);
   } else {
@@ -52,37 +132,146 @@ template <Type NT, bool END_CHILD> Header* makeNewNode() {
 
 template Header* makeNewNode<Type::NODE4, true>();
 template Header* makeNewNode<Type::NODE16, true>();
+template Header* makeNewNode<Type::NODE32, true>();
 template Header* makeNewNode<Type::NODE48, true>();
+template Header* makeNewNode<Type::NODE64, true>();
+template Header* makeNewNode<Type::NODE128, true>();
 template Header* makeNewNode<Type::NODE256, true>();
 // Only the root node needs to be end-child-less
 template Header* makeNewNode<Type::NODE256, false>();
 
 Header* makeNewRoot() { return makeNewNode<Type::NODE256, true>(); }
 
+uint8_t* initPrefix(Header* node_header, size_t prefix_len) {
+  assert(node_header->prefix_len == 0 && !node_header->prefix_allocated);
+  assert(prefix_len <= std::numeric_limits<prefix_size_t>::max());
+  node_header->prefix_len = prefix_len;
+  if (prefix_len <= PREFIX_SIZE) {
+    return node_header->inline_prefix;
+  }
+  node_header->prefix_allocated = true;
+  node_header->allocated_prefix = (uint8_t*)allocate(prefix_len);
+  return node_header->allocated_prefix;
+}
+
+// Children of the node types keeping them in key bit order at the start of
+// their children array, nullptr for the other types
+void** packedChildren(Header* node_header) {
+  switch (node_header->type) {
+  case Type::NODE4:
+    return ((Node4*)node_header->getNode())->children;
+  case Type::NODE16:
+    return ((Node16*)node_header->getNode())->children;
+  case Type::NODE32:
+    return ((Node32*)node_header->getNode())->children;
+  case Type::NODE64:
+    return ((Node64*)node_header->getNode())->children;
+  case Type::NODE128:
+    return ((Node128*)node_header->getNode())->children;
+  default:
+    return nullptr;
+  }
+}
+
+// Keys of the node types keeping them in a sorted array, nullptr for the
+// other types
+uint8_t* sortedKeys(Header* node_header) {
+  switch (node_header->type) {
+  case Type::NODE4:
+    return ((Node4*)node_header->getNode())->keys;
+  case Type::NODE16:
+    return ((Node16*)node_header->getNode())->keys;
+  case Type::NODE32:
+    return ((Node32*)node_header->getNode())->keys;
+  default:
+    return nullptr;
+  }
+}
+
+// Bitmap of Node64 and Node128, nullptr for the other types
+uint64_t* keyBitmap(Header* node_header) {
+  switch (node_header->type) {
+  case Type::NODE64:
+    return ((Node64*)node_header->getNode())->bitmap;
+  case Type::NODE128:
+    return ((Node128*)node_header->getNode())->bitmap;
+  default:
+    return nullptr;
+  }
+}
+
+// children_count, clamped as it might be read while the node is being
+// modified
+size_t clampedCount(const Header* node_header) {
+  return std::min<size_t>(node_header->children_count,
+                          capacity(node_header->type));
+}
+
+inline bool hasBit(const uint64_t* bitmap, uint8_t key) {
+  return ((bitmap[key / 64] >> (key % 64)) & 1) != 0;
+}
+
+// Number of bits set below `key`, i.e. the index of its child
+size_t bitmapIndex(const uint64_t* bitmap, uint8_t key) {
+  size_t word = key / 64;
+  size_t index =
+      __builtin_popcountll(bitmap[word] & ((1ull << (key % 64)) - 1));
+  for (size_t i = 0; i < word; ++i) {
+    index += __builtin_popcountll(bitmap[i]);
+  }
+  return index;
+}
+
+// Smallest bit set from `from` on, 256 if there is none
+size_t nextBit(const uint64_t* bitmap, size_t from) {
+  for (size_t word = from / 64; word < 4; ++word) {
+    uint64_t bits = bitmap[word];
+    if (word == from / 64) {
+      bits &= ~0ull << (from % 64);
+    }
+    if (bits != 0) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+  }
+  return 256;
+}
+
+// Greatest bit set up to `to` (inclusive), -1 if there is none
+int prevBit(const uint64_t* bitmap, int to) {
+  for (int word = to / 64; to >= 0 && word >= 0; --word) {
+    uint64_t bits = bitmap[word];
+    if (word == to / 64) {
+      bits &= ~0ull >> (63 - to % 64);
+    }
+    if (bits != 0) {
+      return word * 64 + 63 - __builtin_clzll(bits);
+    }
+  }
+  return -1;
+}
+
 void freeNode(void* node) {
   assert(node != nullptr);
   if (isLeaf(node)) {
-    free(asLeaf(node));
+    freeLeaf(asLeaf(node));
   } else {
     freeRecursive((Header*)node);
   }
 }
 
 void freeRecursive(Header* node_header) {
-  free(node_header->prefix);
-  node_header->prefix = nullptr;
+  freePrefix(node_header);
+  node_header->prefix_allocated = false;
   node_header->prefix_len = 0;
-  free(*findChildKeyEnd(node_header));
+  Leaf* key_end_child = *findChildKeyEnd(node_header);
+  if (key_end_child != nullptr) {
+    freeLeaf(key_end_child);
+  }
 
-  if (node_header->type == Type::NODE4) {
-    auto node = (Node4*)node_header->getNode();
-    for (uint8_t i = 0; i < node_header->children_count; ++i) {
-      freeNode(node->children[i]);
-    }
-  } else if (node_header->type == Type::NODE16) {
-    auto node = (Node16*)node_header->getNode();
-    for (uint8_t i = 0; i < node_header->children_count; ++i) {
-      freeNode(node->children[i]);
+  void** children = packedChildren(node_header);
+  if (children != nullptr) {
+    for (size_t i = 0; i < node_header->children_count; ++i) {
+      freeNode(children[i]);
     }
   } else if (node_header->type == Type::NODE48) {
     auto node = (Node48*)node_header->getNode();
@@ -107,19 +296,63 @@ void freeRecursive(Header* node_header) {
     return;
   }
 
-  free(node_header);
+  freeHeader(node_header);
 }
 
-Leaf* makeNewLeaf(KEY, Value value) {
-  Leaf* leaf = (Leaf*)malloc(sizeof(Leaf) + key_len);
+Leaf* initLeaf(void* memory, KEY, Value value, size_t payload_len,
+               size_t key_offset) {
+  Leaf* leaf = (Leaf*)memory;
   assert((((uintptr_t)leaf) & 1) == 0);
 
-  memcpy(getKey(leaf), KARGS);
+#ifdef LEAF_SUFFIXES
+  assert(key_offset <= key_len);
+  leaf->key_offset = key_offset;
+#else
+  key_offset = 0;
+#endif
+  memcpy(getKey(leaf) + key_offset, key + key_offset, key_len - key_offset);
   leaf->key_len = key_len;
+  leaf->payload_len = payload_len;
+  leaf->compacted = false;
   leaf->value = value;
+#ifdef CACHE_MODE
+  // new keys get a chance to be read before being evicted
+  leaf->referenced = 1;
+#endif
   return leaf;
 }
 
+Leaf* makeNewLeaf(KEY, Value value, size_t key_offset) {
+#ifndef LEAF_SUFFIXES
+  key_offset = 0;
+#endif
+  return initLeaf(allocate(leafSize(key_len - key_offset, 0)), KARGS, value, 0,
+                  key_offset);
+}
+
+// Hands prefix, key end child and counters over to a node replacing
+// old_header
+void moveHeader(Header* old_header, Header* new_header) {
+#ifdef ORDER_STATS
+  new_header->subtree_count = Nodes::settledSubtreeCount(old_header);
+#endif
+  new_header->prefix_len = old_header->prefix_len;
+  new_header->prefix_allocated = old_header->prefix_allocated;
+  // the inline bytes, or the pointer to the allocated prefix
+  memcpy(new_header->inline_prefix, old_header->inline_prefix, PREFIX_SIZE);
+  if (old_header->compacted && old_header->prefix_allocated) {
+    // the prefix belongs to the compacted block
+    new_header->allocated_prefix = (uint8_t*)allocate(old_header->prefix_len);
+    memcpy(new_header->allocated_prefix, old_header->allocated_prefix,
+           old_header->prefix_len);
+  }
+
+  Leaf* child = *findChildKeyEnd(old_header);
+  if (child != nullptr) {
+    addChildKeyEnd(new_header, child);
+  }
+}
+
 bool isFull(const Header* node_header) {
 #define ISFULL_ACTION(N) return node_header->children_count == N
   DISPATCH_CHILDREN_COUNT(ISFULL_ACTION, node_header->type)
@@ -128,50 +361,50 @@ bool isFull(const Header* node_header) {
 
 void grow(Header** node_header) {
   assert(isFull(*node_header));
+  resize(node_header, fittingType((*node_header)->children_count + 1));
+}
 
-  Header* new_header;
-  if ((*node_header)->type == Type::NODE4) {
-    auto node = (Node4*)(*node_header)->getNode();
-    new_header = makeNewNode<Type::NODE16, true>();
-    auto new_node = (Node16*)new_header->getNode();
-    memcpy(new_node->keys, node->keys, 4);
-    memcpy(new_node->children, node->children, 4 * sizeof(void*));
-  } else if ((*node_header)->type == Type::NODE16) {
-    auto node = (Node16*)(*node_header)->getNode();
-    new_header = makeNewNode<Type::NODE48, true>();
-    auto new_node = (Node48*)new_header->getNode();
-    new_header->min_key = node->keys[0];
-    for (uint8_t i = 0; i < 16; ++i) {
-      new_node->child_index[node->keys[i]] = i;
-      new_node->children[i] = node->children[i];
-    }
-  } else if ((*node_header)->type == Type::NODE48) {
-    auto node = (Node48*)(*node_header)->getNode();
-    new_header = makeNewNode<Type::NODE256, true>();
-    auto new_node = (Node256*)new_header->getNode();
-    new_header->min_key = (*node_header)->min_key;
-    for (uint8_t i = 0; i < 48; ++i) {
-      new_node->children[i] = node->children[node->child_index[i]];
-    }
-  } else {
-    // Node256 can't and should not need to be grown, as it can
-    // hold all key bits at once.
-    ShouldNotReachHere;
-    return;
-  }
+void relocate(Header** node_header) {
+  resize(node_header, (*node_header)->type);
+}
 
-  new_header->children_count = (*node_header)->children_count;
-  new_header->min_key = (*node_header)->min_key;
-  new_header->prefix = (*node_header)->prefix;
-  new_header->prefix_len = (*node_header)->prefix_len;
+void resize(Header** node_header, Type nt) {
+  assert(fittingType((*node_header)->children_count) <= nt);
+  Header* new_header = makeNewNode(nt);
+  forEachChild(*node_header, [&](uint8_t key, void* child) {
+    addChild(new_header, key, child);
+  });
+  moveHeader(*node_header, new_header);
+  *node_header = new_header;
+}
 
-  Leaf* child = *findChildKeyEnd(*node_header);
-  if (child != nullptr) {
-    addChildKeyEnd(new_header, child);
+Header* clone(Header* node_header) {
+  Header* copy = node_header;
+  relocate(&copy);
+  // moveHeader already copied the prefix of compacted nodes
+  if (!node_header->compacted && copy->prefix_allocated) {
+    copy->allocated_prefix = (uint8_t*)allocate(copy->prefix_len);
+    memcpy(copy->allocated_prefix, node_header->allocated_prefix,
+           copy->prefix_len);
   }
+  return copy;
+}
 
-  *node_header = new_header;
-  return;
+bool isUnderfull(const Header* node_header) {
+  // The next smaller type must be left at most 3/4 full, so that it does not
+  // need to grow right away
+  TypeSet types = nodeTypes();
+  for (int i = (int)node_header->type - 1; i >= 0; --i) {
+    if ((types & typeBit((Type)i)) != 0) {
+      return node_header->children_count <= capacity((Type)i) * 3 / 4;
+    }
+  }
+  return false;
+}
+
+void shrink(Header** node_header) {
+  assert(isUnderfull(*node_header));
+  resize(node_header, fittingType((*node_header)->children_count));
 }
 
 // Shift right all elements after 'start' (inclusive)
@@ -185,8 +418,14 @@ void addChildNode16(Header* node_header, uint8_t key, void* child) {
   assert(node_header->type == Type::NODE16);
 
   auto node = (Node16*)node_header->getNode();
-  __m128i key_vec = _mm_set1_epi8(key);
-  __m128i cmp = _mm_cmpgt_epi8(key_vec, _mm_loadu_si128((__m128i*)node->keys));
+  // SSE2 only has signed comparisons, flipping the sign bit of both sides
+  // gives the unsigned order
+  const __m128i sign_bit = _mm_set1_epi8((char)0x80);
+  __m128i key_vec = _mm_xor_si128(_mm_set1_epi8(key), sign_bit);
+  __m128i keys_vec =
+      _mm_xor_si128(_mm_loadu_si128((__m128i*)node->keys), sign_bit);
+  // first key greater than the new one
+  __m128i cmp = _mm_cmplt_epi8(key_vec, keys_vec);
   uint16_t mask = (1u << node_header->children_count) - 1;
   uint16_t bitfield = _mm_movemask_epi8(cmp) & mask;
 
@@ -202,8 +441,77 @@ void addChildNode16(Header* node_header, uint8_t key, void* child) {
   node->children[index] = child;
 }
 
+// Bit i of the result is set if keys[i] > key, for the 32 keys of a Node32.
+// Like in addChildNode16, the sign bit is flipped for the unsigned order.
+uint32_t greaterKeys32(const uint8_t* keys, uint8_t key) {
+#ifdef __AVX2__
+  const __m256i sign_bit = _mm256_set1_epi8((char)0x80);
+  __m256i key_vec = _mm256_xor_si256(_mm256_set1_epi8(key), sign_bit);
+  __m256i keys_vec =
+      _mm256_xor_si256(_mm256_loadu_si256((__m256i*)keys), sign_bit);
+  return _mm256_movemask_epi8(_mm256_cmpgt_epi8(keys_vec, key_vec));
+#else
+  const __m128i sign_bit = _mm_set1_epi8((char)0x80);
+  __m128i key_vec = _mm_xor_si128(_mm_set1_epi8(key), sign_bit);
+  __m128i low = _mm_xor_si128(_mm_loadu_si128((__m128i*)keys), sign_bit);
+  __m128i high =
+      _mm_xor_si128(_mm_loadu_si128((__m128i*)(keys + 16)), sign_bit);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(key_vec, low)) |
+         (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(key_vec, high)) << 16;
+#endif
+}
+
+// Bit i of the result is set if keys[i] == key, for the 32 keys of a Node32
+uint32_t equalKeys32(const uint8_t* keys, uint8_t key) {
+#ifdef __AVX2__
+  __m256i cmp = _mm256_cmpeq_epi8(_mm256_set1_epi8(key),
+                                  _mm256_loadu_si256((__m256i*)keys));
+  return _mm256_movemask_epi8(cmp);
+#else
+  __m128i key_vec = _mm_set1_epi8(key);
+  __m128i low = _mm_cmpeq_epi8(key_vec, _mm_loadu_si128((__m128i*)keys));
+  __m128i high =
+      _mm_cmpeq_epi8(key_vec, _mm_loadu_si128((__m128i*)(keys + 16)));
+  return (uint32_t)_mm_movemask_epi8(low) |
+         (uint32_t)_mm_movemask_epi8(high) << 16;
+#endif
+}
+
+// Mask of the first children_count bits of a Node32 key mask
+uint32_t usedKeys32(const Header* node_header) {
+  return (uint32_t)((1ull << clampedCount(node_header)) - 1);
+}
+
+void addChildNode32(Header* node_header, uint8_t key, void* child) {
+  assert(node_header->type == Type::NODE32);
+
+  auto node = (Node32*)node_header->getNode();
+  // first key greater than the new one
+  uint32_t bitfield =
+      greaterKeys32(node->keys, key) & usedKeys32(node_header);
+  size_t index =
+      bitfield ? __builtin_ctz(bitfield) : node_header->children_count;
+
+  shiftRight(node->keys, node->children, node_header->children_count, index);
+  node->keys[index] = key;
+  node->children[index] = child;
+}
+
+void addChildBitmap(Header* node_header, uint8_t key, void* child) {
+  uint64_t* bitmap = keyBitmap(node_header);
+  void** children = packedChildren(node_header);
+  assert(!hasBit(bitmap, key));
+
+  size_t index = bitmapIndex(bitmap, key);
+  memmove(children + index + 1, children + index,
+          (node_header->children_count - index) * sizeof(void*));
+  children[index] = child;
+  bitmap[key / 64] |= 1ull << (key % 64);
+}
+
 void addChild(Header* node_header, KEY, Value value, size_t depth) {
-  addChild(node_header, key[depth], smuggleLeaf(makeNewLeaf(KARGS, value)));
+  addChild(node_header, key[depth],
+           smuggleLeaf(makeNewLeaf(KARGS, value, depth)));
 }
 
 void addChild(Header* node_header, uint8_t key, void* child) {
@@ -221,6 +529,11 @@ void addChild(Header* node_header, uint8_t key, void* child) {
     node->children[i] = child;
   } else if (node_header->type == Type::NODE16) {
     addChildNode16(node_header, key, child);
+  } else if (node_header->type == Type::NODE32) {
+    addChildNode32(node_header, key, child);
+  } else if (node_header->type == Type::NODE64 ||
+             node_header->type == Type::NODE128) {
+    addChildBitmap(node_header, key, child);
   } else if (node_header->type == Type::NODE48) {
     node_header->min_key = std::min(node_header->min_key, key);
     auto node = (Node48*)node_header->getNode();
@@ -243,6 +556,69 @@ void addChildKeyEnd(Header* node_header, KEY, Value value) {
   addChildKeyEnd(node_header, makeNewLeaf(KARGS, value));
 }
 
+// Shift left all elements after 'start' (exclusive)
+void shiftLeft(uint8_t* keys, void** children, size_t count, size_t start) {
+  size_t shift_count = count - start - 1;
+  memmove(keys + start, keys + start + 1, shift_count);
+  memmove(children + start, children + start + 1, shift_count * sizeof(void**));
+  keys[count - 1] = 0;
+  children[count - 1] = nullptr;
+}
+
+void removeChild(Header* node_header, uint8_t key) {
+  if (sortedKeys(node_header) != nullptr) {
+    uint8_t* keys = sortedKeys(node_header);
+    void** children = packedChildren(node_header);
+    size_t i = 0;
+    while (keys[i] != key) {
+      ++i;
+      assert(i < node_header->children_count);
+    }
+    shiftLeft(keys, children, node_header->children_count, i);
+  } else if (keyBitmap(node_header) != nullptr) {
+    uint64_t* bitmap = keyBitmap(node_header);
+    void** children = packedChildren(node_header);
+    assert(hasBit(bitmap, key));
+    size_t index = bitmapIndex(bitmap, key);
+    size_t last = node_header->children_count - 1;
+    memmove(children + index, children + index + 1,
+            (last - index) * sizeof(void*));
+    children[last] = nullptr;
+    bitmap[key / 64] &= ~(1ull << (key % 64));
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    uint8_t index = node->child_index[key];
+    assert(index != Node48::EMPTY);
+    // keep the used slots contiguous, addChild appends after them
+    uint8_t last = node_header->children_count - 1;
+    if (index != last) {
+      size_t last_key = 0;
+      while (node->child_index[last_key] != last) {
+        ++last_key;
+      }
+      node->children[index] = node->children[last];
+      node->child_index[last_key] = index;
+    }
+    node->children[last] = nullptr;
+    node->child_index[key] = Node48::EMPTY;
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    assert(node->children[key] != nullptr);
+    node->children[key] = nullptr;
+  } else {
+    ShouldNotReachHere;
+  }
+
+  --(node_header->children_count);
+
+  if (key == node_header->min_key) {
+    node_header->min_key = 255;
+    forEachChild(node_header, [&](uint8_t child_key, void*) {
+      node_header->min_key = std::min(node_header->min_key, child_key);
+    });
+  }
+}
+
 void addChildKeyEnd(Header* node_header, Leaf* child) {
   size_t node_size = nodeSize(node_header->type);
   void* node = node_header->getNode();
@@ -261,6 +637,25 @@ void** findChildNode16(Header* node_header, uint8_t key) {
   return bitfield ? &(node->children[__builtin_ctz(bitfield)]) : nullptr;
 }
 
+void** findChildNode32(Header* node_header, uint8_t key) {
+  assert(node_header->type == Type::NODE32);
+
+  auto node = (Node32*)node_header->getNode();
+  uint32_t bitfield = equalKeys32(node->keys, key) & usedKeys32(node_header);
+  return bitfield ? &(node->children[__builtin_ctz(bitfield)]) : nullptr;
+}
+
+void** findChildBitmap(Header* node_header, uint8_t key) {
+  uint64_t* bitmap = keyBitmap(node_header);
+  if (!hasBit(bitmap, key)) {
+    return nullptr;
+  }
+  // clamped, like clampedCount
+  size_t index = std::min(bitmapIndex(bitmap, key),
+                          capacity(node_header->type) - 1);
+  return &(packedChildren(node_header)[index]);
+}
+
 void** findChild(Header* node_header, uint8_t key) {
   if (node_header->type == Type::NODE4) {
     auto node = (Node4*)node_header->getNode();
@@ -272,6 +667,11 @@ void** findChild(Header* node_header, uint8_t key) {
     return nullptr;
   } else if (node_header->type == Type::NODE16) {
     return findChildNode16(node_header, key);
+  } else if (node_header->type == Type::NODE32) {
+    return findChildNode32(node_header, key);
+  } else if (node_header->type == Type::NODE64 ||
+             node_header->type == Type::NODE128) {
+    return findChildBitmap(node_header, key);
   } else if (node_header->type == Type::NODE48) {
     auto node = (Node48*)node_header->getNode();
     uint8_t child_index = node->child_index[key];
@@ -296,4 +696,153 @@ Leaf** findChildKeyEnd(Header* node_header) {
   return (Leaf**)key_end_child;
 }
 
+// The following store the key bit of the child they return in out_key, if
+// not nullptr
+void* childWithKey(void* child, uint8_t key, uint8_t* out_key) {
+  if (out_key != nullptr) {
+    *out_key = key;
+  }
+  return child;
+}
+
+// Child of a bitmap node for a key bit set in its bitmap, nullptr for a key
+// bit out of range
+void* bitmapChild(Header* node_header, int key, uint8_t* out_key) {
+  if (key < 0 || key > 255) {
+    return nullptr;
+  }
+  void** child = findChildBitmap(node_header, key);
+  return child == nullptr ? nullptr : childWithKey(*child, key, out_key);
+}
+
+void* findMinimumChild(Header* node_header, uint8_t* out_key) {
+  if (node_header->children_count == 0) {
+    return nullptr;
+  }
+
+  if (sortedKeys(node_header) != nullptr) {
+    return childWithKey(packedChildren(node_header)[0],
+                        sortedKeys(node_header)[0], out_key);
+  } else if (keyBitmap(node_header) != nullptr) {
+    return bitmapChild(node_header, nextBit(keyBitmap(node_header), 0),
+                       out_key);
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    uint8_t child_index = node->child_index[node_header->min_key];
+    if (child_index == Node48::EMPTY)
+      return nullptr;
+    return childWithKey(node->children[child_index], node_header->min_key,
+                        out_key);
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    return childWithKey(node->children[node_header->min_key],
+                        node_header->min_key, out_key);
+  }
+
+  ShouldNotReachHere;
+  return nullptr;
+}
+
+void* findMaximumChild(Header* node_header, uint8_t* out_key) {
+  if (node_header->children_count == 0) {
+    return nullptr;
+  }
+
+  if (sortedKeys(node_header) != nullptr) {
+    size_t i = clampedCount(node_header) - 1;
+    return childWithKey(packedChildren(node_header)[i],
+                        sortedKeys(node_header)[i], out_key);
+  } else if (keyBitmap(node_header) != nullptr) {
+    return bitmapChild(node_header, prevBit(keyBitmap(node_header), 255),
+                       out_key);
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    for (int k = 255; k >= 0; --k) {
+      if (node->child_index[k] != Node48::EMPTY) {
+        return childWithKey(node->children[node->child_index[k]], k, out_key);
+      }
+    }
+    return nullptr;
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    for (int k = 255; k >= 0; --k) {
+      if (node->children[k] != nullptr) {
+        return childWithKey(node->children[k], k, out_key);
+      }
+    }
+    return nullptr;
+  }
+
+  ShouldNotReachHere;
+  return nullptr;
+}
+
+void* findChildGreater(Header* node_header, uint8_t key, uint8_t* out_key) {
+  if (sortedKeys(node_header) != nullptr) {
+    uint8_t* keys = sortedKeys(node_header);
+    for (size_t i = 0; i < clampedCount(node_header); ++i) {
+      if (keys[i] > key) {
+        return childWithKey(packedChildren(node_header)[i], keys[i], out_key);
+      }
+    }
+    return nullptr;
+  } else if (keyBitmap(node_header) != nullptr) {
+    return bitmapChild(node_header, nextBit(keyBitmap(node_header), key + 1),
+                       out_key);
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    for (size_t k = (size_t)key + 1; k < 256; ++k) {
+      if (node->child_index[k] != Node48::EMPTY) {
+        return childWithKey(node->children[node->child_index[k]], k, out_key);
+      }
+    }
+    return nullptr;
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    for (size_t k = (size_t)key + 1; k < 256; ++k) {
+      if (node->children[k] != nullptr) {
+        return childWithKey(node->children[k], k, out_key);
+      }
+    }
+    return nullptr;
+  }
+
+  ShouldNotReachHere;
+  return nullptr;
+}
+
+void* findChildLess(Header* node_header, uint8_t key, uint8_t* out_key) {
+  if (sortedKeys(node_header) != nullptr) {
+    uint8_t* keys = sortedKeys(node_header);
+    for (int i = (int)clampedCount(node_header) - 1; i >= 0; --i) {
+      if (keys[i] < key) {
+        return childWithKey(packedChildren(node_header)[i], keys[i], out_key);
+      }
+    }
+    return nullptr;
+  } else if (keyBitmap(node_header) != nullptr) {
+    return bitmapChild(node_header, prevBit(keyBitmap(node_header), key - 1),
+                       out_key);
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    for (int k = (int)key - 1; k >= 0; --k) {
+      if (node->child_index[k] != Node48::EMPTY) {
+        return childWithKey(node->children[node->child_index[k]], k, out_key);
+      }
+    }
+    return nullptr;
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    for (int k = (int)key - 1; k >= 0; --k) {
+      if (node->children[k] != nullptr) {
+        return childWithKey(node->children[k], k, out_key);
+      }
+    }
+    return nullptr;
+  }
+
+  ShouldNotReachHere;
+  return nullptr;
+}
+
 } // namespace Nodes
@@ -5,11 +5,14 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
 #define KEY const uint8_t *key, size_t key_len
 #define KARGS key, key_len
 
+// Prefixes up to this size are stored in the node header, longer ones in an
+// allocation of their own
 #define PREFIX_SIZE 8
 
 namespace Nodes {
@@ -21,32 +24,90 @@ typedef uint64_t version_t;
 struct Leaf;
 bool isLeaf(const void* ptr);
 
-inline size_t capPrefixSize(size_t prefix_size) {
-  return std::min(prefix_size, (size_t)PREFIX_SIZE);
-}
+// Ordered by the number of children the node holds
+enum class Type : uint8_t {
+  NODE4,
+  NODE16,
+  NODE32,
+  NODE48,
+  NODE64,
+  NODE128,
+  NODE256
+};
+constexpr size_t TYPE_COUNT = 7;
+
+// Bit set of node types, indexed by Type
+typedef uint32_t TypeSet;
+constexpr TypeSet typeBit(Type nt) { return 1u << (uint8_t)nt; }
+
+// The original four node types of the ART paper
+constexpr TypeSet CLASSIC_TYPES = typeBit(Type::NODE4) | typeBit(Type::NODE16) |
+                                  typeBit(Type::NODE48) |
+                                  typeBit(Type::NODE256);
+// Node48 is left out, Node64 takes less memory for more children
+constexpr TypeSet DEFAULT_TYPES =
+    typeBit(Type::NODE4) | typeBit(Type::NODE16) | typeBit(Type::NODE32) |
+    typeBit(Type::NODE64) | typeBit(Type::NODE128) | typeBit(Type::NODE256);
 
-enum class Type : uint8_t { NODE4, NODE16, NODE48, NODE256 };
+// Sets the node types grow, shrink and fittingType choose from, for all trees.
+// Node4 and Node256 are always part of it. Nodes of the other types keep
+// working, and are replaced by nodes of the new set as they grow or shrink.
+void setNodeTypes(TypeSet types);
+TypeSet nodeTypes();
 
 // When a node is allocated, the memory allocated shall have the
 // following structure:
 // Header -- NodeX -- [End child ptr]
 struct Header {
   Type type;
-  uint8_t children_count;
-  // Compressed prefix length. Real prefix length in Header::prefix
-  // is capped at PREFIX_SIZE.
+  // Lives in a block of memory made by Compaction::compact, see freeHeader
+  bool compacted;
+  // Node256 can hold 256 children, which does not fit in a uint8_t
+  uint16_t children_count;
+  // Compressed prefix length
   prefix_size_t prefix_len;
   // Value of the minimum key bit currently stored in this node.
   // Valid only for Node48 and Node256
   uint8_t min_key;
-  // Compressed prefix
-  uint8_t* prefix;
+  // Whether the prefix has an allocation of its own. It is decided when the
+  // prefix is made (see initPrefix), prefixes only shrink in place.
+  bool prefix_allocated;
+  // Compressed prefix, see getPrefix
+  union {
+    uint8_t* allocated_prefix;
+    uint8_t inline_prefix[PREFIX_SIZE];
+  };
   // For synchronization
   version_t version;
+#ifdef ORDER_STATS
+  // Number of keys stored in the subtree rooted in this node
+  uint64_t subtree_count;
+  // Writers about to add to subtree_count without the lock, see
+  // pinSubtreeCount
+  uint32_t subtree_pins;
+#endif
+#ifdef SNAPSHOTS
+  // Snapshot generation the node was made in, see snapshot.hpp
+  uint64_t generation;
+#endif
 
   void* getNode() const;
 };
 
+static_assert(PREFIX_SIZE == sizeof(uint8_t*),
+              "inline prefixes take the place of the pointer");
+
+inline uint8_t* getPrefix(const Header* node_header) {
+  return node_header->prefix_allocated
+             ? node_header->allocated_prefix
+             : (uint8_t*)node_header->inline_prefix;
+}
+
+// Sets the prefix length of a node which is not reachable yet, whose
+// prefix is empty, and returns the storage of the prefix for the caller to
+// fill
+uint8_t* initPrefix(Header* node_header, size_t prefix_len);
+
 struct Node4 {
   uint8_t keys[4];
   void* children[4];
@@ -57,6 +118,11 @@ struct Node16 {
   void* children[16];
 };
 
+struct Node32 {
+  uint8_t keys[32];
+  void* children[32];
+};
+
 struct Node48 {
   static constexpr uint8_t CHILDREN_COUNT = 48;
   static constexpr uint8_t EMPTY =
@@ -66,38 +132,185 @@ struct Node48 {
   void* children[CHILDREN_COUNT];
 };
 
+// Bit k of bitmap is set if the node has a child for key bit k. The children
+// are kept in key bit order: the index of a child is the number of bits set
+// before its own.
+template <size_t N> struct NodeBitmap {
+  uint64_t bitmap[4];
+  void* children[N];
+};
+
+typedef NodeBitmap<64> Node64;
+typedef NodeBitmap<128> Node128;
+
 struct Node256 {
   void* children[256];
 };
 
+// Maximum number of children of the node type
+size_t capacity(Type nt);
+
+size_t nodeSize(Type nt);
+
 template <Type NT, bool END_CHILD> Header* makeNewNode();
+// Node with a key end child, for a type known at runtime
+Header* makeNewNode(Type nt);
+// Smallest node type holding the given number of children
+Type fittingType(size_t children_count);
+// Initializes an empty node in memory of at least
+// sizeof(Header) + nodeSize(nt) (+ sizeof(void*) with end_child) bytes
+Header* initNode(void* memory, Type nt, bool end_child);
 Header* makeNewRoot();
 void freeRecursive(Header* node_header);
 
 bool isFull(const Header* node_header);
 void grow(Header** node_header);
+// Moves the node to a new allocation of the same type
+void relocate(Header** node_header);
+// Moves the node to a new node of the given type, which must hold its children
+void resize(Header** node_header, Type nt);
+// Copy of the node with its own prefix, sharing the children
+Header* clone(Header* node_header);
+// Whether the node has few enough children to move to a smaller node type
+bool isUnderfull(const Header* node_header);
+void shrink(Header** node_header);
 
 void addChild(Header* node_header, KEY, Value value, size_t depth);
 void addChild(Header* node_header, uint8_t key, void* child);
 void addChildKeyEnd(Header* node_header, KEY, Value value);
 void addChildKeyEnd(Header* node_header, Leaf* child);
+// The child must exist. The key end child is removed by setting it to nullptr.
+void removeChild(Header* node_header, uint8_t key);
 void** findChild(Nodes::Header* node_header, uint8_t key);
 Leaf** findChildKeyEnd(Header* node_header);
 
+// The following return nullptr if there is no such child. The key end child
+// is never considered. The key bit of the child is stored in out_key, if
+// given.
+void* findMinimumChild(Header* node_header, uint8_t* out_key = nullptr);
+void* findMaximumChild(Header* node_header, uint8_t* out_key = nullptr);
+// Child with the smallest key bit greater than `key`
+void* findChildGreater(Header* node_header, uint8_t key,
+                       uint8_t* out_key = nullptr);
+// Child with the greatest key bit smaller than `key`
+void* findChildLess(Header* node_header, uint8_t key,
+                    uint8_t* out_key = nullptr);
+
 inline Header* asHeader(const void* ptr) {
   assert(!isLeaf(ptr));
   return (Nodes::Header*)ptr;
 }
 
+template <size_t N, typename F>
+void forEachBitmapChild(NodeBitmap<N>* node, F fn) {
+  size_t index = 0;
+  for (size_t word = 0; word < 4; ++word) {
+    // index is checked as the node might be read while being modified
+    for (uint64_t bits = node->bitmap[word]; bits != 0 && index < N;
+         bits &= bits - 1) {
+      fn((uint8_t)(word * 64 + __builtin_ctzll(bits)), node->children[index++]);
+    }
+  }
+}
+
+// Calls fn(key_bit, child) on every child of the node, in ascending key bit
+// order. The key end child is not visited.
+template <typename F> void forEachChild(Header* node_header, F fn) {
+  if (node_header->type == Type::NODE4) {
+    auto node = (Node4*)node_header->getNode();
+    for (uint8_t i = 0; i < node_header->children_count; ++i) {
+      fn(node->keys[i], node->children[i]);
+    }
+  } else if (node_header->type == Type::NODE16) {
+    auto node = (Node16*)node_header->getNode();
+    for (uint8_t i = 0; i < node_header->children_count; ++i) {
+      fn(node->keys[i], node->children[i]);
+    }
+  } else if (node_header->type == Type::NODE32) {
+    auto node = (Node32*)node_header->getNode();
+    for (uint8_t i = 0; i < node_header->children_count; ++i) {
+      fn(node->keys[i], node->children[i]);
+    }
+  } else if (node_header->type == Type::NODE64) {
+    forEachBitmapChild((Node64*)node_header->getNode(), fn);
+  } else if (node_header->type == Type::NODE128) {
+    forEachBitmapChild((Node128*)node_header->getNode(), fn);
+  } else if (node_header->type == Type::NODE48) {
+    auto node = (Node48*)node_header->getNode();
+    for (size_t key = 0; key < 256; ++key) {
+      if (node->child_index[key] != Node48::EMPTY) {
+        fn((uint8_t)key, node->children[node->child_index[key]]);
+      }
+    }
+  } else if (node_header->type == Type::NODE256) {
+    auto node = (Node256*)node_header->getNode();
+    for (size_t key = 0; key < 256; ++key) {
+      if (node->children[key] != nullptr) {
+        fn((uint8_t)key, node->children[key]);
+      }
+    }
+  } else {
+    ShouldNotReachHere;
+  }
+}
+
 // When a Leaf is allocated, the memory allocated shall always be enough
 // to accomodate the whole key, immediately after the last field in the
-// struct.
+// struct, followed by payload_len bytes of payload (8-aligned).
 struct Leaf {
-  size_t key_len;
+  uint32_t key_len;
+  // Size of the value stored inline after the key, if any
+  uint32_t payload_len : 31;
+  // Lives in a block of memory made by Compaction::compact, see freeLeaf
+  uint32_t compacted : 1;
   Value value;
+#ifdef LEAF_SUFFIXES
+  // Number of leading key bytes which are not stored, at most the depth of
+  // the leaf in the tree
+  uint32_t key_offset;
+#endif
+#ifdef CACHE_MODE
+  // CLOCK bit, set when the key is read or written, see cache.hpp
+  uint8_t referenced;
+#endif
 };
 
-inline uint8_t* getKey(Leaf* leaf) { return (uint8_t*)(leaf + 1); }
+inline size_t keyOffset(const Leaf* leaf) {
+#ifdef LEAF_SUFFIXES
+  return leaf->key_offset;
+#else
+  (void)leaf;
+  return 0;
+#endif
+}
+
+// Byte i of the key is getKey(leaf)[i]. With LEAF_SUFFIXES only the bytes from
+// keyOffset(leaf) on are stored, the ones before are on the path to the leaf.
+inline uint8_t* getKey(Leaf* leaf) {
+  return (uint8_t*)(leaf + 1) - keyOffset(leaf);
+}
+
+// Number of key bytes stored in the leaf
+inline size_t storedKeyLen(const Leaf* leaf) {
+  return leaf->key_len - keyOffset(leaf);
+}
+
+inline size_t payloadOffset(size_t stored_key_len) {
+  return (sizeof(Leaf) + stored_key_len + 7) & ~(size_t)7;
+}
+
+inline uint8_t* getPayload(Leaf* leaf) {
+  return (uint8_t*)leaf + payloadOffset(storedKeyLen(leaf));
+}
+
+inline size_t leafSize(size_t stored_key_len, size_t payload_len) {
+  return payload_len == 0 ? sizeof(Leaf) + stored_key_len
+                          : payloadOffset(stored_key_len) + payload_len;
+}
+
+inline size_t leafSize(const Leaf* leaf) {
+  return leafSize(storedKeyLen(leaf), leaf->payload_len);
+}
 
 inline bool isLeaf(const void* ptr) { return (((uintptr_t)ptr) & 1) == 1; }
 
@@ -111,7 +324,81 @@ inline void* smuggleLeaf(const Leaf* leaf) {
   return (void*)(((uintptr_t)leaf) + 1);
 }
 
-Leaf* makeNewLeaf(KEY, Value value);
+// Initializes a leaf in memory of at least
+// leafSize(key_len - key_offset, payload_len) bytes. The payload is left for
+// the caller to fill. key_offset is the depth the leaf may move up to in the
+// tree, the first key_offset bytes of the key are left out with
+// LEAF_SUFFIXES, it is ignored otherwise.
+Leaf* initLeaf(void* memory, KEY, Value value, size_t payload_len,
+               size_t key_offset = 0);
+Leaf* makeNewLeaf(KEY, Value value, size_t key_offset = 0);
+
+// Memory of nodes, prefixes and leaves. With CACHE_MODE the bytes are
+// counted for the tree the thread is working on, see Cache::Counting. Memory
+// unlinked and left to Epoch is disowned at once, then freed with free.
+#ifdef CACHE_MODE
+void* allocate(size_t size);
+void deallocate(void* memory);
+void disown(void* memory);
+#else
+inline void* allocate(size_t size) { return malloc(size); }
+inline void deallocate(void* memory) { free(memory); }
+inline void disown(void*) {}
+#endif
+
+// Nodes and leaves in a compacted block are never freed one by one, the block
+// goes away with the root at its start.
+inline void freeLeaf(Leaf* leaf) {
+  if (!leaf->compacted) {
+    deallocate(leaf);
+  }
+}
+
+inline void freePrefix(Header* node_header) {
+  if (node_header->prefix_allocated && !node_header->compacted) {
+    deallocate(node_header->allocated_prefix);
+  }
+}
+
+inline void freeHeader(Header* node_header) {
+  if (!node_header->compacted) {
+    deallocate(node_header);
+  }
+}
+
+#ifdef ORDER_STATS
+// Number of keys stored in the subtree rooted in `child`, which may be a leaf
+inline uint64_t subtreeCount(const void* child) {
+  if (isLeaf(child)) {
+    return 1;
+  }
+  return __atomic_load_n(&(asHeader(child)->subtree_count), __ATOMIC_SEQ_CST);
+}
+
+inline void addSubtreeCount(Header* node_header, int64_t delta) {
+  __atomic_fetch_add(&(node_header->subtree_count), delta, __ATOMIC_SEQ_CST);
+}
+
+// Writers add to the counts of the nodes above the one they change without
+// locking them, pinning them beforehand (see WritePath in actions.cpp)
+inline void pinSubtreeCount(Header* node_header) {
+  __atomic_fetch_add(&(node_header->subtree_pins), 1, __ATOMIC_SEQ_CST);
+}
+
+inline void unpinSubtreeCount(Header* node_header) {
+  __atomic_fetch_sub(&(node_header->subtree_pins), 1, __ATOMIC_SEQ_CST);
+}
+
+// Count of a write-locked node, to be copied into the node replacing it or
+// above it. Waits for the writers which pinned the node before it was locked
+// to add to it: they only release their pins once done.
+inline uint64_t settledSubtreeCount(const Header* node_header) {
+  while (__atomic_load_n(&(node_header->subtree_pins), __ATOMIC_SEQ_CST) !=
+         0) {
+  }
+  return subtreeCount(node_header);
+}
+#endif
 
 } // namespace Nodes
 
@@ -0,0 +1,257 @@
+#include "parallel.hpp"
+#include "utils.hpp"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace Parallel {
+
+namespace {
+
+// A task is a subtree to walk, Task says what the walk needs to know about it
+template <typename Task> struct Worker {
+  std::mutex mutex;
+  std::deque<Task> tasks;
+};
+
+template <typename Task> struct Pool {
+  explicit Pool(size_t threads) : workers(threads), pending(0) {}
+
+  std::vector<Worker<Task>> workers;
+  // Tasks which have been scheduled but not completed yet
+  std::atomic<size_t> pending;
+};
+
+template <typename Task> void push(Pool<Task>& pool, size_t worker, Task task) {
+  ++pool.pending;
+  std::lock_guard<std::mutex> guard(pool.workers[worker].mutex);
+  pool.workers[worker].tasks.push_back(std::move(task));
+}
+
+// The owner works depth-first on the most recent task
+template <typename Task> bool pop(Worker<Task>& worker, Task& task) {
+  std::lock_guard<std::mutex> guard(worker.mutex);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+// Thieves take the oldest task, which is usually the largest subtree
+template <typename Task> bool steal(Worker<Task>& worker, Task& task) {
+  std::lock_guard<std::mutex> guard(worker.mutex);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  task = std::move(worker.tasks.front());
+  worker.tasks.pop_front();
+  return true;
+}
+
+template <typename Task, typename Run>
+void workerLoop(Pool<Task>& pool, size_t worker, const Run& run) {
+  const size_t workers_count = pool.workers.size();
+  Task task;
+  while (pool.pending.load() > 0) {
+    bool found = pop(pool.workers[worker], task);
+    for (size_t i = 1; !found && i < workers_count; ++i) {
+      found = steal(pool.workers[(worker + i) % workers_count], task);
+    }
+
+    if (found) {
+      run(worker, task);
+      --pool.pending;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// Runs the first task and all the tasks it spawns, the calling thread is
+// worker 0
+template <typename Task, typename Run>
+void runPool(Pool<Task>& pool, Task first, const Run& run) {
+  push(pool, 0, std::move(first));
+  std::vector<std::thread> helpers;
+  for (size_t worker = 1; worker < pool.workers.size(); ++worker) {
+    helpers.emplace_back(
+        [&pool, &run, worker]() { workerLoop(pool, worker, run); });
+  }
+  workerLoop(pool, 0, run);
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+}
+
+void runTask(Pool<void*>& pool, size_t worker, void* task,
+             const Visitor& visit) {
+  std::vector<void*> stack;
+  stack.push_back(task);
+
+  while (!stack.empty()) {
+    void* node = stack.back();
+    stack.pop_back();
+
+    if (!Nodes::isLeaf(node)) {
+      auto header = Nodes::asHeader(node);
+      Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(header);
+      if (key_end_child != nullptr) {
+        stack.push_back(Nodes::smuggleLeaf(key_end_child));
+      }
+
+      bool split = header->children_count >= SPLIT_MIN_CHILDREN;
+      Nodes::forEachChild(header, [&](uint8_t, void* child) {
+        if (split && !Nodes::isLeaf(child)) {
+          push(pool, worker, child);
+        } else {
+          stack.push_back(child);
+        }
+      });
+    }
+
+    visit(worker, node);
+  }
+}
+
+} // namespace
+
+size_t workerCount(size_t threads) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  return std::max(threads, (size_t)1);
+}
+
+void traverse(Nodes::Header* root, size_t threads, const Visitor& visit) {
+  assert(root != nullptr);
+
+  Pool<void*> pool(workerCount(threads));
+  runPool(pool, (void*)root, [&](size_t worker, void* task) {
+    runTask(pool, worker, task, visit);
+  });
+}
+
+void freeRecursive(Nodes::Header* root, size_t threads) {
+  traverse(root, threads, [=](size_t, void* node) {
+    if (Nodes::isLeaf(node)) {
+      Nodes::freeLeaf(Nodes::asLeaf(node));
+    } else if (node != root) {
+      auto header = Nodes::asHeader(node);
+      Nodes::freePrefix(header);
+      Nodes::freeHeader(header);
+    }
+  });
+  // A compacted block starts with the root, which goes last
+  Nodes::freePrefix(root);
+  Nodes::freeHeader(root);
+}
+
+#ifdef LEAF_SUFFIXES
+namespace {
+
+// Leaves only store the end of their key, so a task carries the key bytes
+// above its subtree
+struct ScanTask {
+  void* node;
+  std::vector<uint8_t> path;
+};
+
+// The rest of the key is rebuilt in path, which holds the key bytes above
+// node. Split as in runTask.
+void scanSubtree(Pool<ScanTask>& pool, size_t worker, void* node,
+                 std::vector<uint8_t>& path, const Callback& callback) {
+  if (Nodes::isLeaf(node)) {
+    auto leaf = Nodes::asLeaf(node);
+    size_t offset = Nodes::keyOffset(leaf);
+    path.resize(offset);
+    path.insert(path.end(), Nodes::getKey(leaf) + offset,
+                Nodes::getKey(leaf) + leaf->key_len);
+    callback(worker, path.data(), path.size(), leaf->value);
+    return;
+  }
+
+  auto header = Nodes::asHeader(node);
+  const uint8_t* prefix = Nodes::getPrefix(header);
+  path.insert(path.end(), prefix, prefix + header->prefix_len);
+  const size_t depth = path.size();
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(header);
+  if (key_end_child != nullptr) {
+    scanSubtree(pool, worker, Nodes::smuggleLeaf(key_end_child), path,
+                callback);
+    path.resize(depth);
+  }
+  bool split = header->children_count >= SPLIT_MIN_CHILDREN;
+  Nodes::forEachChild(header, [&](uint8_t key, void* child) {
+    path.push_back(key);
+    if (split && !Nodes::isLeaf(child)) {
+      push(pool, worker, ScanTask{child, path});
+    } else {
+      scanSubtree(pool, worker, child, path, callback);
+    }
+    path.resize(depth);
+  });
+}
+
+} // namespace
+
+void scan(Nodes::Header* root, size_t threads, const Callback& callback) {
+  assert(root->prefix_len == 0);
+  Pool<ScanTask> pool(workerCount(threads));
+  runPool(pool, ScanTask{root, {}}, [&](size_t worker, ScanTask& task) {
+    scanSubtree(pool, worker, task.node, task.path, callback);
+  });
+}
+#else
+void scan(Nodes::Header* root, size_t threads, const Callback& callback) {
+  traverse(root, threads, [&](size_t worker, void* node) {
+    if (Nodes::isLeaf(node)) {
+      auto leaf = Nodes::asLeaf(node);
+      callback(worker, Nodes::getKey(leaf), leaf->key_len, leaf->value);
+    }
+  });
+}
+#endif
+
+Stats collectStats(Nodes::Header* root, size_t threads) {
+  struct Partial {
+    Stats stats;
+    char padding[64];
+  };
+  threads = workerCount(threads);
+  std::vector<Partial> partials(threads);
+  for (Partial& partial : partials) {
+    memset(&partial.stats, 0, sizeof(Stats));
+  }
+
+  traverse(root, threads, [&](size_t worker, void* node) {
+    Stats& stats = partials[worker].stats;
+    if (Nodes::isLeaf(node)) {
+      ++stats.leaf_count;
+      stats.memory_bytes += Nodes::leafSize(Nodes::asLeaf(node));
+    } else {
+      auto header = Nodes::asHeader(node);
+      ++stats.node_count[(size_t)header->type];
+      stats.memory_bytes += sizeof(Nodes::Header) +
+                            Nodes::nodeSize(header->type) + sizeof(void*);
+      if (header->prefix_allocated) {
+        stats.memory_bytes += header->prefix_len;
+      }
+    }
+  });
+
+  Stats result;
+  memset(&result, 0, sizeof(Stats));
+  for (const Partial& partial : partials) {
+    for (size_t i = 0; i < Nodes::TYPE_COUNT; ++i) {
+      result.node_count[i] += partial.stats.node_count[i];
+    }
+    result.leaf_count += partial.stats.leaf_count;
+    result.memory_bytes += partial.stats.memory_bytes;
+  }
+  return result;
+}
+
+} // namespace Parallel
@@ -0,0 +1,65 @@
+#ifndef PARALLEL
+#define PARALLEL
+
+#include "nodes.hpp"
+#include <functional>
+#include <vector>
+
+// Children of nodes with at least this many children become separate tasks
+// which idle workers can steal. Subtrees rooted in smaller nodes are walked
+// sequentially by the worker that reached them.
+#define SPLIT_MIN_CHILDREN 17
+
+// The traversals in this namespace expect no concurrent writers on the tree
+// they are walking.
+namespace Parallel {
+
+// `node` is either a Header* or a smuggled Leaf*. The visitor is called after
+// the children of `node` have been scheduled, so it may free `node`.
+typedef std::function<void(size_t worker, void* node)> Visitor;
+typedef std::function<void(size_t worker, KEY, Nodes::Value value)> Callback;
+
+struct Stats {
+  size_t node_count[Nodes::TYPE_COUNT]; // indexed by Nodes::Type
+  size_t leaf_count;
+  size_t memory_bytes;
+};
+
+// 0 means one worker per hardware thread
+size_t workerCount(size_t threads);
+
+// Visits every node and leaf of the tree exactly once, in no particular order.
+void traverse(Nodes::Header* root, size_t threads, const Visitor& visit);
+
+void freeRecursive(Nodes::Header* root, size_t threads = 0);
+void scan(Nodes::Header* root, size_t threads, const Callback& callback);
+Stats collectStats(Nodes::Header* root, size_t threads = 0);
+
+template <typename T, typename Map, typename Combine>
+T aggregate(Nodes::Header* root, size_t threads, T identity, Map map,
+            Combine combine) {
+  // Padded so that workers do not share cache lines
+  struct Partial {
+    T value;
+    char padding[64];
+  };
+  threads = workerCount(threads);
+  std::vector<Partial> partials(threads);
+  for (Partial& partial : partials) {
+    partial.value = identity;
+  }
+  scan(root, threads, [&](size_t worker, KEY, Nodes::Value value) {
+    partials[worker].value =
+        combine(partials[worker].value, map(KARGS, value));
+  });
+
+  T result = identity;
+  for (const Partial& partial : partials) {
+    result = combine(result, partial.value);
+  }
+  return result;
+}
+
+} // namespace Parallel
+
+#endif // PARALLEL
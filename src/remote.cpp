@@ -0,0 +1,605 @@
+#include "remote.hpp"
+#include "actions.hpp"
+#include "async.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Remote {
+
+namespace {
+
+void check(bool ok, const std::string& what) {
+  if (!ok) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+}
+
+sockaddr_un addressOf(const std::string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    check(false, "socket " + path);
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+  return address;
+}
+
+template <typename T> void put(std::vector<uint8_t>& out, T value) {
+  size_t at = out.size();
+  out.resize(at + sizeof(T));
+  memcpy(out.data() + at, &value, sizeof(T));
+}
+
+// Keys of requests take a uint16_t length, keys sent back a uint32_t one
+template <typename Len> void putKey(std::vector<uint8_t>& out, KEY) {
+  put<Len>(out, key_len);
+  out.insert(out.end(), key, key + key_len);
+}
+
+// Frames are written with a zero length, set once the body is complete
+size_t beginFrame(std::vector<uint8_t>& out) {
+  size_t start = out.size();
+  put<uint32_t>(out, 0);
+  return start;
+}
+
+void endFrame(std::vector<uint8_t>& out, size_t start) {
+  uint32_t len = out.size() - start - sizeof(uint32_t);
+  memcpy(out.data() + start, &len, sizeof(len));
+}
+
+// Reads the fields of a body, ok turns false past its end
+struct Cursor {
+  const uint8_t* data;
+  const uint8_t* end;
+  bool ok;
+
+  template <typename T> T get() {
+    T value = T();
+    if ((size_t)(end - data) < sizeof(T)) {
+      ok = false;
+      return value;
+    }
+    memcpy(&value, data, sizeof(T));
+    data += sizeof(T);
+    return value;
+  }
+
+  const uint8_t* bytes(size_t n) {
+    if ((size_t)(end - data) < n) {
+      ok = false;
+      return nullptr;
+    }
+    data += n;
+    return data - n;
+  }
+};
+
+// Finds the first complete frame in [data, data + size), returns false if
+// there is none yet
+bool nextFrame(const uint8_t* data, size_t size, Cursor& body) {
+  uint32_t len;
+  if (size < sizeof(len)) {
+    return false;
+  }
+  memcpy(&len, data, sizeof(len));
+  if (size - sizeof(len) < len) {
+    return false;
+  }
+  body = Cursor{data + sizeof(len), data + sizeof(len) + len, true};
+  return true;
+}
+
+struct Connection {
+  int fd;
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  size_t sent;
+  // The peer is done sending, the connection is closed once out is sent
+  bool eof;
+  // The peer sent a malformed request, or the socket failed
+  bool closing;
+  // Waiting for EPOLLIN, EPOLLOUT
+  bool reading;
+  bool writing;
+};
+
+struct Request {
+  Connection* connection;
+  Op op;
+  const uint8_t* key;
+  size_t key_len;
+  // Value of a PUT, or found by a GET
+  Nodes::Value value;
+  uint32_t limit;
+  bool found;
+  // Response of a SCAN, made when the SCAN runs
+  std::vector<uint8_t> entries;
+};
+
+// Parses the complete requests of the connection into batch, returns the
+// bytes they take
+size_t parse(Connection* connection, std::vector<Request>& batch,
+             size_t& count) {
+  const uint8_t* data = connection->in.data();
+  size_t size = connection->in.size();
+  size_t used = 0;
+  Cursor body;
+  while (!connection->closing && nextFrame(data + used, size - used, body)) {
+    if (body.end - body.data > REMOTE_MAX_FRAME) {
+      connection->closing = true;
+      break;
+    }
+    if (count == batch.size()) {
+      batch.emplace_back();
+    }
+    Request& request = batch[count];
+    request.connection = connection;
+    request.op = (Op)body.get<uint8_t>();
+    request.key_len = body.get<uint16_t>();
+    request.key = body.bytes(request.key_len);
+    request.value = 0;
+    request.limit = 0;
+    request.found = false;
+    if (request.op == PUT) {
+      request.value = body.get<int64_t>();
+    } else if (request.op == SCAN) {
+      request.limit = body.get<uint32_t>();
+    } else if (request.op != GET && request.op != REMOVE) {
+      body.ok = false;
+    }
+    if (!body.ok || body.data != body.end || request.key_len == 0) {
+      connection->closing = true;
+      break;
+    }
+    used = body.end - data;
+    ++count;
+  }
+  // Frames longer than the limit are refused before they arrive whole
+  uint32_t len;
+  if (!connection->closing && size - used >= sizeof(len)) {
+    memcpy(&len, data + used, sizeof(len));
+    connection->closing = len > REMOTE_MAX_FRAME;
+  }
+  return used;
+}
+
+void runGets(Nodes::Header* root, Request* begin, Request* end) {
+#if __cplusplus >= 202002L
+  Async::Scheduler scheduler;
+  auto done = [](const Async::Result& result, void* arg) {
+    Request* request = (Request*)arg;
+    request->found = result.found;
+    request->value = result.value;
+  };
+  for (Request* request = begin; request != end; ++request) {
+    Async::Lookup lookup = Async::search(root, request->key, request->key_len);
+    while (!scheduler.submit(std::move(lookup), done, request)) {
+      scheduler.step();
+    }
+  }
+  scheduler.drain();
+#else
+  for (Request* request = begin; request != end; ++request) {
+    const Nodes::Value* value =
+        Actions::search(root, request->key, request->key_len);
+    request->found = value != nullptr;
+    request->value = request->found ? *value : 0;
+  }
+#endif
+}
+
+// Sorted for insertBatch, equal keys staying in the order they came in so
+// that the last one wins
+void runPuts(Nodes::Header* root, Request* begin, Request* end) {
+  std::vector<Request*> sorted;
+  for (Request* request = begin; request != end; ++request) {
+    sorted.push_back(request);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Request* a, const Request* b) {
+                     int cmp = memcmp(a->key, b->key,
+                                      std::min(a->key_len, b->key_len));
+                     return cmp < 0 || (cmp == 0 && a->key_len < b->key_len);
+                   });
+  std::vector<const uint8_t*> keys;
+  std::vector<size_t> key_lens;
+  std::vector<Nodes::Value> values;
+  for (const Request* request : sorted) {
+    keys.push_back(request->key);
+    key_lens.push_back(request->key_len);
+    values.push_back(request->value);
+  }
+  Actions::insertBatch(root, keys.data(), key_lens.data(), values.data(),
+                       keys.size());
+}
+
+void runScan(Nodes::Header* root, Request& request) {
+  std::vector<uint8_t>& entries = request.entries;
+  entries.clear();
+  uint32_t count = 0;
+  put<uint32_t>(entries, 0);
+  const uint8_t* key;
+  size_t key_len;
+  Nodes::Value value;
+  bool found = request.limit > 0 &&
+               Actions::lowerBound(root, request.key, request.key_len, key,
+                                   key_len, value);
+  while (found) {
+    putKey<uint32_t>(entries, key, key_len);
+    put<int64_t>(entries, value);
+    if (++count == request.limit) {
+      break;
+    }
+    // the key of the entry, key may point to a buffer the next query reuses
+    const uint8_t* last = entries.data() + entries.size() - sizeof(int64_t) -
+                          key_len;
+    std::vector<uint8_t> from(last, last + key_len);
+    found = Actions::upperBound(root, from.data(), from.size(), key, key_len,
+                                value);
+  }
+  memcpy(entries.data(), &count, sizeof(count));
+}
+
+void execute(Nodes::Header* root, Request* batch, size_t count) {
+  for (size_t i = 0; i < count;) {
+    size_t j = i;
+    while (j < count && batch[j].op == batch[i].op) {
+      ++j;
+    }
+    switch (batch[i].op) {
+    case GET:
+      runGets(root, batch + i, batch + j);
+      break;
+    case PUT:
+      runPuts(root, batch + i, batch + j);
+      break;
+    case REMOVE:
+      for (size_t k = i; k < j; ++k) {
+        batch[k].found =
+            Actions::remove(root, batch[k].key, batch[k].key_len);
+      }
+      break;
+    case SCAN:
+      for (size_t k = i; k < j; ++k) {
+        runScan(root, batch[k]);
+      }
+      break;
+    }
+    i = j;
+  }
+}
+
+void respond(const Request& request) {
+  std::vector<uint8_t>& out = request.connection->out;
+  size_t start = beginFrame(out);
+  switch (request.op) {
+  case GET:
+    put<uint8_t>(out, request.found ? FOUND : NOT_FOUND);
+    if (request.found) {
+      put<int64_t>(out, request.value);
+    }
+    break;
+  case PUT:
+    put<uint8_t>(out, OK);
+    break;
+  case REMOVE:
+    put<uint8_t>(out, request.found ? OK : NOT_FOUND);
+    break;
+  case SCAN:
+    put<uint8_t>(out, OK);
+    out.insert(out.end(), request.entries.begin(), request.entries.end());
+    break;
+  }
+  endFrame(out, start);
+}
+
+// Reads what is available, returns false on errors
+bool receive(Connection* connection) {
+  uint8_t buffer[64 * 1024];
+  while (true) {
+    ssize_t n = ::read(connection->fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      connection->in.insert(connection->in.end(), buffer, buffer + n);
+      continue;
+    }
+    if (n == 0) {
+      connection->eof = true;
+      return true;
+    }
+    if (errno != EINTR) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+}
+
+// Writes what the socket takes, returns false on errors
+bool send(Connection* connection) {
+  while (connection->sent < connection->out.size()) {
+    ssize_t n =
+        ::send(connection->fd, connection->out.data() + connection->sent,
+               connection->out.size() - connection->sent, MSG_NOSIGNAL);
+    if (n >= 0) {
+      connection->sent += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+  connection->out.clear();
+  connection->sent = 0;
+  return true;
+}
+
+} // namespace
+
+Server::Server(Nodes::Header* root, const std::string& path, size_t threads)
+    : root_(root), path_(path) {
+  sockaddr_un address = addressOf(path);
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  check(listen_fd_ >= 0, "socket " + path);
+  ::unlink(path.c_str());
+  if (::bind(listen_fd_, (sockaddr*)&address, sizeof(address)) != 0 ||
+      ::listen(listen_fd_, SOMAXCONN) != 0) {
+    int error = errno;
+    ::close(listen_fd_);
+    errno = error;
+    check(false, "listen " + path);
+  }
+  stop_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  check(stop_fd_ >= 0, "eventfd");
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&Server::loop, this);
+  }
+}
+
+Server::~Server() {
+  uint64_t one = 1;
+  ssize_t written = ::write(stop_fd_, &one, sizeof(one));
+  (void)written;
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  ::close(stop_fd_);
+  ::close(listen_fd_);
+  ::unlink(path_.c_str());
+}
+
+// Connections belong to the thread which accepted them
+void Server::loop() {
+  int epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+  check(epoll_fd >= 0, "epoll_create1");
+  epoll_event event;
+  // the listening socket wakes a single thread per connection
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = &listen_fd_;
+  check(::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &event) == 0,
+        "epoll_ctl");
+  event.events = EPOLLIN;
+  event.data.ptr = &stop_fd_;
+  check(::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd_, &event) == 0,
+        "epoll_ctl");
+
+  std::vector<Connection*> connections;
+  std::vector<Connection*> ready;
+  std::vector<Request> batch;
+  epoll_event events[REMOTE_EVENTS];
+  bool stopping = false;
+  while (!stopping) {
+    int n = ::epoll_wait(epoll_fd, events, REMOTE_EVENTS, -1);
+    if (n < 0) {
+      check(errno == EINTR, "epoll_wait");
+      continue;
+    }
+
+    ready.clear();
+    for (int i = 0; i < n; ++i) {
+      void* source = events[i].data.ptr;
+      if (source == &stop_fd_) {
+        stopping = true;
+      } else if (source == &listen_fd_) {
+        for (;;) {
+          int fd = ::accept4(listen_fd_, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd < 0) {
+            // a peer which gave up before the accept leaves ECONNABORTED
+            if (errno == EINTR || errno == ECONNABORTED) {
+              continue;
+            }
+            check(errno == EAGAIN || errno == EWOULDBLOCK, "accept4");
+            break;
+          }
+          auto connection =
+              new Connection{fd, {}, {}, 0, false, false, true, false};
+          event.events = EPOLLIN;
+          event.data.ptr = connection;
+          check(::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0,
+                "epoll_ctl");
+          connections.push_back(connection);
+        }
+      } else {
+        Connection* connection = (Connection*)source;
+        if ((events[i].events & EPOLLOUT) != 0 && !send(connection)) {
+          connection->closing = true;
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 &&
+            !receive(connection)) {
+          connection->closing = true;
+        }
+        ready.push_back(connection);
+      }
+    }
+
+    // The requests of all the ready connections form a batch
+    size_t count = 0;
+    std::vector<size_t> used(ready.size());
+    for (size_t i = 0; i < ready.size(); ++i) {
+      used[i] = parse(ready[i], batch, count);
+    }
+    execute(root_, batch.data(), count);
+    for (size_t i = 0; i < count; ++i) {
+      respond(batch[i]);
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i) {
+      Connection* connection = ready[i];
+      connection->in.erase(connection->in.begin(),
+                           connection->in.begin() + used[i]);
+      if (!send(connection)) {
+        connection->closing = true;
+      }
+      size_t backlog = connection->out.size() - connection->sent;
+      bool writing = backlog > 0;
+      // past the backlog limit, the peer has to read before sending more
+      bool reading = !connection->eof && backlog <= REMOTE_MAX_BACKLOG;
+      if (connection->closing || (connection->eof && !writing)) {
+        ::close(connection->fd);
+        connections.erase(
+            std::find(connections.begin(), connections.end(), connection));
+        delete connection;
+      } else if (reading != connection->reading ||
+                 writing != connection->writing) {
+        connection->reading = reading;
+        connection->writing = writing;
+        event.events = (reading ? (uint32_t)EPOLLIN : (uint32_t)0) |
+                       (writing ? (uint32_t)EPOLLOUT : (uint32_t)0);
+        event.data.ptr = connection;
+        check(::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) ==
+                  0,
+              "epoll_ctl");
+      }
+    }
+  }
+
+  for (Connection* connection : connections) {
+    ::close(connection->fd);
+    delete connection;
+  }
+  ::close(epoll_fd);
+}
+
+Client::Client(const std::string& path) : in_start_(0) {
+  sockaddr_un address = addressOf(path);
+  fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  check(fd_ >= 0, "socket " + path);
+  if (::connect(fd_, (sockaddr*)&address, sizeof(address)) != 0) {
+    int error = errno;
+    ::close(fd_);
+    errno = error;
+    check(false, "connect " + path);
+  }
+}
+
+Client::~Client() { ::close(fd_); }
+
+size_t Client::request(Op op, KEY) {
+  if (key_len > UINT16_MAX) {
+    errno = EMSGSIZE;
+    check(false, "request");
+  }
+  size_t start = beginFrame(out_);
+  ops_.push_back(op);
+  Remote::put<uint8_t>(out_, op);
+  putKey<uint16_t>(out_, KARGS);
+  return start;
+}
+
+void Client::get(KEY) { endFrame(out_, request(GET, KARGS)); }
+
+void Client::put(KEY, Nodes::Value value) {
+  size_t start = request(PUT, KARGS);
+  Remote::put<int64_t>(out_, value);
+  endFrame(out_, start);
+}
+
+void Client::remove(KEY) { endFrame(out_, request(REMOVE, KARGS)); }
+
+void Client::scan(KEY, uint32_t limit) {
+  size_t start = request(SCAN, KARGS);
+  Remote::put<uint32_t>(out_, limit);
+  endFrame(out_, start);
+}
+
+void Client::flush() {
+  size_t sent = 0;
+  while (sent < out_.size()) {
+    ssize_t n =
+        ::send(fd_, out_.data() + sent, out_.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    check(n >= 0, "send");
+    sent += n;
+  }
+  out_.clear();
+}
+
+void Client::finish() {
+  flush();
+  check(::shutdown(fd_, SHUT_WR) == 0, "shutdown");
+}
+
+void Client::receive(Response& out) {
+  if (!out_.empty()) {
+    flush();
+  }
+  Cursor body;
+  while (!nextFrame(in_.data() + in_start_, in_.size() - in_start_, body)) {
+    if (in_start_ > 0) {
+      in_.erase(in_.begin(), in_.begin() + in_start_);
+      in_start_ = 0;
+    }
+    uint8_t buffer[64 * 1024];
+    ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0) {
+      errno = ECONNRESET;
+    }
+    check(n > 0, "read");
+    in_.insert(in_.end(), buffer, buffer + n);
+  }
+  in_start_ = body.end - in_.data();
+
+  Op op = ops_.front();
+  ops_.pop_front();
+  out.status = (Status)body.get<uint8_t>();
+  out.value = 0;
+  out.entries.clear();
+  if (op == GET && out.status == FOUND) {
+    out.value = body.get<int64_t>();
+  } else if (op == SCAN) {
+    uint32_t count = body.get<uint32_t>();
+    for (uint32_t i = 0; i < count && body.ok; ++i) {
+      uint32_t key_len = body.get<uint32_t>();
+      const uint8_t* key = body.bytes(key_len);
+      Nodes::Value value = body.get<int64_t>();
+      if (body.ok) {
+        out.entries.emplace_back(std::string((const char*)key, key_len),
+                                 value);
+      }
+    }
+  }
+  if (!body.ok) {
+    errno = EPROTO;
+    check(false, "response");
+  }
+}
+
+} // namespace Remote
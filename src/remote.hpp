@@ -0,0 +1,117 @@
+#ifndef REMOTE
+#define REMOTE
+
+#include "nodes.hpp"
+#include <deque>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A tree shared by the processes of a host through a Unix domain socket.
+//
+// Messages are frames: the length of the body (uint32_t), then the body.
+// Integers are in host byte order, both ends run on the same host. Requests
+// start with their Op:
+//   GET     key_len (uint16_t), key
+//   PUT     key_len, key, value (int64_t)
+//   REMOVE  key_len, key
+//   SCAN    key_len, key, limit (uint32_t): the first limit keys >= key
+// Keys may not be empty. Responses come in the order of the requests of the
+// connection, and start with a Status:
+//   GET     FOUND then the value, or NOT_FOUND
+//   PUT     OK
+//   REMOVE  OK, or NOT_FOUND
+//   SCAN    OK, count (uint32_t), then count times key_len (uint32_t), key,
+//           value
+// The server closes connections sending malformed requests. A connection the
+// peer stops sending on is closed once its responses are sent.
+//
+// Clients may pipeline requests. Each server thread runs an epoll loop, and
+// executes the requests read from all its ready connections as a batch: runs
+// of PUTs go through Actions::insertBatch, runs of GETs are interleaved with
+// Async lookups in C++20 builds.
+//
+// Socket errors are reported with std::system_error.
+namespace Remote {
+
+enum Op : uint8_t { GET = 1, PUT, REMOVE, SCAN };
+enum Status : uint8_t { OK = 0, FOUND, NOT_FOUND };
+
+// Larger frames are malformed
+#define REMOTE_MAX_FRAME (1 << 20)
+// Events handled by a thread per epoll_wait
+#define REMOTE_EVENTS 64
+// Connections are not read while more bytes of responses wait to be sent
+#define REMOTE_MAX_BACKLOG (1 << 22)
+
+class Server {
+public:
+  // Listens on path, replacing any socket there. Threads default to one per
+  // core. The tree must outlive the server.
+  Server(Nodes::Header* root, const std::string& path, size_t threads = 0);
+  // Stops the threads, closes the connections and removes the socket
+  ~Server();
+
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+
+private:
+  void loop();
+
+  Nodes::Header* const root_;
+  const std::string path_;
+  int listen_fd_;
+  // Written to stop the threads
+  int stop_fd_;
+  std::vector<std::thread> threads_;
+};
+
+// Blocking client of a Server, used by a single thread
+class Client {
+public:
+  explicit Client(const std::string& path);
+  ~Client();
+
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  // Requests are buffered until flush. Keys longer than UINT16_MAX are
+  // refused.
+  void get(KEY);
+  void put(KEY, Nodes::Value value);
+  void remove(KEY);
+  void scan(KEY, uint32_t limit);
+  void flush();
+  // Flushes, then tells the server no more requests come. The responses to
+  // the requests sent can still be received.
+  void finish();
+
+  struct Response {
+    Status status;
+    // For GETs found
+    Nodes::Value value;
+    // For SCANs
+    std::vector<std::pair<std::string, Nodes::Value>> entries;
+  };
+  // Waits for the response to the oldest request left unanswered, flushing
+  // the requests first if needed
+  void receive(Response& out);
+
+  // Requests sent or buffered, and not answered yet
+  size_t pending() const { return ops_.size(); }
+
+private:
+  // Starts the frame of a request, returns where it starts for endFrame
+  size_t request(Op op, KEY);
+
+  int fd_;
+  std::vector<uint8_t> out_;
+  std::vector<uint8_t> in_;
+  size_t in_start_;
+  std::deque<Op> ops_;
+};
+
+} // namespace Remote
+
+#endif // REMOTE
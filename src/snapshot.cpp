@@ -0,0 +1,289 @@
+#ifdef SNAPSHOTS
+
+#include "snapshot.hpp"
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace Snapshot {
+
+std::atomic<uint64_t> current_generation(0);
+std::atomic<uint64_t> shared_below(0);
+
+namespace {
+
+// Writers announce themselves in one of these counters, picked per thread,
+// so that writers rarely share a cache line
+#define WRITER_STRIPES 64
+
+struct alignas(64) WriterCount {
+  std::atomic<uint64_t> count{0};
+};
+
+WriterCount writers[WRITER_STRIPES];
+// Set while a snapshot waits for the writes in progress
+std::atomic<bool> closed(false);
+thread_local size_t write_depth = 0;
+
+struct Dead {
+  void* memory;
+  Epoch::Deleter deleter;
+  // Generations in which the memory was reachable from the tree
+  uint64_t born;
+  uint64_t died;
+};
+
+// Serializes snapshots
+std::mutex take_mutex;
+// Protects the fields below
+std::mutex mutex;
+std::multiset<uint64_t> live;
+// Unlinked memory which live snapshots may reach
+std::vector<Dead> dead;
+
+WriterCount& writerCount() {
+  static std::atomic<size_t> next_stripe(0);
+  static thread_local size_t stripe = next_stripe++ % WRITER_STRIPES;
+  return writers[stripe];
+}
+
+// Called holding the mutex
+bool reachable(uint64_t born, uint64_t died) {
+  auto it = live.lower_bound(born);
+  return it != live.end() && *it < died;
+}
+
+void freeRoot(Nodes::Header* root) {
+  Nodes::freePrefix(root);
+  Nodes::freeHeader(root);
+}
+
+// The leaf and the key share their first depth bytes
+bool leafAtLeast(Nodes::Leaf* leaf, KEY, size_t depth) {
+  size_t len = std::min((size_t)leaf->key_len, key_len);
+  int cmp = memcmp(Nodes::getKey(leaf) + depth, key + depth, len - depth);
+  return cmp > 0 || (cmp == 0 && leaf->key_len >= key_len);
+}
+
+struct ScanState {
+  // Lower bound of the scan
+  const uint8_t* start;
+  size_t start_len;
+  const Callback& callback;
+#ifdef LEAF_SUFFIXES
+  // Key bytes above the node being scanned, leaves only store the rest
+  std::vector<uint8_t> path;
+#endif
+};
+
+// When bounded, the keys below node share their first depth bytes with the
+// bound, and the ones smaller than the bound are skipped. Returns false once
+// the callback asks to stop.
+bool scanNode(ScanState& state, void* node, size_t depth, bool bounded) {
+  if (Nodes::isLeaf(node)) {
+    Nodes::Leaf* leaf = Nodes::asLeaf(node);
+    if (bounded && !leafAtLeast(leaf, state.start, state.start_len, depth)) {
+      return true;
+    }
+#ifdef LEAF_SUFFIXES
+    size_t offset = Nodes::keyOffset(leaf);
+    state.path.resize(offset);
+    state.path.insert(state.path.end(), Nodes::getKey(leaf) + offset,
+                      Nodes::getKey(leaf) + leaf->key_len);
+    return state.callback(state.path.data(), state.path.size(), leaf->value);
+#else
+    return state.callback(Nodes::getKey(leaf), leaf->key_len, leaf->value);
+#endif
+  }
+
+  Nodes::Header* node_header = Nodes::asHeader(node);
+  const uint8_t* prefix = Nodes::getPrefix(node_header);
+  if (bounded && node_header->prefix_len > 0) {
+    size_t length = node_header->prefix_len;
+    size_t common = std::min(length, state.start_len - depth);
+    int cmp = memcmp(prefix, state.start + depth, common);
+    if (cmp < 0) {
+      return true;
+    }
+    // past the bound, or the bound ends inside the prefix
+    bounded = cmp == 0 && common == length;
+  }
+#ifdef LEAF_SUFFIXES
+  state.path.resize(depth);
+  state.path.insert(state.path.end(), prefix,
+                    prefix + node_header->prefix_len);
+#endif
+  depth += node_header->prefix_len;
+
+  Nodes::Leaf* key_end_child = *Nodes::findChildKeyEnd(node_header);
+  if (key_end_child != nullptr &&
+      !scanNode(state, Nodes::smuggleLeaf(key_end_child), depth, bounded)) {
+    return false;
+  }
+  if (bounded && depth == state.start_len) {
+    bounded = false;
+  }
+
+  bool keep_going = true;
+  Nodes::forEachChild(node_header, [&](uint8_t key, void* child) {
+    if (!keep_going) {
+      return;
+    }
+    bool child_bounded = bounded;
+    if (bounded) {
+      uint8_t bound = state.start[depth];
+      if (key < bound) {
+        return;
+      }
+      child_bounded = key == bound;
+    }
+#ifdef LEAF_SUFFIXES
+    state.path.resize(depth);
+    state.path.push_back(key);
+#endif
+    keep_going = scanNode(state, child, depth + 1, child_bounded);
+  });
+  return keep_going;
+}
+
+} // namespace
+
+WriteGuard::WriteGuard() {
+  if (write_depth++ > 0) {
+    return;
+  }
+  WriterCount& writer = writerCount();
+  writer.count.fetch_add(1);
+  while (closed.load()) {
+    writer.count.fetch_sub(1);
+    while (closed.load()) {
+      std::this_thread::yield();
+    }
+    writer.count.fetch_add(1);
+  }
+}
+
+WriteGuard::~WriteGuard() {
+  if (--write_depth == 0) {
+    writerCount().count.fetch_sub(1);
+  }
+}
+
+View::View(View&& other) : root_(other.root_), id_(other.id_) {
+  other.root_ = nullptr;
+}
+
+View::~View() {
+  if (root_ == nullptr) {
+    return;
+  }
+  freeRoot(root_);
+
+  std::lock_guard<std::mutex> guard(mutex);
+  live.erase(live.find(id_));
+  shared_below.store(live.empty() ? 0 : *live.rbegin() + 1);
+
+  size_t kept = 0;
+  for (const Dead& d : dead) {
+    if (reachable(d.born, d.died)) {
+      dead[kept++] = d;
+    } else {
+      Epoch::retire(d.memory, d.deleter);
+    }
+  }
+  dead.resize(kept);
+}
+
+View take(Nodes::Header* root) {
+  std::lock_guard<std::mutex> taking(take_mutex);
+  closed.store(true);
+  for (WriterCount& writer : writers) {
+    while (writer.count.load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  // No write is in progress, nodes made from now on belong to the new
+  // generation
+  uint64_t id = current_generation.load();
+  Nodes::Header* copy = Nodes::clone(root);
+  current_generation.store(id + 1);
+  root->generation = id + 1;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    live.insert(id);
+    shared_below.store(id + 1);
+  }
+
+  closed.store(false);
+  return View(copy, id);
+}
+
+void retire(void* memory, Epoch::Deleter deleter, uint64_t generation) {
+  if (generation >= shared_below.load()) {
+    Epoch::retire(memory, deleter);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex);
+  Dead d = {memory, deleter, generation, current_generation.load()};
+  if (reachable(d.born, d.died)) {
+    dead.push_back(d);
+  } else {
+    Epoch::retire(memory, deleter);
+  }
+}
+
+bool search(const View& view, KEY, Nodes::Value& out_value) {
+  void* node = view.root();
+  size_t depth = 0;
+  while (!Nodes::isLeaf(node)) {
+    Nodes::Header* node_header = Nodes::asHeader(node);
+    size_t prefix_size = node_header->prefix_len;
+    if (key_len - depth < prefix_size ||
+        (prefix_size > 0 && memcmp(Nodes::getPrefix(node_header), key + depth,
+                                   prefix_size) != 0)) {
+      return false;
+    }
+    depth += node_header->prefix_len;
+
+    if (depth == key_len) {
+      node = *Nodes::findChildKeyEnd(node_header);
+      if (node == nullptr) {
+        return false;
+      }
+      node = Nodes::smuggleLeaf((Nodes::Leaf*)node);
+    } else {
+      void** child = Nodes::findChild(node_header, key[depth]);
+      if (child == nullptr || *child == nullptr) {
+        return false;
+      }
+      node = *child;
+      depth += 1;
+    }
+  }
+
+  Nodes::Leaf* leaf = Nodes::asLeaf(node);
+  size_t offset = Nodes::keyOffset(leaf);
+  if (leaf->key_len != key_len ||
+      memcmp(Nodes::getKey(leaf) + offset, key + offset, key_len - offset)) {
+    return false;
+  }
+  out_value = leaf->value;
+  return true;
+}
+
+void scan(const View& view, const Callback& callback) {
+  ScanState state = {nullptr, 0, callback};
+  scanNode(state, view.root(), 0, false);
+}
+
+void scan(const View& view, KEY, const Callback& callback) {
+  ScanState state = {key, key_len, callback};
+  scanNode(state, view.root(), 0, true);
+}
+
+} // namespace Snapshot
+
+#endif // SNAPSHOTS
@@ -0,0 +1,98 @@
+#ifndef SNAPSHOT
+#define SNAPSHOT
+
+#ifdef SNAPSHOTS
+
+#include "epoch.hpp"
+#include "nodes.hpp"
+#include <atomic>
+#include <functional>
+
+// Point-in-time views of a tree, built with -DSNAPSHOTS.
+//
+// Taking a snapshot copies the root only. Every node records the generation
+// it was made in, and a new generation starts with each snapshot: from then
+// on writers copy a node of an older generation before modifying it, along
+// the whole path down to the node they modify, and leave the original to the
+// snapshots. Values are not updated in place while a snapshot is alive.
+// Nodes and leaves unlinked by writers are freed once the snapshots which can
+// reach them are released.
+//
+// Nodes of a snapshot never change: lookups and scans on it take no locks
+// and never restart, and the Parallel traversals can run on View::root().
+// Snapshots must be released before their tree is freed or compacted.
+namespace Snapshot {
+
+class View {
+public:
+  View(View&& other);
+  // Releases the snapshot
+  ~View();
+
+  View(const View&) = delete;
+  View& operator=(const View&) = delete;
+
+  Nodes::Header* root() const { return root_; }
+
+private:
+  friend View take(Nodes::Header* root);
+  View(Nodes::Header* root, uint64_t id) : root_(root), id_(id) {}
+
+  Nodes::Header* root_;
+  // Generation in which the snapshot was taken
+  uint64_t id_;
+};
+
+// Waits for the writes in progress on any tree to complete, new writes wait
+// until the root has been copied.
+View take(Nodes::Header* root);
+
+// Returns false if the key was not in the tree when the snapshot was taken
+bool search(const View& view, KEY, Nodes::Value& out_value);
+
+// Called in key order, returning false stops the scan. The key is valid as
+// long as the snapshot.
+typedef std::function<bool(KEY, Nodes::Value value)> Callback;
+
+void scan(const View& view, const Callback& callback);
+// Starts from the first key greater than or equal to `key`
+void scan(const View& view, KEY, const Callback& callback);
+
+// The following are for writers.
+
+// Nodes are made in the current generation
+extern std::atomic<uint64_t> current_generation;
+// Nodes of a generation below this one may be reachable from a snapshot,
+// 0 without snapshots
+extern std::atomic<uint64_t> shared_below;
+
+inline uint64_t generation() { return current_generation.load(); }
+
+// Whether a snapshot is alive, in which case values must not be updated in
+// place
+inline bool active() { return shared_below.load() != 0; }
+
+inline bool isShared(const Nodes::Header* node_header) {
+  return node_header->generation < shared_below.load();
+}
+
+// Writes to a tree run inside a WriteGuard, so that snapshots are taken
+// between writes. Guards can be nested.
+class WriteGuard {
+public:
+  WriteGuard();
+  ~WriteGuard();
+  WriteGuard(const WriteGuard&) = delete;
+  WriteGuard& operator=(const WriteGuard&) = delete;
+};
+
+// Retires memory unlinked from the tree, which was made in the given
+// generation (0 if unknown, e.g. for leaves). Memory a snapshot can still
+// reach is retired once the snapshot is released.
+void retire(void* memory, Epoch::Deleter deleter, uint64_t generation);
+
+} // namespace Snapshot
+
+#endif // SNAPSHOTS
+
+#endif // SNAPSHOT
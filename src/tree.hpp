@@ -0,0 +1,268 @@
+#ifndef TREE
+#define TREE
+
+#include "actions.hpp"
+#include "epoch.hpp"
+#include "parallel.hpp"
+#include "snapshot.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// Typed front-end over Nodes/Actions. Keys are encoded into byte strings
+// which compare like the original keys, values are stored inside the Leaf
+// holding the key.
+namespace Typed {
+
+// Key encodings
+
+template <typename Key, typename Enable = void> class KeyCodec;
+
+// Big-endian, with the sign bit flipped for signed types
+template <typename Key>
+class KeyCodec<Key,
+               typename std::enable_if<std::is_integral<Key>::value>::type> {
+public:
+  explicit KeyCodec(Key key) {
+    typedef typename std::make_unsigned<Key>::type Unsigned;
+    Unsigned bits = (Unsigned)key;
+    if (std::is_signed<Key>::value) {
+      bits ^= (Unsigned)1 << (sizeof(Key) * 8 - 1);
+    }
+    for (size_t i = 0; i < sizeof(Key); ++i) {
+      buffer[i] = (uint8_t)(bits >> (8 * (sizeof(Key) - 1 - i)));
+    }
+  }
+
+  const uint8_t* data() const { return buffer; }
+  size_t size() const { return sizeof(Key); }
+
+private:
+  uint8_t buffer[sizeof(Key)];
+};
+
+// The terminating NUL is part of the key, so that the empty string is a valid
+// key. The order of the strings is preserved.
+template <> class KeyCodec<std::string> {
+public:
+  explicit KeyCodec(const std::string& key) : key(key) {}
+
+  const uint8_t* data() const { return (const uint8_t*)key.c_str(); }
+  size_t size() const { return key.size() + 1; }
+
+private:
+  const std::string& key;
+};
+
+// Value encodings. payloadSize() is the number of bytes the value takes
+// after the key, values which fit Nodes::Value take none.
+
+template <typename V, typename Enable = void> struct ValueCodec;
+
+template <typename V>
+struct ValueCodec<
+    V, typename std::enable_if<std::is_trivially_copyable<V>::value>::type> {
+  static_assert(alignof(V) <= 8, "payloads are 8-aligned");
+
+  static size_t payloadSize(const V&) {
+    return sizeof(V) <= sizeof(Nodes::Value) ? 0 : sizeof(V);
+  }
+
+  static const V* view(const Nodes::Leaf* leaf) {
+    if (sizeof(V) <= sizeof(Nodes::Value)) {
+      return (const V*)&leaf->value;
+    }
+    return (const V*)Nodes::getPayload((Nodes::Leaf*)leaf);
+  }
+
+  static void store(Nodes::Leaf* leaf, const V& value) {
+    memcpy((void*)view(leaf), &value, sizeof(V));
+  }
+
+  static void load(const Nodes::Leaf* leaf, V& out) {
+    memcpy(&out, view(leaf), sizeof(V));
+  }
+};
+
+// Variable-length blob, its length is the length of the payload
+template <> struct ValueCodec<std::string> {
+  static size_t payloadSize(const std::string& value) { return value.size(); }
+
+  static void store(Nodes::Leaf* leaf, const std::string& value) {
+    memcpy(Nodes::getPayload(leaf), value.data(), value.size());
+  }
+
+  static void load(const Nodes::Leaf* leaf, std::string& out) {
+    out.assign((const char*)Nodes::getPayload((Nodes::Leaf*)leaf),
+               leaf->payload_len);
+  }
+};
+
+// Policies. Nodes, leaves and locking are those of Actions whatever the
+// policy: the Sync policy only decides whether lookup() is available.
+
+// Readers copy values out of the leaves and validate the copy against the
+// version of the node holding the leaf, like Actions::search.
+struct OptimisticSync {
+  static const bool concurrent = true;
+};
+
+// For trees which are not written concurrently with reads. Enables lookup(),
+// which returns a pointer into the leaf instead of a copy. Writes lock as
+// they do with OptimisticSync.
+struct Unsynchronized {
+  static const bool concurrent = false;
+};
+
+template <typename Sync = OptimisticSync> struct Policy {
+  typedef Sync sync;
+};
+
+template <typename Key, typename V, typename P = Policy<>> class Tree {
+public:
+  typedef KeyCodec<Key> Encoded;
+  typedef ValueCodec<V> Codec;
+
+  Tree() : root_(Nodes::makeNewRoot()) {}
+
+  ~Tree() {
+    Nodes::Header* root = root_;
+    Parallel::traverse(root, 1, [=](size_t, void* node) {
+      if (Nodes::isLeaf(node)) {
+        Nodes::freeLeaf(Nodes::asLeaf(node));
+      } else if (node != root) {
+        Nodes::freePrefix(Nodes::asHeader(node));
+        Nodes::freeHeader(Nodes::asHeader(node));
+      }
+    });
+    Nodes::freePrefix(root);
+    Nodes::freeHeader(root);
+  }
+
+  Tree(const Tree&) = delete;
+  Tree& operator=(const Tree&) = delete;
+
+  void insert(const Key& key, const V& value) {
+    upsert(key, [&](const V*, V& out) {
+      out = value;
+      return true;
+    });
+  }
+
+  // Returns false if the key was already in the tree
+  bool insertIfAbsent(const Key& key, const V& value) {
+    return upsert(key, [&](const V* old_value, V& out) {
+      if (old_value != nullptr) {
+        return false;
+      }
+      out = value;
+      return true;
+    });
+  }
+
+  // fn(const V* old_value, V& new_value) -> bool, see Actions::UpsertFn
+  template <typename F> bool upsert(const Key& key, F fn) {
+    Encoded encoded(key);
+    UpsertArg<F> arg = {&fn, nullptr};
+    bool modified = Actions::upsertLeaf(root_, encoded.data(), encoded.size(),
+                                        upsertLeaf<F>, &arg);
+    if (arg.replaced != nullptr) {
+      retireLeaf(arg.replaced);
+    }
+    return modified;
+  }
+
+  // Returns false if the key was not in the tree
+  bool remove(const Key& key) {
+    Encoded encoded(key);
+    Nodes::Leaf* leaf =
+        Actions::removeLeaf(root_, encoded.data(), encoded.size());
+    if (leaf == nullptr) {
+      return false;
+    }
+    retireLeaf(leaf);
+    return true;
+  }
+
+  bool find(const Key& key, V& out) const {
+    Encoded encoded(key);
+    return Actions::readLeaf(root_, encoded.data(), encoded.size(), loadValue,
+                             &out);
+  }
+
+  // The returned pointer is valid until the next write on the key
+  const V* lookup(const Key& key) const {
+    static_assert(!P::sync::concurrent,
+                  "lookup() needs the Unsynchronized policy");
+    Encoded encoded(key);
+    Nodes::Leaf* leaf =
+        Actions::searchLeaf(root_, encoded.data(), encoded.size());
+    return leaf == nullptr ? nullptr : Codec::view(leaf);
+  }
+
+  Nodes::Header* root() const { return root_; }
+
+private:
+  template <typename F> struct UpsertArg {
+    F* fn;
+    // Leaf which has been swapped out instead of being updated in place
+    Nodes::Leaf* replaced;
+  };
+
+  // Leaves keep their whole key: with LEAF_SUFFIXES a remove may have to copy
+  // a leaf storing a suffix, which Actions only does for leaves without a
+  // payload
+  template <typename F>
+  static Nodes::Leaf* upsertLeaf(Nodes::Leaf* old_leaf, KEY, size_t,
+                                 void* arg) {
+    auto upsert = (UpsertArg<F>*)arg;
+    V old_value, new_value;
+    if (old_leaf != nullptr) {
+      Codec::load(old_leaf, old_value);
+    }
+    if (!(*upsert->fn)(old_leaf == nullptr ? nullptr : &old_value,
+                       new_value)) {
+      return nullptr;
+    }
+
+    size_t payload_len = Codec::payloadSize(new_value);
+    bool in_place = old_leaf != nullptr && old_leaf->payload_len == payload_len;
+#ifdef SNAPSHOTS
+    // snapshots may still read the old value
+    in_place = in_place && !Snapshot::active();
+#endif
+    if (in_place) {
+      Codec::store(old_leaf, new_value);
+      return old_leaf;
+    }
+
+    void* memory = Nodes::allocate(Nodes::leafSize(key_len, payload_len));
+    Nodes::Leaf* leaf = Nodes::initLeaf(memory, KARGS, 0, payload_len);
+    Codec::store(leaf, new_value);
+    upsert->replaced = old_leaf;
+    return leaf;
+  }
+
+  // Same as the leaves Actions unlinks, see Nodes::disown
+  static void retireLeaf(Nodes::Leaf* leaf) {
+    if (!leaf->compacted) {
+      Nodes::disown(leaf);
+#ifdef SNAPSHOTS
+      Snapshot::retire(leaf, free, 0);
+#else
+      Epoch::retire(leaf, free);
+#endif
+    }
+  }
+
+  static void loadValue(const Nodes::Leaf* leaf, void* out) {
+    Codec::load(leaf, *(V*)out);
+  }
+
+  Nodes::Header* root_;
+};
+
+} // namespace Typed
+
+#endif // TREE
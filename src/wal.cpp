@@ -0,0 +1,483 @@
+#include "wal.hpp"
+#include "epoch.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Wal {
+
+namespace {
+
+// Record: type, key_len (4 bytes), key, [value], checksum (4 bytes) of all
+// the bytes before it. Checkpoints are made of INSERT records as well.
+enum RecordType : uint8_t { INSERT = 1, REMOVE = 2 };
+
+const char* SEGMENT_PREFIX = "wal.";
+const char* CHECKPOINT_PREFIX = "checkpoint.";
+const char* CHECKPOINT_TMP = "checkpoint.tmp";
+
+// Reads and checkpoint writes go through buffers of this size
+constexpr size_t IO_CHUNK = 1 << 20;
+
+void check(bool ok, const std::string& what) {
+  if (!ok) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+}
+
+// FNV-1a, enough to tell a torn tail from a complete record
+uint32_t checksum(const uint8_t* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void encode(std::vector<uint8_t>& out, uint8_t type, KEY, Nodes::Value value) {
+  size_t start = out.size();
+  uint32_t len = key_len;
+  out.push_back(type);
+  out.insert(out.end(), (const uint8_t*)&len, (const uint8_t*)(&len + 1));
+  out.insert(out.end(), key, key + key_len);
+  if (type == INSERT) {
+    out.insert(out.end(), (const uint8_t*)&value,
+               (const uint8_t*)(&value + 1));
+  }
+  uint32_t sum = checksum(out.data() + start, out.size() - start);
+  out.insert(out.end(), (const uint8_t*)&sum, (const uint8_t*)(&sum + 1));
+}
+
+void writeAll(int fd, const uint8_t* data, size_t size,
+              const std::string& path) {
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    check(written >= 0, "write " + path);
+    data += written;
+    size -= written;
+  }
+}
+
+void syncDirectory(const std::string& directory) {
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  check(fd >= 0, "open " + directory);
+  check(::fsync(fd) == 0, "fsync " + directory);
+  ::close(fd);
+}
+
+std::string fileName(const std::string& directory, const char* prefix,
+                     uint64_t number) {
+  return directory + "/" + prefix + std::to_string(number);
+}
+
+// Numbers of the files named <prefix><number>, sorted
+std::vector<uint64_t> listFiles(const std::string& directory,
+                                const char* prefix) {
+  std::vector<uint64_t> numbers;
+  DIR* dir = ::opendir(directory.c_str());
+  check(dir != nullptr, "opendir " + directory);
+  size_t prefix_len = strlen(prefix);
+  while (dirent* entry = ::readdir(dir)) {
+    const char* name = entry->d_name;
+    if (strncmp(name, prefix, prefix_len) != 0) {
+      continue;
+    }
+    char* end;
+    uint64_t number = strtoull(name + prefix_len, &end, 10);
+    if (end != name + prefix_len && *end == '\0') {
+      numbers.push_back(number);
+    }
+  }
+  ::closedir(dir);
+  std::sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+// Inserts between two removes, applied with a single insertBatch. Sorting
+// them keeps the order of the inserts of each key, so the last one still wins.
+// The keys point into the read buffer, so the run goes in before it moves.
+struct Run {
+  struct Insert {
+    const uint8_t* key;
+    size_t key_len;
+    Nodes::Value value;
+  };
+  std::vector<Insert> inserts;
+
+  void apply(Nodes::Header* root) {
+    if (inserts.empty()) {
+      return;
+    }
+    std::stable_sort(inserts.begin(), inserts.end(),
+                     [](const Insert& a, const Insert& b) {
+                       int diff = memcmp(a.key, b.key,
+                                         std::min(a.key_len, b.key_len));
+                       return diff < 0 || (diff == 0 && a.key_len < b.key_len);
+                     });
+    std::vector<const uint8_t*> keys;
+    std::vector<size_t> key_lens;
+    std::vector<Nodes::Value> values;
+    for (const Insert& insert : inserts) {
+      keys.push_back(insert.key);
+      key_lens.push_back(insert.key_len);
+      values.push_back(insert.value);
+    }
+    Actions::insertBatch(root, keys.data(), key_lens.data(), values.data(),
+                         keys.size());
+    inserts.clear();
+  }
+};
+
+// Applies the records of a file to the tree without any logging. Stops at
+// the first incomplete or corrupted record, i.e. the tail torn by a crash.
+void replay(Nodes::Header* root, const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  check(fd >= 0, "open " + path);
+
+  std::vector<uint8_t> buffer;
+  Run run;
+  size_t begin = 0;
+  bool eof = false;
+  while (true) {
+    // Keep the unparsed bytes at the front and read another chunk after them
+    buffer.erase(buffer.begin(), buffer.begin() + begin);
+    begin = 0;
+    if (!eof) {
+      size_t used = buffer.size();
+      buffer.resize(used + IO_CHUNK);
+      ssize_t n = ::read(fd, buffer.data() + used, IO_CHUNK);
+      if (n < 0 && errno == EINTR) {
+        buffer.resize(used);
+        continue;
+      }
+      check(n >= 0, "read " + path);
+      buffer.resize(used + n);
+      eof = n == 0;
+    }
+
+    bool torn = false;
+    while (!torn) {
+      const uint8_t* p = buffer.data() + begin;
+      size_t available = buffer.size() - begin;
+      uint32_t key_len;
+      if (available < 1 + sizeof(key_len)) {
+        torn = true;
+        break;
+      }
+      uint8_t type = p[0];
+      memcpy(&key_len, p + 1, sizeof(key_len));
+      size_t size = 1 + sizeof(key_len) + key_len + sizeof(uint32_t);
+      if (type == INSERT) {
+        size += sizeof(Nodes::Value);
+      } else if (type != REMOVE) {
+        eof = true; // garbage
+        break;
+      }
+      if (available < size) {
+        torn = true;
+        break;
+      }
+      uint32_t sum;
+      memcpy(&sum, p + size - sizeof(sum), sizeof(sum));
+      if (sum != checksum(p, size - sizeof(sum))) {
+        eof = true;
+        break;
+      }
+
+      const uint8_t* key = p + 1 + sizeof(key_len);
+      if (type == REMOVE) {
+        run.apply(root);
+        Actions::remove(root, KARGS);
+      } else {
+        Nodes::Value value;
+        memcpy(&value, key + key_len, sizeof(value));
+        if (key_len == 0) {
+          // insertBatch takes no empty keys
+          run.apply(root);
+          Actions::insert(root, KARGS, value);
+        } else {
+          run.inserts.push_back({key, key_len, value});
+        }
+      }
+      begin += size;
+    }
+    run.apply(root);
+
+    if (eof) {
+      break;
+    }
+  }
+  ::close(fd);
+}
+
+void copyValue(const Nodes::Leaf* leaf, void* arg) {
+  *(Nodes::Value*)arg = leaf->value;
+}
+
+} // namespace
+
+Log::Log(const std::string& directory, Nodes::Header* root,
+         const Options& options)
+    : directory_(directory), root_(root), options_(options), fd_(-1),
+      segment_(0), appended_(0), durable_(0), flushing_(false), failed_(false),
+      segment_bytes_(0) {
+  assert(root->children_count == 0);
+  recover();
+}
+
+Log::~Log() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (flushing_) {
+    flushed_.wait(lock);
+  }
+  if (!pending_.empty() && !failed_) {
+    flush(lock);
+  }
+  ::close(fd_);
+}
+
+void Log::recover() {
+  std::vector<uint64_t> checkpoints = listFiles(directory_, CHECKPOINT_PREFIX);
+  std::vector<uint64_t> segments = listFiles(directory_, SEGMENT_PREFIX);
+
+  uint64_t first = 0;
+  if (!checkpoints.empty()) {
+    first = checkpoints.back();
+    replay(root_, fileName(directory_, CHECKPOINT_PREFIX, first));
+  }
+  uint64_t last = first;
+  for (uint64_t segment : segments) {
+    if (segment >= first) {
+      replay(root_, fileName(directory_, SEGMENT_PREFIX, segment));
+      last = std::max(last, segment);
+    }
+  }
+
+  // A torn tail stays in its segment, later writes go to a new one
+  openSegment(last + 1);
+}
+
+void Log::openSegment(uint64_t segment) {
+  std::string path = fileName(directory_, SEGMENT_PREFIX, segment);
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  check(fd_ >= 0, "open " + path);
+  syncDirectory(directory_);
+  segment_ = segment;
+  segment_bytes_ = 0;
+}
+
+std::mutex& Log::stripe(KEY) {
+  return stripes_[checksum(key, key_len) % WAL_STRIPES];
+}
+
+uint64_t Log::append(uint8_t type, KEY, Nodes::Value value) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  size_t size = pending_.size();
+  encode(pending_, type, KARGS, value);
+  appended_ += pending_.size() - size;
+  return appended_;
+}
+
+// The first writer to find its record not yet durable writes and syncs
+// everything pending, the writers arriving meanwhile wait for the next batch.
+void Log::commit(uint64_t lsn) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (durable_ < lsn) {
+    if (flushing_) {
+      flushed_.wait(lock);
+    } else {
+      flush(lock);
+    }
+  }
+}
+
+// Called holding the lock, which is released during I/O. A failed write may
+// leave a torn record in the segment, which would hide the records after it
+// from replay, so the log takes no more writes.
+void Log::flush(std::unique_lock<std::mutex>& lock) {
+  if (failed_) {
+    throw std::system_error(EIO, std::generic_category(),
+                            "write-ahead log failed earlier");
+  }
+  flushing_ = true;
+  std::vector<uint8_t> batch;
+  batch.swap(pending_);
+  uint64_t end = appended_;
+  int fd = fd_;
+  std::string path = fileName(directory_, SEGMENT_PREFIX, segment_);
+  lock.unlock();
+
+  try {
+    writeAll(fd, batch.data(), batch.size(), path);
+    if (options_.sync) {
+      check(::fdatasync(fd) == 0, "fdatasync " + path);
+    }
+  } catch (...) {
+    lock.lock();
+    flushing_ = false;
+    failed_ = true;
+    flushed_.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  durable_ = end;
+  segment_bytes_ += batch.size();
+  flushing_ = false;
+  flushed_.notify_all();
+}
+
+// Moves to a new segment once the current one is durable. Writers must be
+// stopped, so that no record is appended meanwhile.
+void Log::rotate() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (flushing_ || !pending_.empty()) {
+    if (flushing_) {
+      flushed_.wait(lock);
+    } else {
+      flush(lock);
+    }
+  }
+  if (!options_.sync) {
+    check(::fdatasync(fd_) == 0, "fdatasync");
+  }
+  ::close(fd_);
+  openSegment(segment_ + 1);
+}
+
+void Log::checkpoint() {
+  std::lock_guard<std::mutex> checkpointing(checkpoint_mutex_);
+  writeCheckpoint();
+}
+
+// Called holding checkpoint_mutex_. The checkpoint is fuzzy: writers are
+// only stopped while the log moves to a new segment, then the tree is walked
+// key by key while they go on. A key changed during the walk may be found in
+// either state, but every change made since the checkpoint began is in the
+// new segment or later ones, and replaying them in order on top of the
+// checkpoint gives the last state of each key.
+void Log::writeCheckpoint() {
+  for (std::mutex& m : stripes_) {
+    m.lock();
+  }
+  uint64_t segment;
+  try {
+    rotate();
+    segment = segment_;
+  } catch (...) {
+    for (std::mutex& m : stripes_) {
+      m.unlock();
+    }
+    throw;
+  }
+  // The tree holds at least the effects of the segments before the new one
+  for (std::mutex& m : stripes_) {
+    m.unlock();
+  }
+
+  std::string tmp_path = directory_ + "/" + CHECKPOINT_TMP;
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  check(fd >= 0, "open " + tmp_path);
+  std::vector<uint8_t> buffer;
+  std::vector<uint8_t> last;
+  for (bool first = true;; first = false) {
+    // keeps the leaf of the key found alive until it is encoded
+    Epoch::Guard guard;
+    const uint8_t* key;
+    size_t key_len;
+    Nodes::Value value;
+    bool found = first ? Actions::minimum(root_, key, key_len, value)
+                       : Actions::upperBound(root_, last.data(), last.size(),
+                                             key, key_len, value);
+    if (!found) {
+      break;
+    }
+    encode(buffer, INSERT, KARGS, value);
+    last.assign(key, key + key_len);
+    if (buffer.size() >= IO_CHUNK) {
+      writeAll(fd, buffer.data(), buffer.size(), tmp_path);
+      buffer.clear();
+    }
+  }
+  writeAll(fd, buffer.data(), buffer.size(), tmp_path);
+
+  check(::fdatasync(fd) == 0, "fdatasync " + tmp_path);
+  ::close(fd);
+  std::string path = fileName(directory_, CHECKPOINT_PREFIX, segment);
+  check(::rename(tmp_path.c_str(), path.c_str()) == 0, "rename " + path);
+  syncDirectory(directory_);
+
+  // Truncate the log: whatever comes before the checkpoint is in it
+  for (uint64_t old : listFiles(directory_, SEGMENT_PREFIX)) {
+    if (old < segment) {
+      ::unlink(fileName(directory_, SEGMENT_PREFIX, old).c_str());
+    }
+  }
+  for (uint64_t old : listFiles(directory_, CHECKPOINT_PREFIX)) {
+    if (old < segment) {
+      ::unlink(fileName(directory_, CHECKPOINT_PREFIX, old).c_str());
+    }
+  }
+}
+
+void Log::maybeCheckpoint() {
+  if (options_.checkpoint_bytes == 0 ||
+      segment_bytes_.load() < options_.checkpoint_bytes) {
+    return;
+  }
+  // Unless someone else is taking it already
+  std::unique_lock<std::mutex> lock(checkpoint_mutex_, std::try_to_lock);
+  if (lock.owns_lock() &&
+      segment_bytes_.load() >= options_.checkpoint_bytes) {
+    writeCheckpoint();
+  }
+}
+
+// Each write holds the stripe of its key until the record is durable and the
+// tree is updated, so the key cannot change in between.
+void Log::insert(KEY, Nodes::Value value) {
+  {
+    std::lock_guard<std::mutex> guard(stripe(KARGS));
+    commit(append(INSERT, KARGS, value));
+    Actions::insert(root_, KARGS, value);
+  }
+  maybeCheckpoint();
+}
+
+bool Log::remove(KEY) {
+  {
+    std::lock_guard<std::mutex> guard(stripe(KARGS));
+    if (Actions::search(root_, KARGS) == nullptr) {
+      return false;
+    }
+    commit(append(REMOVE, KARGS, 0));
+    Actions::remove(root_, KARGS);
+  }
+  maybeCheckpoint();
+  return true;
+}
+
+bool Log::upsert(KEY, Actions::UpsertFn fn, void* arg) {
+  {
+    std::lock_guard<std::mutex> guard(stripe(KARGS));
+    Nodes::Value old_value;
+    bool found = Actions::readLeaf(root_, KARGS, copyValue, &old_value);
+    Nodes::Value value;
+    if (!fn(found ? &old_value : nullptr, value, arg)) {
+      return false;
+    }
+    commit(append(INSERT, KARGS, value));
+    Actions::insert(root_, KARGS, value);
+  }
+  maybeCheckpoint();
+  return true;
+}
+
+} // namespace Wal
@@ -0,0 +1,96 @@
+#ifndef WAL
+#define WAL
+
+#include "actions.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Write-ahead log of the inserts and removes of a tree, kept in a directory:
+//   wal.<n>         segments of the log, in order
+//   checkpoint.<n>  contents of the tree taken while segment n was written,
+//                   which segment n and the ones after it complete
+// Writes go through Log, which appends a record, waits until it is durable and
+// only then applies the write to the tree, so that nothing is seen before it
+// would survive a crash. Writers waiting at the same time share a single
+// write + fdatasync (group commit).
+//
+// I/O errors are reported with std::system_error. A write failing this way is
+// not applied, though its record may still be found by the next recovery, and
+// the log refuses every write after it.
+namespace Wal {
+
+struct Options {
+  // fdatasync before a write returns. Without it records reach the file
+  // before the write returns, but may be lost with the machine.
+  bool sync = true;
+  // A checkpoint is taken once the current segment grows past this size,
+  // 0 leaves checkpoints to explicit calls
+  size_t checkpoint_bytes = 64 << 20;
+};
+
+// Number of key-hashed mutexes serializing writes of the same key, so that
+// records of a key appear in the log in the order they are applied
+#define WAL_STRIPES 256
+
+class Log {
+public:
+  // Replays the last checkpoint and the log after it into root, which must be
+  // empty, then starts a new segment.
+  Log(const std::string& directory, Nodes::Header* root,
+      const Options& options = Options());
+  // Flushes the records not yet written
+  ~Log();
+
+  Log(const Log&) = delete;
+  Log& operator=(const Log&) = delete;
+
+  void insert(KEY, Nodes::Value value);
+  // Returns false if the key was not in the tree
+  bool remove(KEY);
+  // Logged as an insert of the value fn decides on
+  bool upsert(KEY, Actions::UpsertFn fn, void* arg);
+
+  // Writes the tree to a new checkpoint, then drops the log before it.
+  // Writers only wait while the log moves to a new segment, not while the
+  // tree is being walked.
+  void checkpoint();
+
+private:
+  void recover();
+  void openSegment(uint64_t segment);
+  uint64_t append(uint8_t type, KEY, Nodes::Value value);
+  void commit(uint64_t lsn);
+  void flush(std::unique_lock<std::mutex>& lock);
+  void rotate();
+  std::mutex& stripe(KEY);
+  void writeCheckpoint();
+  void maybeCheckpoint();
+
+  const std::string directory_;
+  Nodes::Header* const root_;
+  const Options options_;
+
+  std::mutex stripes_[WAL_STRIPES];
+  std::mutex checkpoint_mutex_;
+
+  // Protect the fields below
+  std::mutex mutex_;
+  std::condition_variable flushed_;
+  int fd_;
+  uint64_t segment_;
+  std::vector<uint8_t> pending_;
+  // Log sequence numbers are byte offsets in the whole log
+  uint64_t appended_;
+  uint64_t durable_;
+  bool flushing_;
+  // A flush failed, see flush
+  bool failed_;
+  std::atomic<size_t> segment_bytes_;
+};
+
+} // namespace Wal
+
+#endif // WAL
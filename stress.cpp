@@ -0,0 +1,440 @@
+#include "src/actions.hpp"
+#include "src/epoch.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Concurrent workloads of inserts, searches, removes and scans on one tree,
+// e.g.
+//   ./run_stress [max threads] [seconds per timed run]
+//
+// The operations of a first series of runs are recorded with the times they
+// started and returned, and the history checked for linearizability: there
+// must be an order of the operations, agreeing with the times, in which
+// each one sees the effects of those before it. As linearizability is local,
+// the history of each key is checked on its own, with the algorithm of Wing
+// and Gong. A scan is a series of lowerBound and upperBound calls, each one
+// reading the key it returns and every key it skips, so those reads join the
+// histories of these keys.
+//
+// The runs which follow are timed, without recording. Either run has all
+// threads on the same keys (shared) or each thread on its own (disjoint).
+// Keys share prefixes of different lengths, some keys are prefixes of
+// others, and the first bytes after the prefix take enough values to grow
+// nodes to the largest type and shrink them back.
+
+typedef std::chrono::steady_clock Clock;
+
+// Keys of a run
+#define STRESS_KEYS 480
+// Operations of each thread of a checked run
+#define STRESS_CHECKED_OPS 20000
+// Steps of a scan
+#define STRESS_SCAN_LENGTH 8
+
+enum Kind : uint8_t { INSERT, REMOVE, READ };
+
+struct Operation {
+  uint32_t key;
+  Kind kind;
+  // Result of REMOVE and READ
+  bool found;
+  // Stored by INSERT, or read
+  Nodes::Value value;
+  uint64_t call;
+  uint64_t ret;
+};
+
+// Key of index i of the given thread (0 for the keys shared by all threads)
+std::string keyOf(size_t owner, size_t i) {
+  std::string key = "stress/" + std::to_string(owner) + "/";
+  key += (char)(1 + 2 * (i % 60));
+  for (size_t rest = i / 60; rest > 0; rest /= 5) {
+    key += (char)('a' + rest % 5);
+    // compressed prefixes of 0 to 2 bytes
+    key.append(rest % 3, '-');
+  }
+  return key;
+}
+
+// Keys of a run and their index in the histories
+struct Keys {
+  std::vector<std::string> sorted;
+  std::map<std::string, uint32_t> index;
+
+  Keys(size_t owners) {
+    for (size_t owner = 0; owner < owners; ++owner) {
+      for (size_t i = 0; i < STRESS_KEYS; ++i) {
+        sorted.push_back(keyOf(owner, i));
+      }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    for (uint32_t i = 0; i < sorted.size(); ++i) {
+      index[sorted[i]] = i;
+    }
+  }
+};
+
+// Times of the calls and returns of all threads, in real time order
+std::atomic<uint64_t> history_clock(0);
+
+// Runs random operations on the keys of a thread, recording them if history
+// is not null
+class Worker {
+public:
+  Worker(Nodes::Header* root, const Keys& keys, size_t owner, uint64_t seed,
+         std::vector<Operation>* history)
+      : root_(root), keys_(keys), owner_(owner), gen_(seed),
+        history_(history), next_value_(seed << 32) {}
+
+  void step() {
+    size_t i = gen_() % STRESS_KEYS;
+    const std::string key = keyOf(owner_, i);
+    const uint8_t* bytes = (const uint8_t*)key.data();
+    unsigned dice = gen_() % 100;
+    if (dice < 50) {
+      uint64_t call = tick();
+      bool found;
+      Nodes::Value value = 0;
+      {
+        // the leaf found stays allocated while its value is read
+        Epoch::Guard guard;
+        const Nodes::Value* found_value =
+            Actions::search(root_, bytes, key.size());
+        found = found_value != nullptr;
+        if (found) {
+          value = *found_value;
+        }
+      }
+      record(key, READ, found, value, call, tick());
+    } else if (dice < 75) {
+      // values are unique, each read tells which insert it sees
+      Nodes::Value value = ++next_value_;
+      uint64_t call = tick();
+      Actions::insert(root_, bytes, key.size(), value);
+      record(key, INSERT, true, value, call, tick());
+    } else if (dice < 90) {
+      uint64_t call = tick();
+      bool found = Actions::remove(root_, bytes, key.size());
+      record(key, REMOVE, found, 0, call, tick());
+    } else {
+      scan(key);
+    }
+  }
+
+private:
+  void scan(std::string from) {
+    Epoch::Guard guard;
+    for (size_t step = 0; step < STRESS_SCAN_LENGTH; ++step) {
+      const uint8_t* out;
+      size_t out_len;
+      Nodes::Value value;
+      uint64_t call = tick();
+      bool found =
+          step == 0 ? Actions::lowerBound(root_, (const uint8_t*)from.data(),
+                                          from.size(), out, out_len, value)
+                    : Actions::upperBound(root_, (const uint8_t*)from.data(),
+                                          from.size(), out, out_len, value);
+      std::string to;
+      if (found) {
+        to.assign((const char*)out, out_len);
+      }
+      uint64_t ret = tick();
+      if (history_ == nullptr) {
+        if (!found) {
+          return;
+        }
+        from = to;
+        continue;
+      }
+
+      // the keys skipped were absent
+      auto it = step == 0 ? std::lower_bound(keys_.sorted.begin(),
+                                             keys_.sorted.end(), from)
+                          : std::upper_bound(keys_.sorted.begin(),
+                                             keys_.sorted.end(), from);
+      for (; it != keys_.sorted.end() && (!found || *it < to); ++it) {
+        record(*it, READ, false, 0, call, ret);
+      }
+      if (!found) {
+        return;
+      }
+      if (keys_.index.count(to) == 0) {
+        std::cerr << "scan found a key never inserted" << std::endl;
+        exit(1);
+      }
+      record(to, READ, true, value, call, ret);
+      from = to;
+    }
+  }
+
+  uint64_t tick() {
+    return history_ == nullptr ? 0 : history_clock.fetch_add(1);
+  }
+
+  void record(const std::string& key, Kind kind, bool found,
+              Nodes::Value value, uint64_t call, uint64_t ret) {
+    if (history_ != nullptr) {
+      history_->push_back(
+          {keys_.index.at(key), kind, found, value, call, ret});
+    }
+  }
+
+  Nodes::Header* const root_;
+  const Keys& keys_;
+  const size_t owner_;
+  std::mt19937_64 gen_;
+  std::vector<Operation>* const history_;
+  Nodes::Value next_value_;
+};
+
+// Value of a key, in the order the operations are linearized
+struct State {
+  bool present;
+  Nodes::Value value;
+
+  bool operator<(const State& other) const {
+    return present != other.present ? present < other.present
+                                    : value < other.value;
+  }
+};
+
+// Applies op to state, returns false if op cannot see state
+bool apply(const Operation& op, State& state) {
+  switch (op.kind) {
+  case INSERT:
+    state = {true, op.value};
+    return true;
+  case REMOVE:
+    if (op.found != state.present) {
+      return false;
+    }
+    state = {false, 0};
+    return true;
+  case READ:
+    return op.found == state.present && (!op.found || op.value == state.value);
+  }
+  return false;
+}
+
+// Wing and Gong's search, memoizing the sets of operations linearized with
+// the state they lead to (Lowe's refinement). The history of a key starts
+// with the key absent.
+bool linearizable(const std::vector<const Operation*>& ops) {
+  // calls and returns in time order, as a list operations are lifted from
+  // once linearized
+  struct Event {
+    const Operation* op;
+    size_t id;
+    // matching return, for calls
+    Event* ret;
+    Event* prev;
+    Event* next;
+  };
+  std::vector<std::pair<uint64_t, size_t>> times;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    times.push_back({ops[i]->call, i});
+    times.push_back({ops[i]->ret, i});
+  }
+  std::sort(times.begin(), times.end());
+  std::vector<Event> events(times.size() + 1);
+  std::vector<Event*> calls(ops.size(), nullptr);
+  Event* head = &events[0];
+  head->prev = nullptr;
+  for (size_t i = 0; i < times.size(); ++i) {
+    Event* event = &events[i + 1];
+    size_t id = times[i].second;
+    event->op = ops[id];
+    event->id = id;
+    event->ret = nullptr;
+    event->prev = &events[i];
+    events[i].next = event;
+    event->next = nullptr;
+    if (calls[id] == nullptr) {
+      calls[id] = event;
+    } else {
+      calls[id]->ret = event;
+    }
+  }
+  auto lift = [](Event* call) {
+    call->prev->next = call->next;
+    call->next->prev = call->prev;
+    call->ret->prev->next = call->ret->next;
+    if (call->ret->next != nullptr) {
+      call->ret->next->prev = call->ret->prev;
+    }
+  };
+  auto unlift = [](Event* call) {
+    call->ret->prev->next = call->ret;
+    if (call->ret->next != nullptr) {
+      call->ret->next->prev = call->ret;
+    }
+    call->prev->next = call;
+    call->next->prev = call;
+  };
+
+  std::vector<uint64_t> linearized((ops.size() + 63) / 64, 0);
+  std::set<std::pair<std::vector<uint64_t>, State>> seen;
+  std::vector<std::pair<Event*, State>> stack;
+  State state = {false, 0};
+  Event* event = head->next;
+  while (head->next != nullptr) {
+    if (event->ret != nullptr) {
+      State next_state = state;
+      if (apply(*event->op, next_state)) {
+        linearized[event->id / 64] |= 1ull << (event->id % 64);
+        if (seen.insert({linearized, next_state}).second) {
+          stack.push_back({event, state});
+          state = next_state;
+          lift(event);
+          event = head->next;
+          continue;
+        }
+        linearized[event->id / 64] &= ~(1ull << (event->id % 64));
+      }
+      event = event->next;
+    } else {
+      // an operation returned without being linearized: backtrack
+      if (stack.empty()) {
+        return false;
+      }
+      event = stack.back().first;
+      state = stack.back().second;
+      stack.pop_back();
+      linearized[event->id / 64] &= ~(1ull << (event->id % 64));
+      unlift(event);
+      event = event->next;
+    }
+  }
+  return true;
+}
+
+const char* kindName(Kind kind) {
+  return kind == INSERT ? "insert" : kind == REMOVE ? "remove" : "read";
+}
+
+// Runs and checks a recorded workload, returns false on a violation
+bool check(size_t threads, bool shared) {
+  const Keys keys(shared ? 1 : threads);
+  Nodes::Header* root = Nodes::makeNewRoot();
+  std::vector<std::vector<Operation>> histories(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      histories[t].reserve(STRESS_CHECKED_OPS * 2);
+      Worker worker(root, keys, shared ? 0 : t, t + 1, &histories[t]);
+      for (size_t i = 0; i < STRESS_CHECKED_OPS; ++i) {
+        worker.step();
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  std::vector<std::vector<const Operation*>> by_key(keys.sorted.size());
+  size_t recorded = 0;
+  for (const std::vector<Operation>& history : histories) {
+    for (const Operation& op : history) {
+      by_key[op.key].push_back(&op);
+    }
+    recorded += history.size();
+  }
+  bool ok = true;
+  for (size_t k = 0; k < by_key.size(); ++k) {
+    if (!linearizable(by_key[k])) {
+      ok = false;
+      std::cerr << "history of key " << k << " is not linearizable:"
+                << std::endl;
+      for (const Operation* op : by_key[k]) {
+        std::cerr << "  [" << op->call << ", " << op->ret << "] "
+                  << kindName(op->kind) << " found " << op->found
+                  << " value " << op->value << std::endl;
+      }
+      break;
+    }
+  }
+  std::cout << "checked " << threads << " threads, "
+            << (shared ? "shared" : "disjoint") << " keys: " << recorded
+            << " operations, " << (ok ? "linearizable" : "NOT linearizable")
+            << std::endl;
+
+  Epoch::collect();
+  Nodes::freeRecursive(root);
+  return ok;
+}
+
+// Returns the operations per second of a timed workload
+double measure(size_t threads, bool shared, double seconds) {
+  const Keys keys(shared ? 1 : threads);
+  Nodes::Header* root = Nodes::makeNewRoot();
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> total(0);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      Worker worker(root, keys, shared ? 0 : t, t + 1, nullptr);
+      uint64_t ops = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 256; ++i) {
+          worker.step();
+        }
+        ops += 256;
+      }
+      total += ops;
+    });
+  }
+  const auto start = Clock::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop.store(true);
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  const double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  Epoch::collect();
+  Nodes::freeRecursive(root);
+  return total / elapsed;
+}
+
+int main(int argc, char** argv) {
+  const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  const size_t max_threads =
+      argc > 1 ? atoi(argv[1]) : std::max<size_t>(4, hardware);
+  const double seconds = argc > 2 ? atof(argv[2]) : 1;
+
+  std::vector<size_t> counts;
+  for (size_t threads = 1; threads < max_threads; threads *= 2) {
+    counts.push_back(threads);
+  }
+  counts.push_back(max_threads);
+
+  bool ok = true;
+  for (size_t threads : counts) {
+    ok = check(threads, true) && ok;
+    ok = check(threads, false) && ok;
+  }
+  if (!ok) {
+    return 1;
+  }
+
+  for (size_t threads : counts) {
+    for (bool shared : {true, false}) {
+      double ops = measure(threads, shared, seconds);
+      std::cout << threads << " threads, " << (shared ? "shared" : "disjoint")
+                << " keys: " << (uint64_t)ops << " ops/s, "
+                << (uint64_t)(ops / threads) << " per thread" << std::endl;
+    }
+  }
+}
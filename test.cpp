@@ -1,8 +1,33 @@
 #include "src/actions.hpp"
+#include "src/async.hpp"
+#include "src/cache.hpp"
+#include "src/compaction.hpp"
+#include "src/frozen.hpp"
+#include "src/hot.hpp"
+#include "src/multi.hpp"
 #include "src/nodes.hpp"
+#include "src/parallel.hpp"
+#include "src/remote.hpp"
+#include "src/tree.hpp"
+#include "src/wal.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
+#include <sys/resource.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #define ASSERT_VALUE(out, expected)                                            \
   assert(out != nullptr);                                                      \
@@ -117,4 +142,1577 @@ int main() {
     assert(out_len == 4);
     assert(memcmp(key2, out, 4) == 0);
   }
+
+  { // lower bound, upper bound and predecessor
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    assert(!Actions::minimum(root, out, out_len, value));
+    assert(!Actions::maximum(root, out, out_len, value));
+
+    uint32_t seed = 7;
+    for (long i = 0; i < 3000; ++i) {
+      std::string key(1 + (seed = seed * 1103515245 + 12345) % 14, 1);
+      for (size_t j = 0; j < key.size(); ++j) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 3 != 0) {
+          key[j] = (seed >> 16) % 256;
+        }
+      }
+      keys.insert(key);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+    }
+
+    assert(Actions::minimum(root, out, out_len, value));
+    assert(std::string((const char*)out, out_len) == *keys.begin());
+    assert(Actions::maximum(root, out, out_len, value));
+    assert(std::string((const char*)out, out_len) == *keys.rbegin());
+
+    for (long i = 0; i < 3000; ++i) {
+      std::string probe(1 + (seed = seed * 1103515245 + 12345) % 14, 1);
+      for (size_t j = 0; j < probe.size(); ++j) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 3 != 0) {
+          probe[j] = (seed >> 16) % 256;
+        }
+      }
+      const uint8_t* p = (const uint8_t*)probe.data();
+
+      auto it = keys.lower_bound(probe);
+      bool found = Actions::lowerBound(root, p, probe.size(), out, out_len,
+                                       value);
+      assert(found == (it != keys.end()));
+      assert(!found || std::string((const char*)out, out_len) == *it);
+
+      it = keys.upper_bound(probe);
+      found = Actions::upperBound(root, p, probe.size(), out, out_len, value);
+      assert(found == (it != keys.end()));
+      assert(!found || std::string((const char*)out, out_len) == *it);
+
+      it = keys.lower_bound(probe);
+      found = Actions::predecessor(root, p, probe.size(), out, out_len, value);
+      assert(found == (it != keys.begin()));
+      assert(!found || std::string((const char*)out, out_len) == *--it);
+
+      it = keys.upper_bound(probe);
+      found = Actions::floorKey(root, p, probe.size(), out, out_len, value);
+      assert(found == (it != keys.begin()));
+      assert(!found || std::string((const char*)out, out_len) == *--it);
+    }
+
+    Nodes::freeRecursive(root);
+  }
+
+  { // node types
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+    const size_t fan_outs[] = {2,  4,  5,  16, 17, 30,  32,  33,
+                               48, 49, 64, 65, 100, 128, 129, 256};
+    const size_t fan_outs_count = sizeof(fan_outs) / sizeof(fan_outs[0]);
+
+    auto check = [&]() {
+      for (size_t i = 0; i < fan_outs_count; ++i) {
+        std::string key(2, (char)i);
+        void** child = Nodes::findChild(root, i);
+        size_t count = 0;
+        for (size_t bit = 0; bit < 256; ++bit) {
+          key[1] = (char)bit;
+          auto found = Actions::search(root, (const uint8_t*)key.data(), 2);
+          assert((found != nullptr) == (keys.count(key) > 0));
+          count += found != nullptr ? 1 : 0;
+        }
+        if (count > 1) {
+          Nodes::Header* node_header = Nodes::asHeader(*child);
+          assert(node_header->children_count == count);
+          assert(Nodes::capacity(node_header->type) >= count);
+        }
+      }
+      const uint8_t* out;
+      size_t out_len;
+      Nodes::Value value;
+      for (size_t i = 0; i < fan_outs_count; ++i) {
+        for (size_t bit = 0; bit < 256; bit += 3) {
+          std::string probe{(char)i, (char)bit};
+          const uint8_t* p = (const uint8_t*)probe.data();
+          auto it = keys.lower_bound(probe);
+          bool found = Actions::lowerBound(root, p, 2, out, out_len, value);
+          assert(found == (it != keys.end()));
+          assert(!found || std::string((const char*)out, out_len) == *it);
+          found = Actions::predecessor(root, p, 2, out, out_len, value);
+          assert(found == (it != keys.begin()));
+          assert(!found || std::string((const char*)out, out_len) == *--it);
+        }
+      }
+    };
+
+    // Nodes made with one set of types keep working under the next
+    const Nodes::TypeSet type_sets[] = {Nodes::CLASSIC_TYPES,
+                                        Nodes::DEFAULT_TYPES, 0,
+                                        (1u << Nodes::TYPE_COUNT) - 1};
+    for (Nodes::TypeSet types : type_sets) {
+      Nodes::setNodeTypes(types);
+      for (size_t i = 0; i < fan_outs_count; ++i) {
+        for (size_t j = 0; j < fan_outs[i]; ++j) {
+          // spreads the key bits over the whole byte
+          std::string key{(char)i, (char)(j * 167)};
+          Actions::insert(root, (const uint8_t*)key.data(), 2, j);
+          keys.insert(key);
+        }
+        // a node of the previous round only grows if it has to
+        Nodes::Header* node_header =
+            Nodes::asHeader(*Nodes::findChild(root, i));
+        assert(types != Nodes::CLASSIC_TYPES ||
+               node_header->type == Nodes::fittingType(fan_outs[i]));
+      }
+      check();
+
+      for (size_t i = 0; i < fan_outs_count; ++i) {
+        for (size_t j = 1; j < fan_outs[i]; j += 2) {
+          std::string key{(char)i, (char)(j * 167)};
+          assert(Actions::remove(root, (const uint8_t*)key.data(), 2));
+          keys.erase(key);
+        }
+      }
+      check();
+    }
+    Nodes::setNodeTypes(Nodes::DEFAULT_TYPES);
+
+    for (const std::string& key : keys) {
+      assert(Actions::remove(root, (const uint8_t*)key.data(), 2));
+    }
+    assert(root->children_count == 0);
+    Nodes::freeRecursive(root);
+  }
+
+  { // read-modify-write
+    Nodes::Header* root = Nodes::makeNewRoot();
+
+    assert(Actions::fetchAdd(root, "counter", 5) == 0);
+    assert(Actions::fetchAdd(root, "counter", 2) == 5);
+    ASSERT_VALUE(Actions::search(root, "counter"), 7);
+
+    Nodes::Value expected = 6;
+    const uint8_t* counter = (const uint8_t*)"counter";
+    assert(!Actions::compareExchange(root, counter, 8, expected, 10));
+    assert(expected == 7);
+    assert(Actions::compareExchange(root, counter, 8, expected, 10));
+    ASSERT_VALUE(Actions::search(root, "counter"), 10);
+    assert(!Actions::compareExchange(root, (const uint8_t*)"count", 6,
+                                     expected, 10));
+    assert(Actions::search(root, "count") == nullptr);
+
+    const uint8_t* other = (const uint8_t*)"other";
+    assert(Actions::insertIfAbsent(root, other, 6, 1));
+    assert(!Actions::insertIfAbsent(root, other, 6, 2));
+    ASSERT_VALUE(Actions::search(root, "other"), 1);
+
+    Nodes::Value seen = -1;
+    assert(Actions::upsert(root, other, 6,
+                           [&](const Nodes::Value* old_value,
+                               Nodes::Value& new_value) {
+                             seen = *old_value;
+                             new_value = *old_value * 100;
+                             return true;
+                           }));
+    assert(seen == 1);
+    ASSERT_VALUE(Actions::search(root, "other"), 100);
+
+    // Concurrent increments on a handful of keys sharing prefixes
+    const int threads_count = 4;
+    const int increments = 2000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; ++t) {
+      threads.emplace_back([root]() {
+        for (int i = 0; i < increments; ++i) {
+          uint8_t key[3] = {9, (uint8_t)(1 + i % 20), 0};
+          Actions::fetchAdd(root, key, 3, 1);
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    for (int i = 0; i < 20; ++i) {
+      uint8_t key[3] = {9, (uint8_t)(1 + i), 0};
+      ASSERT_VALUE(Actions::search(root, key, 3),
+                   threads_count * increments / 20);
+    }
+
+    Nodes::freeRecursive(root);
+  }
+
+  { // parallel traversal
+    Nodes::Header* root = Nodes::makeNewRoot();
+
+    // Enough fan-out to have Node64s on the second level
+    const long count = 60 * 60 * 3;
+    long expected_sum = 0;
+    for (long i = 0; i < count; ++i) {
+      uint8_t key[4];
+      key[0] = 1 + i % 60;
+      key[1] = 1 + (i / 60) % 60;
+      key[2] = 1 + i / 3600;
+      key[3] = 0;
+      Actions::insert(root, key, 4, i);
+      expected_sum += i;
+    }
+
+    Parallel::Stats stats = Parallel::collectStats(root, 4);
+    assert(stats.leaf_count == (size_t)count);
+    assert(stats.node_count[(size_t)Nodes::Type::NODE256] == 1);
+    assert(stats.node_count[(size_t)Nodes::Type::NODE64] == 60);
+
+    std::vector<long> seen(4, 0);
+    Parallel::scan(root, 4, [&](size_t worker, KEY, Nodes::Value value) {
+      // keys are rebuilt whole, whichever worker scans them
+      assert(key_len == 4);
+      assert(value == (key[0] - 1) + (key[1] - 1) * 60 + (key[2] - 1) * 3600);
+      seen[worker] += 1;
+    });
+    long seen_count = 0;
+    for (long s : seen) {
+      seen_count += s;
+    }
+    assert(seen_count == count);
+
+    long sum = Parallel::aggregate(
+        root, 4, 0L, [](KEY, Nodes::Value value) { return value; },
+        [](long a, long b) { return a + b; });
+    assert(sum == expected_sum);
+
+    Parallel::freeRecursive(root, 4);
+  }
+
+  { // typed tree with inline values
+    struct Record {
+      long id;
+      double score;
+      char tag[16];
+    };
+    Typed::Tree<std::string, Record> records;
+    for (long i = 0; i < 100; ++i) {
+      Record record = {i, i * 0.5, "record"};
+      records.insert("key" + std::to_string(i), record);
+    }
+    Record record;
+    assert(records.find("key42", record));
+    assert(record.id == 42 && record.score == 21 &&
+           std::string(record.tag) == "record");
+    assert(!records.find("key100", record));
+    assert(!records.insertIfAbsent("key42", record));
+    assert(records.insertIfAbsent("", record));
+    assert(records.find("", record) && record.id == 42);
+
+    Typed::Tree<int64_t, std::string> blobs;
+    for (int64_t i = -50; i < 50; ++i) {
+      blobs.insert(i, std::string(i + 50, 'x'));
+    }
+    // values changing size move to a new leaf
+    blobs.upsert(-7, [](const std::string* old_value, std::string& out) {
+      out = *old_value + "yz";
+      return true;
+    });
+    std::string blob;
+    assert(blobs.find(-7, blob) && blob == std::string(43, 'x') + "yz");
+    assert(blobs.find(49, blob) && blob.size() == 99);
+
+    // signed keys keep their order
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    assert(Actions::minimum(blobs.root(), out, out_len, value));
+    assert(out_len == 8 && out[0] == 0x7f && out[7] == (uint8_t)-50);
+
+    Typed::Tree<uint32_t, long, Typed::Policy<Typed::Unsynchronized>> small;
+    small.insert(7, 70);
+    assert(*small.lookup(7) == 70);
+    assert(small.lookup(8) == nullptr);
+  }
+
+  { // compaction
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+    uint32_t seed = 7;
+    for (int i = 0; i < 3000; ++i) {
+      std::string key(i % 3 == 0 ? "shared-prefix-" : "");
+      for (int j = 0; j < 1 + i % 7; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back((char)(1 + (seed >> 16) % 50));
+      }
+      keys.insert(key);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(),
+                      key.size());
+    }
+    Parallel::Stats before = Parallel::collectStats(root, 1);
+
+    Nodes::Header* old_root = Compaction::compactAndSwap(&root);
+    Nodes::freeRecursive(old_root);
+    Parallel::Stats after = Parallel::collectStats(root, 1);
+    assert(after.leaf_count == before.leaf_count);
+    assert(after.memory_bytes <= before.memory_bytes);
+
+    for (const std::string& key : keys) {
+      ASSERT_VALUE(Actions::search(root, (const uint8_t*)key.data(),
+                                   key.size()),
+                   (long)key.size());
+    }
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    assert(Actions::minimum(root, out, out_len, value));
+    assert(std::string((const char*)out, out_len) == *keys.begin());
+
+    // the compacted tree is still writable
+    for (int i = 0; i < 3000; ++i) {
+      std::string key("shared-prefix-" + std::to_string(i));
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), -i);
+      ASSERT_VALUE(Actions::search(root, (const uint8_t*)key.data(),
+                                   key.size()),
+                   -i);
+    }
+    for (const std::string& key : keys) {
+      assert(Actions::search(root, (const uint8_t*)key.data(), key.size()));
+    }
+
+    Parallel::freeRecursive(root, 4);
+  }
+
+  { // frozen tree
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+    uint32_t seed = 11;
+    for (int i = 0; i < 3000; ++i) {
+      std::string key(i % 2 == 0 ? "a long shared prefix " : "");
+      for (int j = 0; j < 1 + i % 5; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back((char)(1 + (seed >> 16) % (i % 3 == 0 ? 200 : 4)));
+      }
+      keys.insert(key);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(),
+                      key.size());
+    }
+
+    Frozen::Tree frozen = Frozen::freeze(root);
+    assert(frozen.data.size() < Parallel::collectStats(root, 1).memory_bytes);
+
+    Nodes::Value value;
+    for (const std::string& key : keys) {
+      assert(Frozen::search(frozen, (const uint8_t*)key.data(), key.size(),
+                            value));
+      assert(value == (long)key.size());
+      std::string missing = key + '\xff';
+      assert(keys.count(missing) > 0 ||
+             !Frozen::search(frozen, (const uint8_t*)missing.data(),
+                             missing.size(), value));
+    }
+
+    std::vector<std::string> scanned;
+    Frozen::scan(frozen, [&](KEY, Nodes::Value) {
+      scanned.push_back(std::string((const char*)key, key_len));
+      return true;
+    });
+    assert(scanned == std::vector<std::string>(keys.begin(), keys.end()));
+
+    std::string bounds[] = {"", "a long", "a long shared prefix \x02", "\x03",
+                            std::string(1, '\xff')};
+    for (const std::string& bound : bounds) {
+      auto expected = keys.lower_bound(bound);
+      Frozen::scan(frozen, (const uint8_t*)bound.data(), bound.size(),
+                   [&](KEY, Nodes::Value) {
+                     assert(expected != keys.end());
+                     assert(std::string((const char*)key, key_len) ==
+                            *expected);
+                     return ++expected != keys.end() &&
+                            expected->size() % 4 != 0;
+                   });
+    }
+
+    Nodes::freeRecursive(root);
+  }
+
+  { // remove
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+
+    uint32_t seed = 7;
+    for (long i = 0; i < 20000; ++i) {
+      std::string key;
+      size_t len = 1 + (seed = seed * 1103515245 + 12345) % 10;
+      for (size_t j = 0; j < len; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back(1 + (seed >> 16) % 6);
+      }
+      seed = seed * 1103515245 + 12345;
+      const uint8_t* k = (const uint8_t*)key.data();
+      if ((seed >> 16) % 3 == 0) {
+        assert(Actions::remove(root, k, key.size()) == (keys.erase(key) > 0));
+        assert(Actions::search(root, k, key.size()) == nullptr);
+      } else {
+        Actions::insert(root, k, key.size(), key.size());
+        keys.insert(key);
+      }
+    }
+
+    // Bounds must skip the removed keys
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    std::string previous;
+    for (const std::string& key : keys) {
+      assert(Actions::lowerBound(root, (const uint8_t*)previous.data(),
+                                 previous.size(), out, out_len, value));
+      assert(std::string((const char*)out, out_len) == key);
+      previous = key;
+      previous.push_back(0);
+    }
+#ifdef ORDER_STATS
+    assert(Nodes::subtreeCount(root) == keys.size());
+#endif
+
+    for (const std::string& key : keys) {
+      assert(Actions::remove(root, (const uint8_t*)key.data(), key.size()));
+    }
+    assert(root->children_count == 0);
+    assert(!Actions::minimum(root, out, out_len, value));
+
+    // Concurrent removes of disjoint keys, while readers search
+    const long n = 100000;
+    for (long i = 0; i < n; ++i) {
+      Actions::insert(root, (const uint8_t*)&i, sizeof(i), i);
+    }
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; ++t) {
+      threads.emplace_back([root, t, n]() {
+        for (long i = t; i < n; i += 4) {
+          assert(Actions::remove(root, (const uint8_t*)&i, sizeof(i)));
+          long j = n - 1 - i;
+          auto found = Actions::search(root, (const uint8_t*)&j, sizeof(j));
+          assert(found == nullptr || *found == j);
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    assert(root->children_count == 0);
+
+    Epoch::collect();
+    Nodes::freeRecursive(root);
+  }
+
+  { // write-ahead log
+    char directory[] = "/tmp/art-wal-XXXXXX";
+    assert(mkdtemp(directory) != nullptr);
+    Wal::Options options;
+    options.sync = false;
+    options.checkpoint_bytes = 1 << 16;
+
+    std::vector<long> expected(40000, -1);
+    {
+      Nodes::Header* root = Nodes::makeNewRoot();
+      Wal::Log log(directory, root, options);
+      std::vector<std::thread> threads;
+      for (long t = 0; t < 4; ++t) {
+        threads.emplace_back([&log, &expected, t]() {
+          uint32_t seed = t;
+          for (long i = t; i < (long)expected.size(); i += 4) {
+            log.insert((const uint8_t*)&i, sizeof(i), i);
+            expected[i] = i;
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 16) % 4 == 0) {
+              log.remove((const uint8_t*)&i, sizeof(i));
+              expected[i] = -1;
+            }
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      long key = 1;
+      Actions::UpsertFn add = [](const Nodes::Value* old_value,
+                                 Nodes::Value& new_value, void*) {
+        new_value = old_value != nullptr ? *old_value + 100 : 0;
+        return true;
+      };
+      log.upsert((const uint8_t*)&key, sizeof(key), add, nullptr);
+      expected[1] = expected[1] == -1 ? 0 : 101;
+      Parallel::freeRecursive(root);
+    }
+
+    // A record torn by a crash is dropped
+    std::string torn = std::string(directory) + "/wal.1000";
+    FILE* file = fopen(torn.c_str(), "w");
+    fputs("\1\7", file);
+    fclose(file);
+
+    for (int round = 0; round < 2; ++round) {
+      Nodes::Header* root = Nodes::makeNewRoot();
+      {
+        Wal::Log log(directory, root, options);
+        for (long i = 0; i < (long)expected.size(); ++i) {
+          auto found = Actions::search(root, (const uint8_t*)&i, sizeof(i));
+          if (expected[i] == -1) {
+            assert(found == nullptr);
+          } else {
+            ASSERT_VALUE(found, expected[i]);
+          }
+        }
+        // The second round starts from this checkpoint alone
+        log.checkpoint();
+      }
+      Parallel::freeRecursive(root);
+    }
+
+    // A write which fails to reach the log is not applied, nor is any write
+    // after it, and recovery drops its torn record
+    {
+      Nodes::Header* root = Nodes::makeNewRoot();
+      long key = -1;
+      {
+        Wal::Log log(directory, root, options);
+        rlimit limit;
+        assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+        rlimit tiny = limit;
+        tiny.rlim_cur = 1;
+        signal(SIGXFSZ, SIG_IGN);
+        assert(setrlimit(RLIMIT_FSIZE, &tiny) == 0);
+        for (int i = 0; i < 2; ++i) {
+          bool failed = false;
+          try {
+            log.insert((const uint8_t*)&key, sizeof(key), 1);
+          } catch (const std::system_error&) {
+            failed = true;
+          }
+          assert(failed);
+          assert(Actions::search(root, (const uint8_t*)&key, sizeof(key)) ==
+                 nullptr);
+        }
+        assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+        signal(SIGXFSZ, SIG_DFL);
+      }
+      Parallel::freeRecursive(root);
+
+      root = Nodes::makeNewRoot();
+      {
+        Wal::Log log(directory, root, options);
+        assert(Actions::search(root, (const uint8_t*)&key, sizeof(key)) ==
+               nullptr);
+        long i = 1;
+        ASSERT_VALUE(Actions::search(root, (const uint8_t*)&i, sizeof(i)),
+                     expected[1]);
+      }
+      Parallel::freeRecursive(root);
+    }
+
+    std::string remove_all = std::string("rm -r ") + directory;
+    assert(system(remove_all.c_str()) == 0);
+  }
+
+  { // hot key cache
+    Nodes::Header* root = Nodes::makeNewRoot();
+    auto keyOf = [](long i) { return "hot/" + std::to_string(i); };
+    const long n = 10000;
+    for (long i = 0; i < n; ++i) {
+      std::string key = keyOf(i);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+    }
+    Hot::Cache cache(root, 64);
+    auto search = [&cache](const std::string& key, Nodes::Value& value) {
+      return cache.search((const uint8_t*)key.data(), key.size(), value);
+    };
+    auto find = [&cache](const std::string& key, Nodes::Value& value) {
+      return cache.find((const uint8_t*)key.data(), key.size(), value);
+    };
+
+    // Keys read again and again end up in the cache
+    std::string hot = keyOf(42);
+    Nodes::Value value;
+    for (int i = 0; i < HOT_ADMIT; ++i) {
+      assert(search(hot, value) && value == 42);
+    }
+#ifndef LEAF_SUFFIXES
+    assert(find(hot, value) && value == 42);
+#endif
+    std::string missing = keyOf(n);
+    for (int i = 0; i < HOT_ADMIT; ++i) {
+      assert(!search(missing, value));
+    }
+    assert(!find(missing, value));
+
+    // Stale entries are never used
+    Actions::insert(root, (const uint8_t*)hot.data(), hot.size(), -42);
+    assert(!find(hot, value) || value == -42);
+    assert(search(hot, value) && value == -42);
+    Actions::remove(root, (const uint8_t*)hot.data(), hot.size());
+    assert(!find(hot, value));
+    assert(!search(hot, value));
+    // nor the ones of an older epoch
+    std::string other = keyOf(7);
+    for (int i = 0; i < HOT_ADMIT; ++i) {
+      assert(search(other, value) && value == 7);
+    }
+    Epoch::collect();
+    assert(!find(other, value));
+    assert(search(other, value) && value == 7);
+    // which are made again on the next miss
+#ifndef LEAF_SUFFIXES
+    assert(find(other, value) && value == 7);
+#endif
+
+    // Readers of skewed keys see each key's values in the order written
+    std::atomic<bool> stop(false);
+    std::thread writer([&]() {
+      std::mt19937 gen(3);
+      for (long round = 1; !stop.load(); ++round) {
+        long i = gen() % 64;
+        std::string key = keyOf(i);
+        if (round % 16 == 0) {
+          Actions::remove(root, (const uint8_t*)key.data(), key.size());
+        }
+        Actions::insert(root, (const uint8_t*)key.data(), key.size(),
+                        round * n + i);
+      }
+    });
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+      readers.emplace_back([&, t]() {
+        std::mt19937 gen(t);
+        std::vector<Nodes::Value> last(n, 0);
+        for (int j = 0; j < 200000; ++j) {
+          long i = std::min(gen() % n, gen() % 128);
+          Nodes::Value value;
+          if (search(keyOf(i), value)) {
+            assert(value % n == i);
+            assert(value >= last[i]);
+            last[i] = value;
+          }
+        }
+      });
+    }
+    for (std::thread& reader : readers) {
+      reader.join();
+    }
+    stop.store(true);
+    writer.join();
+    Nodes::freeRecursive(root);
+  }
+
+  { // multiple values per key
+    Multi::Tree tree;
+    auto add = [&tree](const std::string& key, Nodes::Value value) {
+      return tree.add((const uint8_t*)key.data(), key.size(), value);
+    };
+    auto remove = [&tree](const std::string& key, Nodes::Value value) {
+      return tree.remove((const uint8_t*)key.data(), key.size(), value);
+    };
+    auto count = [&tree](const std::string& key) {
+      return tree.count((const uint8_t*)key.data(), key.size());
+    };
+    auto values = [&tree](const std::string& key) {
+      std::vector<Nodes::Value> out;
+      tree.forEach((const uint8_t*)key.data(), key.size(),
+                   [&out](Nodes::Value value) {
+                     out.push_back(value);
+                     return true;
+                   });
+      return out;
+    };
+
+    // Keys which are prefixes of others, values kept sorted and unique
+    assert(add("ab", 3) && add("ab", -1) && add("ab", 7) && !add("ab", 3));
+    assert(add("a", 5) && add("abc", 5));
+    assert(values("ab") == std::vector<Nodes::Value>({-1, 3, 7}));
+    assert(count("a") == 1 && count("abc") == 1 && count("b") == 0);
+    assert(!remove("ab", 4) && !remove("b", 3));
+    assert(remove("ab", 3) && count("ab") == 2);
+    assert(remove("a", 5) && count("a") == 0);
+    assert(Actions::search(tree.root(), (const uint8_t*)"a", 1) == nullptr);
+    assert(values("abc") == std::vector<Nodes::Value>({5}));
+
+    // Large keys move to a tree of their own and back
+    const long n = MULTI_ARRAY_MAX * 8;
+    std::set<Nodes::Value> expected;
+    std::mt19937 gen(5);
+    for (long i = 0; i < n; ++i) {
+      Nodes::Value value = (Nodes::Value)gen() - (1l << 31);
+      assert(add("large", value) == expected.insert(value).second);
+    }
+    assert(count("large") == expected.size());
+    std::vector<Nodes::Value> large = values("large");
+    assert(std::equal(large.begin(), large.end(), expected.begin()) &&
+           large.size() == expected.size());
+    size_t seen = 0;
+    tree.forEach((const uint8_t*)"large", 5, [&seen](Nodes::Value) {
+      return ++seen < 10;
+    });
+    assert(seen == 10);
+    while (!expected.empty()) {
+      auto it = expected.begin();
+      std::advance(it, gen() % expected.size());
+      assert(remove("large", *it));
+      expected.erase(it);
+      assert(count("large") == expected.size());
+      if (expected.size() % 97 == 0) {
+        assert(values("large") ==
+               std::vector<Nodes::Value>(expected.begin(), expected.end()));
+      }
+    }
+    assert(count("large") == 0);
+
+    // Writers of the same keys, and readers
+    std::atomic<bool> stop(false);
+    std::thread reader([&]() {
+      while (!stop.load()) {
+        for (int k = 0; k < 4; ++k) {
+          std::vector<Nodes::Value> seen = values("shared" + std::to_string(k));
+          assert(std::adjacent_find(seen.begin(), seen.end(),
+                                    std::greater_equal<Nodes::Value>()) ==
+                 seen.end());
+        }
+      }
+    });
+    std::vector<std::thread> writers;
+    for (long t = 0; t < 3; ++t) {
+      writers.emplace_back([&, t]() {
+        std::mt19937 gen(t);
+        for (long i = 0; i < 20000; ++i) {
+          std::string key = "shared" + std::to_string(gen() % 4);
+          // each thread adds and removes negative values of its own
+          Nodes::Value value = -1 - t * n - gen() % 300;
+          if (gen() % 2 == 0) {
+            add(key, value);
+          } else {
+            remove(key, value);
+          }
+        }
+        // keeps the values i * 3 + t, 0 <= i < n / 3, of every key
+        for (int k = 0; k < 4; ++k) {
+          std::string key = "shared" + std::to_string(k);
+          for (long v = 0; v < 300; ++v) {
+            remove(key, -1 - t * n - v);
+          }
+          for (long i = 0; i < n / 3; ++i) {
+            add(key, i * 3 + t);
+          }
+        }
+      });
+    }
+    for (std::thread& writer : writers) {
+      writer.join();
+    }
+    stop.store(true);
+    reader.join();
+    for (int k = 0; k < 4; ++k) {
+      std::vector<Nodes::Value> shared = values("shared" + std::to_string(k));
+      assert(shared.size() == (size_t)(n / 3) * 3);
+      for (size_t i = 0; i < shared.size(); ++i) {
+        assert(shared[i] == (Nodes::Value)i);
+      }
+    }
+  }
+
+  { // socket server
+    char directory[] = "/tmp/art-remote-XXXXXX";
+    assert(mkdtemp(directory) != nullptr);
+    const std::string path = std::string(directory) + "/socket";
+    Nodes::Header* root = Nodes::makeNewRoot();
+    {
+      Remote::Server server(root, path, 2);
+      Remote::Client client(path);
+      auto key = [](const std::string& s) { return (const uint8_t*)s.data(); };
+      const std::string a = "a", ab = "ab", b = "b";
+      Remote::Client::Response response;
+      typedef std::vector<std::pair<std::string, Nodes::Value>> Entries;
+
+      // Pipelined, answered in order, each seeing the requests before it
+      client.get(key(a), 1);
+      client.put(key(a), 1, 1);
+      client.put(key(ab), 2, 2);
+      client.put(key(a), 1, 3);
+      client.get(key(a), 1);
+      client.put(key(b), 1, 4);
+      client.scan(key(a), 1, 2);
+      client.remove(key(a), 1);
+      client.remove(key(a), 1);
+      client.get(key(a), 1);
+      client.scan(key(a), 1, 10);
+      assert(client.pending() == 11);
+      client.receive(response);
+      assert(response.status == Remote::NOT_FOUND);
+      for (int i = 0; i < 3; ++i) {
+        client.receive(response);
+        assert(response.status == Remote::OK);
+      }
+      client.receive(response);
+      assert(response.status == Remote::FOUND && response.value == 3);
+      client.receive(response);
+      client.receive(response);
+      Entries first = {{"a", 3}, {"ab", 2}};
+      assert(response.status == Remote::OK && response.entries == first);
+      client.receive(response);
+      assert(response.status == Remote::OK);
+      client.receive(response);
+      assert(response.status == Remote::NOT_FOUND);
+      client.receive(response);
+      assert(response.status == Remote::NOT_FOUND);
+      client.receive(response);
+      Entries rest = {{"ab", 2}, {"b", 4}};
+      assert(response.entries == rest);
+      assert(client.pending() == 0);
+
+      // Clients pipelining on connections of their own
+      std::vector<std::thread> threads;
+      for (long t = 0; t < 4; ++t) {
+        threads.emplace_back([&path, t]() {
+          Remote::Client client(path);
+          Remote::Client::Response response;
+          for (long i = t; i < 20000; i += 4) {
+            client.put((const uint8_t*)&i, sizeof(i), i);
+            client.get((const uint8_t*)&i, sizeof(i));
+            if (client.pending() >= 64) {
+              client.receive(response);
+              assert(response.status == Remote::OK);
+              client.receive(response);
+              assert(response.status == Remote::FOUND &&
+                     response.value == i - 31 * 4);
+            }
+          }
+          while (client.pending() > 0) {
+            client.receive(response);
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      for (long i = 0; i < 20000; ++i) {
+        const Nodes::Value* value =
+            Actions::search(root, (const uint8_t*)&i, sizeof(i));
+        assert(value != nullptr && *value == i);
+      }
+
+      // Keys too long for a request are refused, they come back whole from
+      // scans. Responses piling up past what the socket takes are all sent
+      // to a client done sending before its connection is closed.
+      const std::string long_key(70000, 'x');
+      bool refused = false;
+      try {
+        client.get(key(long_key), long_key.size());
+      } catch (const std::system_error&) {
+        refused = true;
+      }
+      assert(refused && client.pending() == 0);
+      Actions::insert(root, key(long_key), long_key.size(), 5);
+      const std::string xx = "xx";
+      const int scans = 64;
+      for (int i = 0; i < scans; ++i) {
+        client.scan(key(xx), xx.size(), 1);
+      }
+      client.finish();
+      for (int i = 0; i < scans; ++i) {
+        client.receive(response);
+        assert(response.status == Remote::OK);
+        assert(response.entries.size() == 1 &&
+               response.entries[0].first == long_key &&
+               response.entries[0].second == 5);
+      }
+    }
+    assert(access(path.c_str(), F_OK) != 0);
+    rmdir(directory);
+    Nodes::freeRecursive(root);
+  }
+
+#ifdef CACHE_MODE
+  { // bounded cache
+    const int64_t budget = 4 << 20;
+    // a write may stop evicting on a round of keys read since the hand
+    // last went by
+    const int64_t slack = budget / 16;
+    Cache::Tree cache(budget);
+    auto keyOf = [](long i) { return "cached/" + std::to_string(i); };
+
+    // Hot keys, read between the writes, survive the eviction of the others
+    const long hot = 64;
+    const long n = 300000;
+    Nodes::Value value;
+    for (long i = 0; i < n; ++i) {
+      std::string key = keyOf(i);
+      cache.put((const uint8_t*)key.data(), key.size(), i);
+      std::string hot_key = keyOf(i % hot);
+      assert(cache.get((const uint8_t*)hot_key.data(), hot_key.size(),
+                       value));
+      assert(value == i % hot);
+    }
+    assert(cache.evictions() > 0);
+    assert(cache.allocatedBytes() <= budget + slack);
+
+    // Another cache has a budget of its own
+    {
+      Cache::Tree other(budget / 4);
+      const int64_t bytes = cache.allocatedBytes();
+      for (long i = 0; i < n / 4; ++i) {
+        std::string key = keyOf(i);
+        other.put((const uint8_t*)key.data(), key.size(), i);
+      }
+      assert(other.evictions() > 0);
+      assert(other.allocatedBytes() <= budget / 4 + slack);
+      assert(cache.allocatedBytes() == bytes);
+    }
+    // the cache is not emptied either
+    long cached = 0;
+    for (long i = 0; i < n; ++i) {
+      std::string key = keyOf(i);
+      if (cache.get((const uint8_t*)key.data(), key.size(), value)) {
+        assert(value == i);
+        ++cached;
+      }
+    }
+    assert(cached >= hot && cached < n);
+    assert(cached > (long)cache.evictions() / 100);
+
+    // Concurrent writers and readers
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; ++t) {
+      threads.emplace_back([&cache, &keyOf, t]() {
+        std::mt19937 gen(t);
+        Nodes::Value value;
+        for (long i = 0; i < 100000; ++i) {
+          std::string key = keyOf(gen() % 1000000);
+          if (gen() % 2 == 0) {
+            cache.put((const uint8_t*)key.data(), key.size(), i);
+          } else if (gen() % 16 == 0) {
+            cache.remove((const uint8_t*)key.data(), key.size());
+          } else {
+            cache.get((const uint8_t*)key.data(), key.size(), value);
+          }
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    assert(cache.allocatedBytes() <= budget + slack);
+  }
+#endif
+
+#if __cplusplus >= 202002L
+  { // interleaved lookups
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::vector<std::string> keys;
+    for (long i = 0; i < 20000; ++i) {
+      // keys which are prefixes of others, and long shared prefixes
+      keys.push_back(std::to_string(i));
+      keys.push_back(std::string(40, 'p') + std::to_string(i * 7));
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      Actions::insert(root, (const uint8_t*)keys[i].data(), keys[i].size(),
+                      i);
+    }
+
+    struct Check {
+      long expected;
+      long* remaining;
+    };
+    auto check = [](const Async::Result& result, void* arg) {
+      Check* c = (Check*)arg;
+      assert(result.found == (c->expected >= 0));
+      assert(!result.found || result.value == c->expected);
+      --*c->remaining;
+    };
+
+    // Present and missing keys, while a writer changes the nodes on their
+    // paths
+    std::atomic<bool> stop(false);
+    std::thread writer([root, &stop]() {
+      for (long i = 0; !stop.load(); i = (i + 1) % 50000) {
+        std::string key = std::to_string(i) + "w";
+        Actions::insert(root, (const uint8_t*)key.data(), key.size(), -1);
+        if (i % 3 != 0) {
+          Actions::remove(root, (const uint8_t*)key.data(), key.size());
+        }
+      }
+    });
+    Async::Scheduler scheduler;
+    std::vector<std::string> queries;
+    std::vector<Check> checks;
+    long remaining = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      queries.push_back(keys[i]);
+      checks.push_back(Check{(long)i, &remaining});
+      queries.push_back(keys[i] + "x");
+      checks.push_back(Check{-1, &remaining});
+      queries.push_back(keys[i].substr(0, keys[i].size() / 2) + "y");
+      checks.push_back(Check{-1, &remaining});
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+      Async::Lookup lookup = Async::search(
+          root, (const uint8_t*)queries[i].data(), queries[i].size());
+      ++remaining;
+      while (!scheduler.submit(std::move(lookup), check, &checks[i])) {
+        scheduler.step();
+      }
+      assert(scheduler.inFlight() <= scheduler.width());
+    }
+    scheduler.drain();
+    assert(remaining == 0);
+    stop.store(true);
+    writer.join();
+
+    // A lookup left suspended is destroyed with its handle
+    {
+      Async::Lookup lookup =
+          Async::search(root, (const uint8_t*)keys[1].data(), keys[1].size());
+      lookup.resume();
+      assert(!lookup.done());
+    }
+
+    // A scheduler kept full does not stop memory from being freed
+    struct Feed {
+      Async::Scheduler* scheduler;
+      Nodes::Header* root;
+      const std::string* key;
+      bool* stop;
+      long completed;
+
+      static void done(const Async::Result& result, void* arg) {
+        Feed* feed = (Feed*)arg;
+        assert(result.found);
+        ++feed->completed;
+        if (!*feed->stop) {
+          feed->scheduler->submit(
+              Async::search(feed->root, (const uint8_t*)feed->key->data(),
+                            feed->key->size()),
+              done, arg);
+        }
+      }
+    };
+    Async::Scheduler saturated(4);
+    bool stop_feeding = false;
+    std::vector<Feed> feeds(4,
+                            Feed{&saturated, root, &keys[3], &stop_feeding, 0});
+    for (Feed& feed : feeds) {
+      saturated.submit(Async::search(root, (const uint8_t*)keys[3].data(),
+                                     keys[3].size()),
+                       Feed::done, &feed);
+    }
+    size_t waiting = 0;
+    for (long i = 0; i < 2000; ++i) {
+      saturated.step();
+      // off the path of the lookups, which complete and start over
+      std::string key = "9retired" + std::to_string(i);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+      Actions::remove(root, (const uint8_t*)key.data(), key.size());
+      waiting = Epoch::collect();
+    }
+    assert(saturated.inFlight() == 4);
+    assert(waiting < 100);
+    for (const Feed& feed : feeds) {
+      assert(feed.completed > 0);
+    }
+    stop_feeding = true;
+    saturated.drain();
+    Nodes::freeRecursive(root);
+  }
+#endif
+
+#ifdef SNAPSHOTS
+  { // snapshots
+    Nodes::Header* root = Nodes::makeNewRoot();
+    const long n = 60000;
+    auto key_of = [](long i) {
+      char key[16];
+      snprintf(key, sizeof(key), "%06ld", i);
+      return std::string(key);
+    };
+    for (long i = 0; i < n; i += 2) {
+      Actions::insert(root, key_of(i).c_str(), i);
+    }
+
+    {
+      Snapshot::View snapshot = Snapshot::take(root);
+      std::vector<std::thread> writers;
+      for (long t = 0; t < 4; ++t) {
+        writers.emplace_back([root, t, n, key_of]() {
+          for (long i = t; i < n; i += 4) {
+            std::string key = key_of(i);
+            if (i % 2 == 0) {
+              Actions::fetchAdd(root, key.c_str(), n);
+            } else {
+              Actions::insert(root, key.c_str(), i);
+            }
+            if (i % 3 == 0) {
+              Actions::remove(root, (const uint8_t*)key.c_str(),
+                              key.size() + 1);
+            }
+          }
+        });
+      }
+
+      // Scans see the even keys with their old values, whatever the writers
+      // are doing
+      for (int round = 0; round < 3; ++round) {
+        long expected = 0;
+        Snapshot::scan(snapshot, [&](KEY, Nodes::Value value) {
+          assert(std::string((const char*)key) == key_of(expected));
+          assert(value == expected);
+          expected += 2;
+          return true;
+        });
+        assert(expected == n);
+      }
+      for (std::thread& writer : writers) {
+        writer.join();
+      }
+
+      std::string from = key_of(n / 2 + 1);
+      long expected = n / 2 + 2;
+      Snapshot::scan(snapshot, (const uint8_t*)from.c_str(), from.size() + 1,
+                     [&](KEY, Nodes::Value value) {
+                       assert(value == expected);
+                       expected += 2;
+                       return expected < n / 2 + 100;
+                     });
+      assert(expected == n / 2 + 100);
+
+      Nodes::Value value;
+      for (long i = 0; i < 100; ++i) {
+        std::string key = key_of(i);
+        bool found = Snapshot::search(snapshot, (const uint8_t*)key.c_str(),
+                                      key.size() + 1, value);
+        assert(found == (i % 2 == 0));
+        assert(!found || value == i);
+      }
+    }
+
+    for (long i = 0; i < n; ++i) {
+      auto found = Actions::search(root, key_of(i).c_str());
+      if (i % 3 == 0) {
+        assert(found == nullptr);
+      } else {
+        ASSERT_VALUE(found, (i % 2 == 0 ? i + n : i));
+      }
+    }
+
+    {
+      Snapshot::View snapshot = Snapshot::take(root);
+      for (long i = 0; i < n; ++i) {
+        std::string key = key_of(i);
+        Actions::remove(root, (const uint8_t*)key.c_str(), key.size() + 1);
+      }
+      long count = 0;
+      Snapshot::scan(snapshot, [&](KEY, Nodes::Value) {
+        ++count;
+        return true;
+      });
+      assert(count == n - (n + 2) / 3);
+    }
+
+    Epoch::collect();
+    Nodes::freeRecursive(root);
+  }
+#endif
+
+  { // batch insert
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::map<std::string, Nodes::Value> expected;
+
+    // Keys sharing long prefixes, some of them prefixes of others
+    uint32_t seed = 11;
+    auto random_key = [&seed]() {
+      std::string key;
+      seed = seed * 1103515245 + 12345;
+      if ((seed >> 16) % 2 == 0) {
+        key.assign(PREFIX_SIZE + 4, 1);
+      }
+      size_t len = 1 + (seed = seed * 1103515245 + 12345) % 6;
+      for (size_t j = 0; j < len; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back(1 + (seed >> 16) % 5);
+      }
+      return key;
+    };
+
+    for (long i = 0; i < 2000; ++i) {
+      std::string key = random_key();
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+      expected[key] = i;
+    }
+
+    for (long round = 0; round < 20; ++round) {
+      std::vector<std::string> keys;
+      for (long i = 0; i < 500; ++i) {
+        keys.push_back(random_key());
+      }
+      std::sort(keys.begin(), keys.end());
+      std::vector<const uint8_t*> key_ptrs;
+      std::vector<size_t> key_lens;
+      std::vector<Nodes::Value> values;
+      for (const std::string& key : keys) {
+        key_ptrs.push_back((const uint8_t*)key.data());
+        key_lens.push_back(key.size());
+        values.push_back(round * 1000 + values.size());
+        // the last of equal keys wins
+        expected[key] = values.back();
+      }
+      Actions::insertBatch(root, key_ptrs.data(), key_lens.data(),
+                           values.data(), keys.size());
+    }
+
+    for (const auto& entry : expected) {
+      ASSERT_VALUE(Actions::search(root, (const uint8_t*)entry.first.data(),
+                                   entry.first.size()),
+                   entry.second);
+    }
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    std::string previous;
+    for (const auto& entry : expected) {
+      assert(Actions::lowerBound(root, (const uint8_t*)previous.data(),
+                                 previous.size(), out, out_len, value));
+      assert(std::string((const char*)out, out_len) == entry.first);
+      previous = entry.first;
+      previous.push_back(0);
+    }
+#ifdef ORDER_STATS
+    assert(Nodes::subtreeCount(root) == expected.size());
+#endif
+
+    // Concurrent batches of interleaved keys
+    Nodes::Header* shared = Nodes::makeNewRoot();
+    const long n = 40000;
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; ++t) {
+      threads.emplace_back([shared, t, n]() {
+        for (long lo = t * 1000; lo < n; lo += 4000) {
+          std::vector<uint64_t> keys;
+          for (long i = lo; i < lo + 1000; ++i) {
+            keys.push_back(__builtin_bswap64(i * 7));
+          }
+          std::vector<const uint8_t*> key_ptrs;
+          std::vector<size_t> key_lens(keys.size(), sizeof(uint64_t));
+          std::vector<Nodes::Value> values;
+          for (const uint64_t& key : keys) {
+            key_ptrs.push_back((const uint8_t*)&key);
+            values.push_back(__builtin_bswap64(key));
+          }
+          Actions::insertBatch(shared, key_ptrs.data(), key_lens.data(),
+                               values.data(), keys.size());
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    for (long i = 0; i < n; ++i) {
+      uint64_t key = __builtin_bswap64(i * 7);
+      ASSERT_VALUE(Actions::search(shared, (const uint8_t*)&key, sizeof(key)),
+                   i * 7);
+    }
+#ifdef ORDER_STATS
+    assert(Nodes::subtreeCount(shared) == (size_t)n);
+#endif
+  }
+
+  { // merge
+    uint32_t seed = 5;
+    auto random_key = [&seed]() {
+      std::string key;
+      seed = seed * 1103515245 + 12345;
+      if ((seed >> 16) % 2 == 0) {
+        key.assign(PREFIX_SIZE + 3, 2);
+      }
+      size_t len = 1 + (seed = seed * 1103515245 + 12345) % 6;
+      for (size_t j = 0; j < len; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back(1 + (seed >> 16) % 4);
+      }
+      return key;
+    };
+
+    for (long round = 0; round < 50; ++round) {
+      Nodes::Header* dst = Nodes::makeNewRoot();
+      Nodes::Header* src = Nodes::makeNewRoot();
+      std::map<std::string, Nodes::Value> expected;
+      std::set<std::string> src_keys;
+      for (long i = 0; i < 300; ++i) {
+        std::string key = random_key();
+        const uint8_t* k = (const uint8_t*)key.data();
+        if (i % 2 == 0) {
+          Actions::insert(dst, k, key.size(), i);
+          expected[key] = i;
+        } else {
+          Actions::insert(src, k, key.size(), i);
+          src_keys.insert(key);
+        }
+      }
+      size_t both = 0;
+      for (const std::string& key : src_keys) {
+        const Nodes::Value* src_value =
+            Actions::search(src, (const uint8_t*)key.data(), key.size());
+        if (expected.count(key) > 0) {
+          expected[key] += *src_value;
+          ++both;
+        } else {
+          expected[key] = *src_value;
+        }
+      }
+
+      size_t conflicts = Actions::merge(
+          dst, src, [](Nodes::Value dst_value, Nodes::Value src_value) {
+            return dst_value + src_value;
+          });
+      assert(conflicts == both);
+      assert(src->children_count == 0);
+      for (const auto& entry : expected) {
+        ASSERT_VALUE(Actions::search(dst, (const uint8_t*)entry.first.data(),
+                                     entry.first.size()),
+                     entry.second);
+      }
+      const uint8_t* out;
+      size_t out_len;
+      Nodes::Value value;
+      std::string previous;
+      for (const auto& entry : expected) {
+        assert(Actions::lowerBound(dst, (const uint8_t*)previous.data(),
+                                   previous.size(), out, out_len, value));
+        assert(std::string((const char*)out, out_len) == entry.first);
+        previous = entry.first;
+        previous.push_back(0);
+      }
+      assert(!Actions::lowerBound(dst, (const uint8_t*)previous.data(),
+                                  previous.size(), out, out_len, value));
+#ifdef ORDER_STATS
+      assert(Nodes::subtreeCount(dst) == expected.size());
+      assert(Nodes::subtreeCount(src) == 0);
+#endif
+      Epoch::collect();
+      Nodes::freeRecursive(dst);
+      Nodes::freeRecursive(src);
+    }
+
+    // Shards built in parallel, merged while dst is searched
+    const long n = 100000;
+    Nodes::Header* dst = Nodes::makeNewRoot();
+    Nodes::Header* shards[4];
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; ++t) {
+      shards[t] = Nodes::makeNewRoot();
+      threads.emplace_back([&shards, t, n]() {
+        for (long i = t; i < n; i += 4) {
+          Actions::insert(shards[t], (const uint8_t*)&i, sizeof(i), i);
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+    Actions::merge(dst, shards[0], [](Nodes::Value, Nodes::Value src_value) {
+      return src_value;
+    });
+    std::atomic<bool> merged(false);
+    threads.emplace_back([dst, n, &merged]() {
+      while (!merged.load()) {
+        for (long i = 0; i < n; i += 4) {
+          ASSERT_VALUE(Actions::search(dst, (const uint8_t*)&i, sizeof(i)), i);
+        }
+      }
+    });
+    for (long t = 1; t < 4; ++t) {
+      Actions::merge(dst, shards[t], [](Nodes::Value, Nodes::Value src_value) {
+        return src_value;
+      });
+    }
+    merged.store(true);
+    threads[0].join();
+    for (long i = 0; i < n; ++i) {
+      ASSERT_VALUE(Actions::search(dst, (const uint8_t*)&i, sizeof(i)), i);
+    }
+#ifdef ORDER_STATS
+    assert(Nodes::subtreeCount(dst) == (size_t)n);
+#endif
+  }
+
+#ifdef ORDER_STATS
+  { // rank, select and countRange
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+
+    uint32_t seed = 42;
+    for (long i = 0; i < 5000; ++i) {
+      std::string key;
+      // Long runs of equal bits exercise the allocated prefix path
+      size_t len = 1 + (seed = seed * 1103515245 + 12345) % 12;
+      for (size_t j = 0; j < len; ++j) {
+        seed = seed * 1103515245 + 12345;
+        key.push_back((seed >> 16) % 5 == 0 ? 2 : 1 + (seed >> 16) % 40);
+      }
+      keys.insert(key);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+    }
+    assert(Nodes::subtreeCount(root) == keys.size());
+
+    uint64_t expected_rank = 0;
+    for (const std::string& key : keys) {
+      assert(Actions::rank(root, (const uint8_t*)key.data(), key.size()) ==
+             expected_rank);
+
+      const uint8_t* out;
+      size_t out_len;
+      Nodes::Value value;
+      assert(Actions::select(root, expected_rank, out, out_len, value));
+      assert(std::string((const char*)out, out_len) == key);
+      ++expected_rank;
+    }
+
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    assert(!Actions::select(root, keys.size(), out, out_len, value));
+
+    std::string lo(1, 3), hi(2, 20);
+    hi[1] = 7;
+    uint64_t expected_count = std::distance(keys.lower_bound(lo),
+                                            keys.lower_bound(hi));
+    assert(Actions::countRange(root, (const uint8_t*)lo.data(), lo.size(),
+                               (const uint8_t*)hi.data(),
+                               hi.size()) == expected_count);
+
+    Nodes::freeRecursive(root);
+  }
+
+  { // subtree counts under concurrent writes
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; ++t) {
+      threads.emplace_back([root, t]() {
+        std::mt19937 gen(t);
+        // short keys from a small alphabet: nodes grow, shrink and collapse
+        auto randomKey = [&gen]() {
+          std::string key(1 + gen() % 4, 0);
+          for (char& c : key) {
+            c = 1 + gen() % 40;
+          }
+          return key;
+        };
+        for (long i = 0; i < 20000; ++i) {
+          std::string key = randomKey();
+          unsigned dice = gen() % 10;
+          if (dice < 5) {
+            Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+          } else if (dice < 9) {
+            Actions::remove(root, (const uint8_t*)key.data(), key.size());
+          } else {
+            std::set<std::string> batch;
+            for (int j = 0; j < 8; ++j) {
+              batch.insert(key + randomKey());
+            }
+            std::vector<const uint8_t*> keys;
+            std::vector<size_t> key_lens;
+            std::vector<Nodes::Value> values(batch.size(), i);
+            for (const std::string& k : batch) {
+              keys.push_back((const uint8_t*)k.data());
+              key_lens.push_back(k.size());
+            }
+            Actions::insertBatch(root, keys.data(), key_lens.data(),
+                                 values.data(), keys.size());
+          }
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    // every count matches the keys below its node
+    std::function<uint64_t(void*)> check = [&check](void* node) -> uint64_t {
+      if (Nodes::isLeaf(node)) {
+        return 1;
+      }
+      Nodes::Header* node_header = Nodes::asHeader(node);
+      uint64_t count = *Nodes::findChildKeyEnd(node_header) != nullptr;
+      Nodes::forEachChild(node_header, [&](uint8_t, void* child) {
+        count += check(child);
+      });
+      assert(Nodes::subtreeCount(node_header) == count);
+      return count;
+    };
+    const uint64_t size = check(root);
+    const std::string above(6, 127);
+    assert(Actions::rank(root, (const uint8_t*)above.data(), above.size()) ==
+           size);
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    assert(size == 0 || Actions::select(root, size - 1, out, out_len, value));
+    assert(!Actions::select(root, size, out, out_len, value));
+
+    Nodes::freeRecursive(root);
+  }
+#endif
+
+#ifdef LEAF_SUFFIXES
+  { // leaves store key suffixes
+    Nodes::Header* root = Nodes::makeNewRoot();
+    std::set<std::string> keys;
+    const std::string base = "https://example.com/a/rather/long/shared/path/";
+    std::mt19937 gen(37);
+    for (int i = 0; i < 2000; ++i) {
+      std::string key = base + std::to_string(gen() % 5000);
+      keys.insert(key);
+      Actions::insert(root, (const uint8_t*)key.data(), key.size(), i);
+    }
+    // only the first leaf was made before the shared prefix was known
+    size_t whole_keys = 0;
+    for (const std::string& key : keys) {
+      Nodes::Leaf* leaf =
+          Actions::searchLeaf(root, (const uint8_t*)key.data(), key.size());
+      assert(leaf != nullptr && leaf->key_len == key.size());
+      if (Nodes::storedKeyLen(leaf) > key.size() - base.size()) {
+        ++whole_keys;
+      }
+    }
+    assert(whole_keys <= 1);
+
+    // remove keys until nodes collapse, leaves moving up keep their key
+    auto it = keys.begin();
+    while (it != keys.end()) {
+      if (gen() % 4 != 0) {
+        assert(Actions::remove(root, (const uint8_t*)it->data(), it->size()));
+        it = keys.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    const uint8_t* out;
+    size_t out_len;
+    Nodes::Value value;
+    std::vector<std::string> found;
+    bool more = Actions::minimum(root, out, out_len, value);
+    while (more) {
+      found.push_back(std::string((const char*)out, out_len));
+      more = Actions::upperBound(root, (const uint8_t*)found.back().data(),
+                                 found.back().size(), out, out_len, value);
+    }
+    assert(found == std::vector<std::string>(keys.begin(), keys.end()));
+    assert(Actions::maximum(root, out, out_len, value));
+    assert(std::string((const char*)out, out_len) == *keys.rbegin());
+
+    std::set<std::string> scanned;
+    std::mutex scanned_mutex;
+    Parallel::scan(root, 2, [&](size_t, KEY, Nodes::Value) {
+      std::lock_guard<std::mutex> guard(scanned_mutex);
+      scanned.insert(std::string((const char*)key, key_len));
+    });
+    assert(scanned == keys);
+
+    Nodes::freeRecursive(root);
+  }
+#endif
 }